@@ -33,6 +33,41 @@ void redirect_home(hus::Request& req, hus::Response& resp) {
     resp.headers["Location"] = "/";
 }
 
+// middleware: logged in users are sent home instead of to the login pages
+bool logged_out_only(hus::Request& req, hus::Response& resp) {
+    if (hus::read_session(req.session_id, "username") != "") {
+        redirect_home(req, resp);
+        return false;
+    }
+    return true;
+}
+
+// middleware: logged out users are sent to the login page
+bool login_required(hus::Request& req, hus::Response& resp) {
+    if (hus::read_session(req.session_id, "username") == "") {
+        resp.code = "302";
+        resp.headers["Location"] = "/login?message=Log+in+to+upload+content";
+        return false;
+    }
+    return true;
+}
+
+// middleware: logged out users are refused
+bool logged_in_only(hus::Request& req, hus::Response& resp) {
+    if (hus::read_session(req.session_id, "username") == "") {
+        resp.code = "401";
+        resp.body = "<h1>401: Unauthorized</h1>";
+        return false;
+    }
+    return true;
+}
+
+// middleware: added to every response
+void security_headers(hus::Request& req, hus::Response& resp) {
+    resp.headers["X-Content-Type-Options"] = "nosniff";
+    resp.headers["X-Frame-Options"] = "DENY";
+}
+
 void home(hus::Request& req, hus::Response& resp) {
     if (hus::read_session(req.session_id, "username") != "") {
         resp.body = "<h1>Welcome to the website, <b>" + hus::html_escape(hus::read_session(req.session_id, "username")) + "</b>!</h1><br>"
@@ -46,11 +81,6 @@ void home(hus::Request& req, hus::Response& resp) {
 }
 
 void login_page(hus::Request& req, hus::Response& resp) {
-    if (hus::read_session(req.session_id, "username") != "") {
-        redirect_home(req, resp);
-        return;
-    }
-
     resp.body = R"(
 <form action="/login" method="post">
 <label for="name">Username: </label>
@@ -67,11 +97,6 @@ void login_page(hus::Request& req, hus::Response& resp) {
 }
 
 void login(hus::Request& req, hus::Response& resp) {
-    if (hus::read_session(req.session_id, "username") != "") {
-        redirect_home(req, resp);
-        return;
-    }
-
     // Checking if post parameters exist
     if (req.post.find("username") == req.post.end()) goto login_redirect;
     if (req.post.find("password") == req.post.end()) goto login_redirect;
@@ -103,12 +128,6 @@ void logout(hus::Request& req, hus::Response& resp) {
 }
 
 void upload_page(hus::Request& req, hus::Response& resp) {
-    if (hus::read_session(req.session_id, "username") == "") {
-        resp.code = "302";
-        resp.headers["Location"] = "/login?message=Log+in+to+upload+content";
-        return;
-    }
-
     resp.body = R"(
 <script>
 function upload() {
@@ -132,7 +151,9 @@ function upload() {
     };
 
     let formData = new FormData;
-    formData.append('file', files[0]);
+    for (let file of files) {
+        formData.append('file', file);
+    }
 
     ajax.open("PUT", "/upload", true);
     ajax.send(formData);
@@ -140,7 +161,7 @@ function upload() {
 </script>
 <form action="/upload" method="POST">
 <label for="file">File: </label>
-<input type="file" id="file" name="file" required><br>
+<input type="file" id="file" name="file" multiple required><br>
 <input type="button" value="Submit" onclick=upload()>
 </form>
 <div id="response"></div>
@@ -153,21 +174,14 @@ function upload() {
 }
 
 void upload(hus::Request& req, hus::Response& resp) {
-    if (hus::read_session(req.session_id, "username") == "") {
-        resp.code = "401";
-        resp.body = "<h1>401: Unauthorized</h1>";
-        return;
-    }
-
     std::ostringstream oss;
-    oss << "<h1>Uploaded File:</h1><br>\n";
+    oss << "<h1>Uploaded Files:</h1><br>\n";
     for (auto& [key, file] : req.files) {
         oss << "<h2>" << hus::html_escape(file.id) << ": " << hus::html_escape(file.name) << "</h2><br>\n";
         oss << "<p>mime: " << hus::html_escape(file.mime) << "</p><br>\n";
         //oss << "<pre>" << hus::html_escape(file.data) << "</pre>";
         std::filesystem::path filename(file.name);
-        std::ofstream outfile("upload/"+filename.filename().string(), std::ios::binary);
-        outfile << file.data;
+        file.save("upload/"+filename.filename().string());
         hus::print_lock.lock();
             std::cout << "File uploaded: " << filename.filename() << std::endl;
         hus::print_lock.unlock();
@@ -200,14 +214,21 @@ int main(int argc, char* argv[]) {
     // set config.private_key and config.certificate to "" for no ssl
     hus::Hussar s(config);
 
+    // register middleware run around every route
+    s.use(nullptr, &security_headers);
+
     // register routes
     s.fallback(&four_oh_four);       // fallback route is everything other than registered routes
     s.get("/", &home);
-    s.get("/login", &login_page);
-    s.post("/login", &login);
+    s.get("/login", &login_page, {
+        .middleware = {&logged_out_only},
+        .cache = {.ttl = std::chrono::seconds(10), .query = {"message"}}, // page only varies by ?message=
+    });
+    s.post("/login", &login, {.middleware = {&logged_out_only}});
     s.get("/logout", &logout);
-    s.get("/upload", &upload_page);
-    s.alt("PUT", "/upload", &upload);
+    s.get("/upload", &upload_page, {.middleware = {&login_required}});
+    s.alt("PUT", "/upload", &upload, {.middleware = {&logged_in_only}});
+    s.freeze();                      // no more routes, dispatch from read-only tables
 
     // BLOCKING listen for the server
     // perhaps put in a thread for non-blocking style behaviour so
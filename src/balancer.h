@@ -0,0 +1,464 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <sys/epoll.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+
+#include "libs.h"
+#include "loop.h"
+#include "proxy.h"
+
+#define HEALTH_MAX_RESPONSE 1024    // bytes of a health check response read for its status line
+#define EJECTION_MAX_FACTOR 8       // longest ejection, in multiples of the base time
+
+namespace hussar {
+    /**
+     * how an UpstreamGroup picks the upstream for a request
+     */
+    enum class Balance {
+        ROUND_ROBIN,
+        LEAST_OUTSTANDING,  // fewest requests in flight, body streaming included
+        POWER_OF_TWO        // the less busy of two picked at random
+    };
+
+    /**
+     * periodic requests to every upstream of a group, an empty path turns them off
+     */
+    struct HealthCheck {
+        std::string path;                           // GET target, 2xx and 3xx answers pass
+        std::chrono::milliseconds interval{5000};
+        std::chrono::milliseconds timeout{2000};
+        unsigned unhealthy = 3;                     // failed checks in a row that take an upstream out
+        unsigned healthy = 2;                       // passed checks in a row that bring it back
+    };
+
+    /**
+     * passive ejection of upstreams, judged by the requests sent to them.
+     * an ejected upstream gets no requests for base_time, times the number
+     * of ejections in a row up to EJECTION_MAX_FACTOR
+     */
+    struct Ejection {
+        unsigned errors = 5;                        // failed or 5xx responses in a row, 0 turns it off
+        double latency_factor = 3;                  // average latency over this multiple of the group's, 0 turns it off
+        std::chrono::milliseconds min_latency{50};  // averages under this are never slow enough to eject
+        std::chrono::milliseconds base_time{10000};
+        unsigned max_percent = 50;                  // most of the group that may be ejected at once
+    };
+
+    struct BalanceOptions {
+        Balance policy = Balance::ROUND_ROBIN;
+        HealthCheck health;
+        Ejection ejection;
+        UpstreamOptions upstream;                   // for every upstream of the group
+    };
+
+    /**
+     * several upstreams serving the same application, each request goes to
+     * one of them picked by the group's Balance policy.
+     *
+     * picking reads only atomics, so requests never wait on each other to be
+     * balanced. the state they read is written by the requests as they finish
+     * and by the health checks, which run on the io loop without blocking it.
+     * an upstream is left out while it fails its health checks or is ejected
+     * for its errors or latency. if every upstream is left out they are all
+     * tried anyway, a guess is better than a certain 503.
+     *
+     * the members live in state shared with the health checks and the
+     * requests still streaming a body, so the group may be destroyed while
+     * either is under way. the checks stop once it is, a probe already
+     * sent keeps the state until it finishes
+     */
+    class UpstreamGroup {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct Member {
+            Upstream upstream;
+            std::atomic<uint32_t> outstanding{0};
+            std::atomic<bool> healthy{true};
+            std::atomic<int64_t> ejected_until{0};  // clock ticks
+            std::atomic<uint32_t> ejections{0};     // in a row, sets how long the next one lasts
+            std::atomic<uint32_t> errors{0};        // in a row
+            std::atomic<int64_t> latency{0};        // moving average in microseconds, 0 until measured
+            unsigned passes = 0;                    // health checks in a row, loop thread only
+            unsigned fails = 0;
+
+            Member(const std::string& address, const UpstreamOptions& options)
+                : upstream(address, options)
+            {}
+        };
+
+        struct State {
+            std::vector<std::unique_ptr<Member>> members;
+            BalanceOptions options;
+            std::atomic<uint64_t> next{0};
+            std::atomic<bool> stopped{false};   // the group was destroyed, no more health checks
+        };
+
+        /**
+         * a request in flight to a member, counted until the last of its
+         * response body is sent
+         */
+        struct InFlight {
+            std::shared_ptr<State> state;
+            Member& member;
+
+            InFlight(std::shared_ptr<State> state, Member& member)
+                : state(std::move(state)), member(member)
+            {
+                this->member.outstanding.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            ~InFlight()
+            {
+                this->member.outstanding.fetch_sub(1, std::memory_order_relaxed);
+            }
+        };
+
+        /**
+         * one health check, a GET sent over a non-blocking socket watched by the loop
+         */
+        struct Probe : std::enable_shared_from_this<Probe> {
+            std::shared_ptr<State> state;
+            Member& member;
+            int fd = -1;
+            bool sent = false;
+            bool done = false;
+            std::string response;
+
+            Probe(std::shared_ptr<State> state, Member& member)
+                : state(std::move(state)), member(member)
+            {}
+
+            void start()
+            {
+                bool connecting;
+                this->fd = this->member.upstream.connect_start(connecting);
+                std::shared_ptr<Probe> self = this->shared_from_this();
+                if (this->fd < 0 || not io_loop.attach(this->fd, EPOLLOUT, [self](uint32_t events) { self->on_events(events); })) {
+                    this->finish(false);
+                    return;
+                }
+                io_loop.after(this->state->options.health.timeout, [self] {
+                    self->finish(false);
+                });
+            }
+
+            void on_events(uint32_t events)
+            {
+                if (this->done) return;
+                if (not this->sent) {
+                    int error = 0;
+                    socklen_t length = sizeof(error);
+                    if ((events & EPOLLERR) || getsockopt(this->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+                        this->finish(false);
+                        return;
+                    }
+
+                    // the request is small enough for an empty socket buffer
+                    std::string request = "GET " + this->state->options.health.path + " HTTP/1.1\r\nHost: " +
+                        this->member.upstream.host_header() + "\r\nConnection: close\r\n\r\n";
+                    if (::send(this->fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+                        this->finish(false);
+                        return;
+                    }
+                    this->sent = true;
+                    io_loop.rearm(this->fd, EPOLLIN);
+                    return;
+                }
+
+                char buf[HEALTH_MAX_RESPONSE];
+                ssize_t status = recv(this->fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if (status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+                if (status > 0) this->response.append(buf, status);
+
+                size_t end = this->response.find("\r\n");
+                if (end != std::string::npos || status <= 0 || this->response.size() >= HEALTH_MAX_RESPONSE) {
+                    std::string_view line = std::string_view(this->response).substr(0, end);
+                    int code = line.starts_with("HTTP/1.") && line.size() >= 12 ? status_number(line.substr(9, 3)) : -1;
+                    this->finish(code >= 200 && code < 400);
+                }
+            }
+
+            void finish(bool passed)
+            {
+                if (this->done) return;
+                this->done = true;
+                if (this->fd >= 0) {
+                    io_loop.detach(this->fd);
+                    ::close(this->fd);
+                    this->fd = -1;
+                }
+                checked(*this->state, this->member, passed);
+            }
+        };
+
+        std::shared_ptr<State> state;
+
+        static int64_t now()
+        {
+            return clock::now().time_since_epoch().count();
+        }
+
+        bool available(const Member& m, int64_t at) const
+        {
+            return m.healthy.load(std::memory_order_relaxed) && m.ejected_until.load(std::memory_order_relaxed) <= at;
+        }
+
+        // the member for a request, with every member available when all are left out
+        Member& pick()
+        {
+            int64_t at = now();
+            size_t count = this->state->members.size();
+            uint64_t start = this->state->next.fetch_add(1, std::memory_order_relaxed);
+
+            for (int pass = 0; pass < 2; ++pass) {
+                bool all = pass == 1;
+                auto usable = [&](const Member& m) {
+                    return all || this->available(m, at);
+                };
+
+                if (this->state->options.policy == Balance::POWER_OF_TWO && count > 1) {
+                    thread_local std::mt19937_64 random{std::random_device{}()};
+                    size_t a = random() % count;
+                    size_t b = (a + 1 + random() % (count - 1)) % count;
+                    Member& first = *this->state->members[a];
+                    Member& second = *this->state->members[b];
+                    bool first_ok = usable(first);
+                    bool second_ok = usable(second);
+                    if (first_ok && second_ok) {
+                        return first.outstanding.load(std::memory_order_relaxed) <= second.outstanding.load(std::memory_order_relaxed) ? first : second;
+                    }
+                    if (first_ok) return first;
+                    if (second_ok) return second;
+                    // both were out, any other member will do
+                }
+
+                if (this->state->options.policy == Balance::LEAST_OUTSTANDING) {
+                    // the scan starts at a different member each time, so ties are spread out
+                    Member* best = nullptr;
+                    uint32_t fewest = UINT32_MAX;
+                    for (size_t n = 0; n < count; ++n) {
+                        Member& m = *this->state->members[(start + n) % count];
+                        uint32_t outstanding = m.outstanding.load(std::memory_order_relaxed);
+                        if (usable(m) && outstanding < fewest) {
+                            best = &m;
+                            fewest = outstanding;
+                        }
+                    }
+                    if (best) return *best;
+                    continue;
+                }
+
+                for (size_t n = 0; n < count; ++n) {
+                    Member& m = *this->state->members[(start + n) % count];
+                    if (usable(m)) return m;
+                }
+            }
+            return *this->state->members[start % count];
+        }
+
+        // ejects a member unless too much of the group already is
+        void eject(Member& m, int64_t at)
+        {
+            size_t ejected = 0;
+            for (auto& other : this->state->members) {
+                if (other->ejected_until.load(std::memory_order_relaxed) > at) ++ejected;
+            }
+            if ((ejected + 1) * 100 > this->state->options.ejection.max_percent * this->state->members.size()) return;
+
+            uint32_t times = std::min<uint32_t>(m.ejections.fetch_add(1, std::memory_order_relaxed) + 1, EJECTION_MAX_FACTOR);
+            auto duration = std::chrono::duration_cast<clock::duration>(this->state->options.ejection.base_time * times);
+            m.ejected_until.store(at + duration.count(), std::memory_order_relaxed);
+            m.errors.store(0, std::memory_order_relaxed);
+            // the average starts over when it comes back, the old one is what got it ejected
+            m.latency.store(0, std::memory_order_relaxed);
+        }
+
+        // records how a request to the member went
+        void report(Member& m, bool failed, clock::duration took)
+        {
+            const Ejection& ejection = this->state->options.ejection;
+            int64_t at = now();
+
+            if (failed) {
+                uint32_t errors = m.errors.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (ejection.errors && errors >= ejection.errors) this->eject(m, at);
+                return;
+            }
+            m.errors.store(0, std::memory_order_relaxed);
+
+            // a clean run as long as its last ejection lasted forgives it
+            int64_t until = m.ejected_until.load(std::memory_order_relaxed);
+            if (until && at > until + std::chrono::duration_cast<clock::duration>(ejection.base_time).count()) {
+                m.ejections.store(0, std::memory_order_relaxed);
+            }
+
+            // moving average, a new sample weighs an eighth
+            int64_t sample = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+            int64_t average = m.latency.load(std::memory_order_relaxed);
+            int64_t updated;
+            do {
+                updated = average ? average + (sample - average) / 8 : sample;
+            } while (not m.latency.compare_exchange_weak(average, updated, std::memory_order_relaxed));
+
+            if (ejection.latency_factor <= 0 || updated < std::chrono::duration_cast<std::chrono::microseconds>(ejection.min_latency).count()) return;
+
+            // compared to the average of the rest of the group that is serving
+            int64_t total = 0;
+            size_t measured = 0;
+            for (auto& other : this->state->members) {
+                int64_t latency = other->latency.load(std::memory_order_relaxed);
+                if (other.get() != &m && latency && this->available(*other, at)) {
+                    total += latency;
+                    ++measured;
+                }
+            }
+            if (measured && updated > ejection.latency_factor * (total / measured)) this->eject(m, at);
+        }
+
+        // records a health check, on the loop thread
+        static void checked(State& state, Member& m, bool passed)
+        {
+            const HealthCheck& health = state.options.health;
+            if (passed) {
+                m.fails = 0;
+                if (++m.passes >= health.healthy) m.healthy.store(true, std::memory_order_relaxed);
+            } else {
+                m.passes = 0;
+                if (++m.fails >= health.unhealthy) m.healthy.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        // starts a round of health checks and schedules the next, for as long as the group lives
+        static void check(const std::shared_ptr<State>& state)
+        {
+            if (state->stopped.load(std::memory_order_relaxed)) return;
+            for (auto& m : state->members) {
+                std::make_shared<Probe>(state, *m)->start();
+            }
+            io_loop.after(state->options.health.interval, [weak = std::weak_ptr<State>(state)] {
+                if (std::shared_ptr<State> state = weak.lock()) check(state);
+            });
+        }
+
+    public:
+        UpstreamGroup(const std::vector<std::string>& addresses, BalanceOptions options = {})
+            : state(std::make_shared<State>())
+        {
+            if (addresses.empty()) {
+                fatal_error("ERROR upstream group without upstreams");
+            }
+            this->state->options = std::move(options);
+            for (const std::string& address : addresses) {
+                this->state->members.push_back(std::make_unique<Member>(address, this->state->options.upstream));
+            }
+
+            if (not this->state->options.health.path.empty()) {
+                io_loop.post([weak = std::weak_ptr<State>(this->state)] {
+                    if (std::shared_ptr<State> state = weak.lock()) check(state);
+                });
+            }
+        }
+
+        ~UpstreamGroup()
+        {
+            this->state->stopped.store(true, std::memory_order_relaxed);
+        }
+
+        // delete copy constructors
+        UpstreamGroup(UpstreamGroup& g) = delete;
+        UpstreamGroup(const UpstreamGroup& g) = delete;
+        UpstreamGroup& operator=(UpstreamGroup& g) = delete;
+        UpstreamGroup& operator=(const UpstreamGroup& g) = delete;
+
+        /**
+         * forwards the request to an upstream of the group, see proxy_request().
+         * a request that failed to reach it is sent once more to another, if
+         * it can be sent again without any of it being lost
+         */
+        bool forward(Request& req, Response& resp)
+        {
+            bool whole_body = not req.body_source || (not req.chunked() && req.declared_length().value_or(0) <= req.body.size());
+            bool retry = idempotent(req.method_id) && whole_body && this->state->members.size() > 1;
+
+            Member* tried = nullptr;
+            while (true) {
+                Member* m = &this->pick();
+                // a second pick of the same member gets the one after it
+                if (m == tried) {
+                    for (size_t n = 0; n < this->state->members.size(); ++n) {
+                        if (this->state->members[n].get() == m) {
+                            m = this->state->members[(n + 1) % this->state->members.size()].get();
+                            break;
+                        }
+                    }
+                }
+
+                auto in_flight = std::make_shared<InFlight>(this->state, *m);
+                auto started = clock::now();
+                bool reached = proxy_request(m->upstream, req, resp);
+                this->report(*m, not reached || resp.code.starts_with('5'), clock::now() - started);
+
+                // a streamed body keeps the request in flight until it's sent
+                if (resp.streaming()) {
+                    resp.streamer = [in_flight, producer = std::move(resp.streamer)](ResponseWriter& w) {
+                        producer(w);
+                    };
+                }
+
+                if (reached || not retry || tried || resp.code != "502") return reached;
+                tried = m;
+                resp.body.clear();
+            }
+        }
+
+        size_t size() const
+        {
+            return this->state->members.size();
+        }
+
+        /**
+         * upstreams currently passing their health checks and not ejected
+         */
+        size_t available() const
+        {
+            int64_t at = now();
+            size_t count = 0;
+            for (auto& m : this->state->members) {
+                if (this->available(*m, at)) ++count;
+            }
+            return count;
+        }
+    };
+
+    /**
+     * route handler spreading requests over the upstreams of a group, see
+     * proxy(Upstream&)
+     */
+    std::function<void (Request&, Response&)> proxy(UpstreamGroup& group)
+    {
+        return [&group](Request& req, Response& resp) {
+            group.forward(req, resp);
+        };
+    }
+};
@@ -0,0 +1,329 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+
+#include "libs.h"
+
+#define UPLOAD_READ_CHUNK 65536     // bytes of a request body read at a time
+#define CHUNKED_MAX_LINE 8192       // bytes of chunk extensions or trailers allowed
+
+namespace hussar {
+    /**
+     * the outcome of reading a request body
+     */
+    enum class BodyStatus {
+        READ,
+        REJECTED,   // an error response was filled in, the rest of the body is unread
+        FAILED      // the connection failed
+    };
+
+    /**
+     * incremental decoder for the chunked transfer coding.
+     *
+     * data is decoded in place, the chunk framing is dropped and the chunk
+     * contents are moved to the front of the buffer, so decoding never copies
+     * the body anywhere else. chunk extensions and trailers are skipped.
+     */
+    class ChunkedDecoder {
+    private:
+        enum class State {
+            SIZE,
+            EXTENSION,
+            SIZE_LF,
+            DATA,
+            DATA_CR,
+            DATA_LF,
+            TRAILER,        // at the start of a trailer line, or the final CRLF
+            TRAILER_LINE,
+            END_LF,
+            DONE,
+            FAILED
+        };
+
+        State state = State::SIZE;
+        uint64_t remaining = 0;     // bytes left in the current chunk
+        size_t digits = 0;
+        size_t line = 0;            // bytes of extensions and trailers seen
+
+        static int hex_value(char c)
+        {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+    public:
+        /**
+         * decodes size bytes at data in place, the decoded bytes end up at the
+         * front and their count is stored in produced. returns the bytes
+         * consumed, which is less than size only when the body ended early
+         */
+        size_t decode(char* data, size_t size, size_t& produced)
+        {
+            produced = 0;
+            size_t n = 0;
+
+            while (n < size && this->state != State::DONE && this->state != State::FAILED) {
+                char c = data[n];
+                switch (this->state) {
+                    case State::SIZE: {
+                        int value = hex_value(c);
+                        if (value >= 0) {
+                            // 15 hex digits keeps the size from overflowing
+                            if (++this->digits > 15) this->state = State::FAILED;
+                            this->remaining = this->remaining * 16 + value;
+                            ++n;
+                        } else if (this->digits == 0) {
+                            this->state = State::FAILED;
+                        } else if (c == ';' || c == ' ' || c == '\t') {
+                            this->state = State::EXTENSION;
+                            ++n;
+                        } else if (c == '\r') {
+                            this->state = State::SIZE_LF;
+                            ++n;
+                        } else {
+                            this->state = State::FAILED;
+                        }
+                        break;
+                    }
+                    case State::EXTENSION:
+                        if (++this->line > CHUNKED_MAX_LINE || c == '\n') {
+                            this->state = State::FAILED;
+                        } else {
+                            if (c == '\r') this->state = State::SIZE_LF;
+                            ++n;
+                        }
+                        break;
+                    case State::SIZE_LF:
+                        if (c != '\n') {
+                            this->state = State::FAILED;
+                            break;
+                        }
+                        ++n;
+                        this->digits = 0;
+                        this->state = this->remaining ? State::DATA : State::TRAILER;
+                        break;
+                    case State::DATA: {
+                        size_t take = std::min<uint64_t>(this->remaining, size - n);
+                        std::memmove(data + produced, data + n, take);
+                        produced += take;
+                        n += take;
+                        this->remaining -= take;
+                        if (this->remaining == 0) this->state = State::DATA_CR;
+                        break;
+                    }
+                    case State::DATA_CR:
+                        this->state = c == '\r' ? State::DATA_LF : State::FAILED;
+                        ++n;
+                        break;
+                    case State::DATA_LF:
+                        this->state = c == '\n' ? State::SIZE : State::FAILED;
+                        ++n;
+                        break;
+                    case State::TRAILER:
+                        if (c == '\r') {
+                            this->state = State::END_LF;
+                            ++n;
+                        } else {
+                            this->state = State::TRAILER_LINE;
+                        }
+                        break;
+                    case State::TRAILER_LINE:
+                        if (++this->line > CHUNKED_MAX_LINE) {
+                            this->state = State::FAILED;
+                            break;
+                        }
+                        if (c == '\n') this->state = State::TRAILER;
+                        ++n;
+                        break;
+                    case State::END_LF:
+                        this->state = c == '\n' ? State::DONE : State::FAILED;
+                        ++n;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return n;
+        }
+
+        bool done() const
+        {
+            return this->state == State::DONE;
+        }
+
+        bool failed() const
+        {
+            return this->state == State::FAILED;
+        }
+    };
+
+    /**
+     * reads a request body off a connection, framed by Content-Length or the
+     * chunked transfer coding. it stops at the end of the body, bytes of the
+     * next request read along with it are appended to leftover.
+     *
+     * a body that isn't on the socket, like an HTTP/2 stream's, is pulled
+     * from a source instead. the source frames it, so it may come without
+     * a length and end when the source returns 0.
+     */
+    class BodyReader {
+    public:
+        using source = std::function<ssize_t (char* dst, size_t count)>;
+
+    private:
+        int client;
+        SSL* ssl;
+        source pull;            // where the body comes from instead of the socket, if set
+        bool chunked;
+        bool open_ended;        // no length, the body ends where the source's does
+        ChunkedDecoder decoder;
+        uint64_t length;        // Content-Length, unused for chunked bodies
+        uint64_t received;      // body bytes produced so far
+        std::unique_ptr<char[]> buf;
+        std::string spare;      // leftover of a source, which never has any
+        std::string& leftover;  // bytes read past the end of the body
+
+        ssize_t read_socket(char* dst, size_t count)
+        {
+            if (this->pull) return this->pull(dst, count);
+            if (this->ssl) return SSL_read(this->ssl, dst, count);
+            while (true) {
+                ssize_t status = read(this->client, dst, count);
+                if (status >= 0 || errno != EINTR) return status;
+            }
+        }
+
+    public:
+        BodyReader(int client, SSL* ssl, std::string& leftover, bool chunked, uint64_t length)
+            : client(client), ssl(ssl), chunked(chunked), open_ended(false), length(length), received(0),
+              buf(new char[UPLOAD_READ_CHUNK]), leftover(leftover)
+        {}
+
+        /**
+         * a body pulled from source, which returns how many bytes it wrote,
+         * 0 at the end of the body and -1 if it failed. a body with a length
+         * ending short of it is a failure
+         */
+        BodyReader(source pull, std::optional<uint64_t> length)
+            : client(-1), ssl(nullptr), pull(std::move(pull)), chunked(false), open_ended(not length), length(length.value_or(0)), received(0),
+              buf(new char[UPLOAD_READ_CHUNK]), leftover(this->spare)
+        {}
+
+        // delete copy constructors
+        BodyReader(BodyReader& b) = delete;
+        BodyReader(const BodyReader& b) = delete;
+        BodyReader& operator=(BodyReader& b) = delete;
+        BodyReader& operator=(const BodyReader& b) = delete;
+
+        /**
+         * takes the bytes that arrived along with the head, they are cut to
+         * the body and decoded in place. returns false if they are malformed
+         */
+        bool start(std::string& initial)
+        {
+            if (not this->chunked) {
+                if (not this->open_ended && initial.size() > this->length) {
+                    this->leftover.assign(initial, this->length);
+                    initial.resize(this->length);
+                }
+                this->received = initial.size();
+                return true;
+            }
+
+            size_t produced;
+            size_t used = this->decoder.decode(initial.data(), initial.size(), produced);
+            if (this->decoder.done()) this->leftover.assign(initial, used);
+            initial.resize(produced);
+            this->received = produced;
+            return not this->decoder.failed();
+        }
+
+        /**
+         * reads the next piece of the body, piece stays valid until the next
+         * call. returns its size, 0 at the end of the body, -1 if the
+         * connection failed and -2 if the chunked framing is malformed
+         */
+        ssize_t next(std::string_view& piece)
+        {
+            while (true) {
+                if (not this->chunked) {
+                    if (not this->open_ended && this->received >= this->length) return 0;
+                    uint64_t want = this->open_ended ? UPLOAD_READ_CHUNK : std::min<uint64_t>(UPLOAD_READ_CHUNK, this->length - this->received);
+                    ssize_t status = this->read_socket(this->buf.get(), want);
+                    if (status == 0 && this->open_ended) return 0;
+                    if (status <= 0) return -1;
+                    this->received += status;
+                    piece = std::string_view(this->buf.get(), status);
+                    return status;
+                }
+
+                if (this->decoder.done()) return 0;
+                ssize_t status = this->read_socket(this->buf.get(), UPLOAD_READ_CHUNK);
+                if (status <= 0) return -1;
+
+                size_t produced;
+                size_t used = this->decoder.decode(this->buf.get(), status, produced);
+                if (this->decoder.failed()) return -2;
+                if (this->decoder.done()) this->leftover.append(this->buf.get() + used, status - used);
+
+                this->received += produced;
+                if (produced) {
+                    piece = std::string_view(this->buf.get(), produced);
+                    return produced;
+                }
+            }
+        }
+
+        /**
+         * bytes still to come of a Content-Length body, for reading it some
+         * other way. always 0 for bodies without a length
+         */
+        uint64_t remaining() const
+        {
+            return this->sized() ? this->length - this->received : 0;
+        }
+
+        /**
+         * counts body bytes read some other way
+         */
+        void consumed(uint64_t count)
+        {
+            this->received += count;
+        }
+
+        /**
+         * body bytes read so far
+         */
+        uint64_t size() const
+        {
+            return this->received;
+        }
+
+        /**
+         * whether the length of the body was known before it was read
+         */
+        bool sized() const
+        {
+            return not this->chunked && not this->open_ended;
+        }
+    };
+};
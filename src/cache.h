@@ -0,0 +1,232 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+
+#include "libs.h"
+#include "request.h"
+#include "response.h"
+
+namespace hussar {
+    /**
+     * options for caching a route's responses, a zero ttl disables the cache
+     */
+    struct CacheOptions {
+        std::chrono::milliseconds ttl{0};
+        size_t max_bytes = 4'000'000;       // memory cap for the route's cached responses
+        std::vector<std::string> query;     // GET parameters that select the cached response
+        std::vector<std::string> headers;   // request headers that select the cached response
+        std::chrono::milliseconds max_wait{5000}; // longest a request waits for another to generate
+    };
+
+    /**
+     * per route cache of serialized responses.
+     *
+     * only one request generates a missing or expired entry at a time, while it
+     * runs the others are served the stale entry, or wait for the first one.
+     * entries are the response's serialized headers and body, so a hit only
+     * writes the status line and per request headers in front of them.
+     */
+    class ResponseCache {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct Entry {
+            std::shared_ptr<const std::string> bytes; // null until first generated
+            clock::time_point expires;
+            bool generating = false;
+            bool uncacheable = false;                 // last response couldn't be cached
+            std::list<std::string>::iterator lru;
+        };
+
+        CacheOptions options;
+        std::mutex mtx;
+        std::condition_variable generated;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru; // least recently used entry at the back
+        size_t bytes;               // size of every key and cached response
+
+        // drops least recently used entries until extra bytes fit
+        void evict(size_t extra)
+        {
+            auto n = this->lru.end();
+            while (this->bytes + extra > this->options.max_bytes && n != this->lru.begin()) {
+                --n;
+                auto found = this->entries.find(*n);
+                if (found->second.generating) continue;
+
+                this->bytes -= n->size();
+                if (found->second.bytes) this->bytes -= found->second.bytes->size();
+                this->entries.erase(found);
+                n = this->lru.erase(n);
+            }
+        }
+
+        void touch(Entry& e)
+        {
+            this->lru.splice(this->lru.begin(), this->lru, e.lru);
+        }
+
+    public:
+        ResponseCache(CacheOptions options)
+            : options(std::move(options)), bytes(0)
+        {}
+
+        // delete copy constructors
+        ResponseCache(ResponseCache& c) = delete;
+        ResponseCache(const ResponseCache& c) = delete;
+        ResponseCache& operator=(ResponseCache& c) = delete;
+        ResponseCache& operator=(const ResponseCache& c) = delete;
+
+        /**
+         * builds the cache key for a request from its path and the selected
+         * query parameters and headers
+         */
+        std::string key(Request& req) const
+        {
+            std::string key = req.document;
+            for (const std::string& name : this->options.query) {
+                key += '\n';
+                auto param = req.get.find(name);
+                if (param != req.get.end()) key += param->second;
+            }
+            for (const std::string& name : this->options.headers) {
+                key += '\n';
+                key += req.header(name);
+            }
+            return key;
+        }
+
+        /**
+         * looks up the response for key.
+         *
+         * on a hit resp.prebuilt is set and true is returned. otherwise the
+         * caller has to generate the response, and if generating is set, pass
+         * it to store() afterwards so waiting requests are released, or call
+         * abandon() if generating it failed.
+         */
+        bool lookup(const std::string& key, Response& resp, bool& generating)
+        {
+            std::unique_lock<std::mutex> lock(this->mtx);
+            auto deadline = clock::now() + this->options.max_wait;
+            generating = false;
+
+            while (true) {
+                auto found = this->entries.find(key);
+                if (found == this->entries.end()) {
+                    // first request for the key generates it
+                    this->evict(key.size());
+                    this->bytes += key.size();
+                    Entry& e = this->entries[key];
+                    e.generating = true;
+                    this->lru.push_front(key);
+                    e.lru = this->lru.begin();
+                    generating = true;
+                    return false;
+                }
+
+                Entry& e = found->second;
+                auto now = clock::now();
+
+                if (e.uncacheable) {
+                    if (now < e.expires || e.generating) return false;
+                    e.uncacheable = false;
+                    e.generating = true;
+                    generating = true;
+                    return false;
+                }
+
+                if (e.bytes) {
+                    // fresh entries, and stale ones while another request regenerates them
+                    if (now < e.expires || e.generating) {
+                        this->touch(e);
+                        resp.prebuilt = e.bytes;
+                        return true;
+                    }
+                    e.generating = true;
+                    generating = true;
+                    return false;
+                }
+
+                // another request is generating the first copy, wait for it
+                if (this->generated.wait_until(lock, deadline) == std::cv_status::timeout) {
+                    return false;
+                }
+            }
+        }
+
+        /**
+         * stores the generated response for key, or remembers that it can't be
+         * cached so requests for it stop waiting on each other until the ttl passes.
+         * only 200 responses with an in memory body and without their own cookies are cached
+         */
+        void store(const std::string& key, Response& resp)
+        {
+            std::shared_ptr<const std::string> bytes;
+            if (resp.code == "200" && not resp.sets_cookies() && not resp.prebuilt && not resp.streaming() && not resp.file && resp.parts.empty()) {
+                bytes = resp.snapshot();
+                if (bytes->size() > this->options.max_bytes) bytes.reset();
+            }
+
+            std::lock_guard<std::mutex> lock(this->mtx);
+            auto found = this->entries.find(key);
+            if (found != this->entries.end()) {
+                Entry& e = found->second;
+                if (e.bytes) this->bytes -= e.bytes->size();
+                e.bytes.reset();
+                if (bytes) this->evict(bytes->size());
+
+                e.generating = false;
+                e.expires = clock::now() + this->options.ttl;
+
+                if (bytes) {
+                    this->bytes += bytes->size();
+                    e.bytes = std::move(bytes);
+                    e.uncacheable = false;
+                } else {
+                    e.uncacheable = true;
+                }
+            }
+            this->generated.notify_all();
+        }
+
+        /**
+         * releases key after its handler failed, so other requests stop waiting
+         * on it. a stale entry keeps being served until a request regenerates
+         * it, a first copy is dropped for the next request to generate
+         */
+        void abandon(const std::string& key)
+        {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            auto found = this->entries.find(key);
+            if (found != this->entries.end()) {
+                Entry& e = found->second;
+                e.generating = false;
+                if (not e.bytes && not e.uncacheable) {
+                    this->bytes -= found->first.size();
+                    this->lru.erase(e.lru);
+                    this->entries.erase(found);
+                }
+            }
+            this->generated.notify_all();
+        }
+    };
+};
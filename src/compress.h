@@ -0,0 +1,178 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <zlib.h>           // gzip
+#include <list>
+#include <optional>
+
+#include "libs.h"
+#include "output.h"
+
+#define GZIP_LEVEL 6
+#define GZIP_MAX_FILE 4'000'000     // larger files aren't compressed on the fly
+#define GZIP_CACHE_BYTES 16'000'000
+
+namespace hussar {
+    /**
+     * returns true for mime types worth compressing
+     */
+    bool compressible(std::string_view mime)
+    {
+        return mime.starts_with("text/") ||
+            mime == "application/javascript" ||
+            mime == "application/json" ||
+            mime == "application/xml" ||
+            mime == "image/svg+xml";
+    }
+
+    /**
+     * gzips data, returns nothing if zlib fails
+     */
+    std::optional<std::string> gzip(std::string_view data, int level = GZIP_LEVEL)
+    {
+        z_stream zs{};
+        // 15 window bits plus 16 selects the gzip wrapper
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return std::nullopt;
+        }
+
+        std::string out;
+        out.resize(deflateBound(&zs, data.size()));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        zs.avail_in = data.size();
+        zs.next_out = reinterpret_cast<Bytef*>(out.data());
+        zs.avail_out = out.size();
+
+        int status = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (status != Z_STREAM_END) return std::nullopt;
+
+        out.resize(zs.total_out);
+        return out;
+    }
+
+    /**
+     * bounded cache of gzipped files keyed by path, an entry is reused while
+     * the file's size and modification time are unchanged.
+     *
+     * files that don't shrink are remembered too, so they aren't compressed
+     * again on every request. two requests missing at the same time may both
+     * compress the file, the last one stored wins.
+     */
+    class GzipCache {
+    private:
+        struct Entry {
+            timespec mtime;
+            off_t size;
+            std::shared_ptr<const std::string> gz; // null if compressing didn't help
+            std::list<std::string>::iterator lru;
+        };
+
+        size_t max_bytes;
+        size_t bytes;               // size of every key and compressed file
+        std::mutex mtx;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru; // least recently used entry at the back
+
+        static bool same_file(const Entry& e, const struct stat& info)
+        {
+            return e.size == info.st_size &&
+                e.mtime.tv_sec == info.st_mtim.tv_sec &&
+                e.mtime.tv_nsec == info.st_mtim.tv_nsec;
+        }
+
+        void erase(std::unordered_map<std::string, Entry>::iterator found)
+        {
+            this->bytes -= found->first.size();
+            if (found->second.gz) this->bytes -= found->second.gz->size();
+            this->lru.erase(found->second.lru);
+            this->entries.erase(found);
+        }
+
+        // drops least recently used entries until extra bytes fit
+        void evict(size_t extra)
+        {
+            while (this->bytes + extra > this->max_bytes && not this->lru.empty()) {
+                this->erase(this->entries.find(this->lru.back()));
+            }
+        }
+
+    public:
+        GzipCache(size_t max_bytes = GZIP_CACHE_BYTES)
+            : max_bytes(max_bytes), bytes(0)
+        {}
+
+        // delete copy constructors
+        GzipCache(GzipCache& c) = delete;
+        GzipCache(const GzipCache& c) = delete;
+        GzipCache& operator=(GzipCache& c) = delete;
+        GzipCache& operator=(const GzipCache& c) = delete;
+
+        /**
+         * returns the gzipped contents of the opened file at path, compressing
+         * and caching them on a miss. returns null if the file is too big, can't
+         * be read or doesn't get smaller
+         */
+        std::shared_ptr<const std::string> get(const std::string& path, const FileBody& file)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mtx);
+                auto found = this->entries.find(path);
+                if (found != this->entries.end()) {
+                    if (same_file(found->second, file.info)) {
+                        this->lru.splice(this->lru.begin(), this->lru, found->second.lru);
+                        return found->second.gz;
+                    }
+                    this->erase(found);
+                }
+            }
+
+            if (file.length > GZIP_MAX_FILE) return nullptr;
+
+            // compress outside the lock
+            std::string contents(file.length, '\0');
+            size_t got = 0;
+            while (got < contents.size()) {
+                ssize_t status = pread(file.fd, contents.data() + got, contents.size() - got, file.offset + got);
+                if (status < 0 && errno == EINTR) continue;
+                if (status <= 0) return nullptr;
+                got += status;
+            }
+
+            std::shared_ptr<const std::string> gz;
+            std::optional<std::string> compressed = gzip(contents);
+            if (compressed && compressed->size() < contents.size()) {
+                gz = std::make_shared<const std::string>(std::move(*compressed));
+            }
+
+            size_t size = path.size() + (gz ? gz->size() : 0);
+            if (size > this->max_bytes) return gz;
+
+            std::lock_guard<std::mutex> lock(this->mtx);
+            auto found = this->entries.find(path);
+            if (found != this->entries.end()) this->erase(found);
+            this->evict(size);
+
+            this->lru.push_front(path);
+            this->entries[path] = Entry{file.info.st_mtim, file.info.st_size, gz, this->lru.begin()};
+            this->bytes += size;
+            return gz;
+        }
+    };
+};
@@ -25,8 +25,12 @@ namespace hussar {
         uint16_t port;
         uint16_t verbosity;
         uint32_t thread_count;
-        uint64_t max_upload = 32'000'000;
+        uint64_t max_upload = 32'000'000;  // largest request body accepted, bigger ones get a 413
         uint64_t max_stdbuf = 4096;
+        uint64_t max_output = 1'000'000; // bytes buffered per connection before writing blocks
+        uint64_t upload_spill = 1'000'000; // uploaded parts larger than this are written to a temp file
+        std::string upload_dir;          // where spilled uploads go, the system temp directory if empty
+        bool http2 = true;               // offer HTTP/2 to TLS clients through ALPN
 
         Config()
         {
@@ -46,7 +50,12 @@ namespace hussar {
             this->port = config.port;
             this->thread_count = config.thread_count;
             this->verbosity = config.verbosity;
-
+            this->max_upload = config.max_upload;
+            this->max_stdbuf = config.max_stdbuf;
+            this->max_output = config.max_output;
+            this->upload_spill = config.upload_spill;
+            this->upload_dir = config.upload_dir;
+            this->http2 = config.http2;
         }
 
         Config& operator=(Config&& config)
@@ -57,6 +66,12 @@ namespace hussar {
             this->port = config.port;
             this->thread_count = config.thread_count;
             this->verbosity = config.verbosity;
+            this->max_upload = config.max_upload;
+            this->max_stdbuf = config.max_stdbuf;
+            this->max_output = config.max_output;
+            this->upload_spill = config.upload_spill;
+            this->upload_dir = config.upload_dir;
+            this->http2 = config.http2;
             return *this;
         }
     };
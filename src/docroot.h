@@ -0,0 +1,636 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <sys/inotify.h>    // docroot changes
+#include <sys/syscall.h>    // openat2
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <shared_mutex>
+#include <unordered_set>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>  // RESOLVE_BENEATH
+#endif
+
+#include "libs.h"
+#include "output.h"
+#include "loop.h"
+#include "response.h"
+#include "compress.h"
+
+#define DOCROOT_PATH_MAX 256
+#define NEGATIVE_CACHE_SIZE 10000
+#define MEMORY_MAX_FILE 8'000'000   // larger files are always served from disk
+
+namespace hussar {
+    /**
+     * normalizes a decoded request path into dst in a single pass.
+     *
+     * repeated slashes and "." segments are dropped, a path ending in a slash
+     * gets "index.html" appended and the leading slash is removed, so the
+     * result is relative to the document root. returns the length written, or
+     * 0 if the path contains a ".." segment or a null byte, or doesn't fit.
+     */
+    size_t normalize_path(std::string_view path, char (&dst)[DOCROOT_PATH_MAX])
+    {
+        static constexpr std::string_view index = "index.html";
+        size_t length = 0;
+        size_t n = 0;
+
+        while (n < path.size()) {
+            // skip slashes between segments
+            while (n < path.size() && path[n] == '/') ++n;
+            size_t start = n;
+            while (n < path.size() && path[n] != '/') {
+                if (path[n] == '\0') return 0;
+                ++n;
+            }
+
+            std::string_view segment = path.substr(start, n - start);
+            if (segment.empty() || segment == ".") continue;
+            if (segment == "..") return 0;
+
+            // room for the segment, its slash and a terminator
+            if (length + segment.size() + 2 > DOCROOT_PATH_MAX) return 0;
+            if (length) dst[length++] = '/';
+            std::memcpy(dst + length, segment.data(), segment.size());
+            length += segment.size();
+        }
+
+        // directories are served by their index
+        if (length == 0 || path.back() == '/' || path.ends_with("/.")) {
+            if (length + index.size() + 2 > DOCROOT_PATH_MAX) return 0;
+            if (length) dst[length++] = '/';
+            std::memcpy(dst + length, index.data(), index.size());
+            length += index.size();
+        }
+
+        dst[length] = '\0';
+        return length;
+    }
+
+    // hashes strings and string views alike, so lookups by view don't allocate
+    struct path_hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view path) const
+        {
+            return std::hash<std::string_view>{}(path);
+        }
+    };
+
+    // called with the paths that changed relative to the root, an empty path means anything may have
+    using change_listener = std::function<void (const std::vector<std::string>&)>;
+
+    /**
+     * a directory files are served from.
+     *
+     * the directory is canonicalized and opened once, then files are opened
+     * relative to it with openat2(RESOLVE_BENEATH), so neither ".." nor a
+     * symlink can resolve outside of it. kernels without openat2 fall back to
+     * openat, paths from normalize_path() still can't climb out with "..".
+     *
+     * the tree is watched with inotify on the io loop. while the watch works,
+     * paths that failed to open are remembered in a bounded negative cache and
+     * small pages are kept in memory, both are dropped whenever anything in
+     * the tree changes.
+     */
+    class Docroot {
+    private:
+        struct Page {
+            uint64_t generation;
+            std::shared_ptr<const std::string> contents;
+        };
+
+        int dirfd;
+        bool beneath; // openat2 is available
+        std::filesystem::path root;
+
+        int inotify_fd;
+        std::unordered_map<int, std::string> watches; // watch descriptor to directory relative to root, loop thread only
+        std::vector<change_listener> listeners;       // loop thread only
+        std::atomic<uint64_t> generation;             // bumped on every change in the tree
+
+        std::shared_mutex missing_mtx;
+        std::unordered_set<std::string, path_hash, std::equal_to<>> missing;
+        std::deque<std::string> missing_order;        // oldest negative entry at the front
+        uint64_t missing_generation;
+
+        std::mutex pages_mtx;
+        std::unordered_map<std::string, Page> pages;
+
+        int open_relative(const char* relative) const
+        {
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+            if (this->beneath) {
+                open_how how{};
+                how.flags = O_RDONLY | O_CLOEXEC;
+                how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+                return static_cast<int>(syscall(SYS_openat2, this->dirfd, relative, &how, sizeof(how)));
+            }
+#endif
+            return ::openat(this->dirfd, relative, O_RDONLY | O_CLOEXEC);
+        }
+
+        bool watching() const
+        {
+            return this->inotify_fd >= 0;
+        }
+
+        // watches dir and every directory below it, dir is relative to the root
+        void add_watches(const std::string& dir)
+        {
+            constexpr uint32_t events = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+            std::filesystem::path start = dir.empty() ? this->root : this->root / dir;
+            int wd = inotify_add_watch(this->inotify_fd, start.c_str(), events);
+            if (wd < 0) return;
+            this->watches[wd] = dir;
+
+            std::error_code error;
+            for (auto it = std::filesystem::recursive_directory_iterator(start, error);
+                    not error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+                if (not it->is_directory(error) || it->is_symlink(error)) continue;
+                wd = inotify_add_watch(this->inotify_fd, it->path().c_str(), events);
+                if (wd >= 0) {
+                    this->watches[wd] = std::filesystem::relative(it->path(), this->root).string();
+                }
+            }
+        }
+
+        // drains queued inotify events and tells listeners what changed, runs on the loop thread
+        void on_events()
+        {
+            alignas(inotify_event) char buf[16384];
+            std::vector<std::string> changed;
+
+            while (true) {
+                ssize_t count = ::read(this->inotify_fd, buf, sizeof(buf));
+                if (count <= 0) break;
+
+                for (char* p = buf; p < buf + count;) {
+                    inotify_event* e = reinterpret_cast<inotify_event*>(p);
+                    p += sizeof(inotify_event) + e->len;
+
+                    // lost events, everything may have changed
+                    if (e->mask & IN_Q_OVERFLOW) {
+                        changed.emplace_back();
+                        continue;
+                    }
+
+                    auto dir = this->watches.find(e->wd);
+                    if (dir == this->watches.end()) continue;
+                    if (e->mask & IN_IGNORED) {
+                        this->watches.erase(dir);
+                        continue;
+                    }
+
+                    std::string path = dir->second;
+                    if (e->len && e->name[0]) {
+                        if (not path.empty()) path += '/';
+                        path += e->name;
+                    }
+
+                    // new directories need watches of their own
+                    if ((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO))) {
+                        this->add_watches(path);
+                    }
+                    changed.emplace_back(std::move(path));
+                }
+            }
+
+            if (changed.empty()) return;
+            ++this->generation;
+
+            std::sort(changed.begin(), changed.end());
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+            for (auto& listener : this->listeners) {
+                listener(changed);
+            }
+        }
+
+        void arm()
+        {
+            io_loop.watch(this->inotify_fd, EPOLLIN, [this](uint32_t events) {
+                if (events & EPOLLIN) this->on_events();
+                this->arm();
+            });
+        }
+
+        void start_watching()
+        {
+            if (this->inotify_fd >= 0) close(this->inotify_fd);
+            this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (this->inotify_fd < 0) return;
+
+            // set up on the loop thread, which owns the watch table from here on
+            io_loop.post([this] {
+                this->watches.clear();
+                this->add_watches("");
+                ++this->generation;
+                this->arm();
+            });
+        }
+
+        // true if path failed to open since the tree last changed
+        bool known_missing(std::string_view path)
+        {
+            std::shared_lock<std::shared_mutex> lock(this->missing_mtx);
+            return this->missing_generation == this->generation && this->missing.find(path) != this->missing.end();
+        }
+
+        // remembers that path failed to open while the tree was at generation
+        void remember_missing(std::string_view path, uint64_t generation)
+        {
+            std::unique_lock<std::shared_mutex> lock(this->missing_mtx);
+            if (generation != this->generation) return;
+            if (this->missing_generation != generation) {
+                this->missing.clear();
+                this->missing_order.clear();
+                this->missing_generation = generation;
+            }
+
+            if (this->missing.size() >= NEGATIVE_CACHE_SIZE) {
+                this->missing.erase(this->missing_order.front());
+                this->missing_order.pop_front();
+            }
+            if (this->missing.emplace(path).second) {
+                this->missing_order.emplace_back(path);
+            }
+        }
+
+    public:
+        Docroot()
+            : dirfd(-1), beneath(false), inotify_fd(-1), generation(0), missing_generation(0)
+        {}
+
+        // delete copy constructors
+        Docroot(Docroot& d) = delete;
+        Docroot(const Docroot& d) = delete;
+        Docroot& operator=(Docroot& d) = delete;
+        Docroot& operator=(const Docroot& d) = delete;
+
+        ~Docroot()
+        {
+            if (this->dirfd >= 0) close(this->dirfd);
+        }
+
+        /**
+         * opens dir as the document root and starts watching it for changes,
+         * exits if it isn't a directory
+         */
+        void open(const std::filesystem::path& dir)
+        {
+            std::error_code error;
+            this->root = std::filesystem::canonical(dir, error);
+            if (error) {
+                fatal_error("ERROR can't open document root: " + dir.string());
+            }
+
+            if (this->dirfd >= 0) close(this->dirfd);
+            this->dirfd = ::open(this->root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (this->dirfd < 0) {
+                fatal_error("ERROR can't open document root: " + this->root.string());
+            }
+
+            this->beneath = false;
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+            // probe for openat2, it needs linux 5.6
+            open_how how{};
+            how.flags = O_RDONLY | O_CLOEXEC | O_DIRECTORY;
+            how.resolve = RESOLVE_BENEATH;
+            int probe = static_cast<int>(syscall(SYS_openat2, this->dirfd, ".", &how, sizeof(how)));
+            if (probe >= 0) {
+                close(probe);
+                this->beneath = true;
+            }
+#endif
+
+            this->start_watching();
+        }
+
+        /**
+         * calls listener on the io loop with the paths that changed, each time
+         * the tree changes. does nothing if the tree can't be watched
+         */
+        void on_change(change_listener listener)
+        {
+            if (not this->watching()) return;
+            io_loop.post([this, listener = std::move(listener)]() mutable {
+                this->listeners.emplace_back(std::move(listener));
+            });
+        }
+
+        /**
+         * the canonical path of the document root
+         */
+        const std::filesystem::path& path() const
+        {
+            return this->root;
+        }
+
+        /**
+         * opens a regular file by its path relative to the root, as returned by
+         * normalize_path(), returns null if there is no such file
+         */
+        std::shared_ptr<const FileBody> open_file(const char* relative)
+        {
+            if (not this->watching()) {
+                int fd = this->open_relative(relative);
+                return fd < 0 ? nullptr : FileBody::from_fd(fd);
+            }
+
+            if (this->known_missing(relative)) return nullptr;
+
+            uint64_t generation = this->generation;
+            int fd = this->open_relative(relative);
+            std::shared_ptr<const FileBody> file = fd < 0 ? nullptr : FileBody::from_fd(fd);
+            if (not file && (fd >= 0 || errno == ENOENT || errno == ENOTDIR || errno == EXDEV || errno == ELOOP)) {
+                this->remember_missing(relative, generation);
+            }
+            return file;
+        }
+
+        /**
+         * returns the contents of a small file kept in memory until the tree
+         * changes, for pages served often such as 404.html. returns null if
+         * there is no such file
+         */
+        std::shared_ptr<const std::string> page(const char* relative)
+        {
+            uint64_t generation = this->generation;
+            if (this->watching()) {
+                std::lock_guard<std::mutex> lock(this->pages_mtx);
+                auto found = this->pages.find(relative);
+                if (found != this->pages.end() && found->second.generation == generation) {
+                    return found->second.contents;
+                }
+            }
+
+            std::shared_ptr<const std::string> contents;
+            std::shared_ptr<const FileBody> file = this->open_file(relative);
+            if (file) {
+                std::string data(file->length, '\0');
+                ssize_t got = pread(file->fd, data.data(), data.size(), 0);
+                if (got < 0) return nullptr;
+                data.resize(got);
+                contents = std::make_shared<const std::string>(std::move(data));
+            }
+
+            if (this->watching()) {
+                std::lock_guard<std::mutex> lock(this->pages_mtx);
+                this->pages[relative] = Page{generation, contents};
+            }
+            return contents;
+        }
+    };
+
+    /**
+     * a file held in memory as ready to send entities, headers and body
+     * serialized after the status line, for each encoding it is available in
+     */
+    struct MemoryFile {
+        struct Variant {
+            std::shared_ptr<const std::string> full; // headers and body, null if the encoding isn't available
+            std::shared_ptr<const std::string> head; // headers only, for HEAD requests
+            std::string etag;
+        };
+
+        Variant identity;
+        Variant gzip;
+        Variant br;
+        std::string last_modified;
+        size_t bytes = 0;
+    };
+
+    /**
+     * the files of a docroot loaded into memory.
+     *
+     * the whole tree is loaded by load() and then kept current from the
+     * docroot's inotify changes. changes are applied on the io loop's blocking
+     * thread to a copy of the table, which then replaces the current one in a
+     * single atomic swap. readers only hold the atomic shared_ptr's internal
+     * lock long enough to copy the pointer, never while a change is built.
+     * files bigger than MEMORY_MAX_FILE, or that don't fit in max_bytes, are
+     * left out and served from disk.
+     */
+    class MemoryDocroot {
+    private:
+        using table = std::unordered_map<std::string, std::shared_ptr<const MemoryFile>, path_hash, std::equal_to<>>;
+
+        Docroot& docroot;
+        size_t max_bytes;
+        size_t bytes;       // blocking thread only once loaded
+        std::atomic<std::shared_ptr<const table>> files;
+
+        static std::shared_ptr<const std::string> entity(const std::string& headers, std::string_view body, bool with_body)
+        {
+            std::string out;
+            out.reserve(headers.size() + 32 + (with_body ? body.size() : 0));
+            out += headers;
+            out += "Content-Length: ";
+            out += std::to_string(body.size());
+            out += "\r\n\r\n";
+            if (with_body) out += body;
+            return std::make_shared<const std::string>(std::move(out));
+        }
+
+        static void fill(MemoryFile::Variant& v, std::string headers, std::string_view body, const std::string& coding, const struct stat& info)
+        {
+            v.etag = file_etag(info, coding);
+            headers += "ETag: " + v.etag + "\r\n";
+            if (not coding.empty()) headers += "Content-Encoding: " + coding + "\r\n";
+            v.full = entity(headers, body, true);
+            v.head = entity(headers, body, false);
+        }
+
+        // reads a whole file, returns nothing if it can't
+        static std::optional<std::string> read(const FileBody& file)
+        {
+            std::string data(file.length, '\0');
+            size_t got = 0;
+            while (got < data.size()) {
+                ssize_t status = pread(file.fd, data.data() + got, data.size() - got, got);
+                if (status < 0 && errno == EINTR) continue;
+                if (status <= 0) return std::nullopt;
+                got += status;
+            }
+            return data;
+        }
+
+        // reads the sidecar of path if it is at least as new as the file
+        std::optional<std::string> sidecar(const std::string& path, const char* extension, const struct stat& info)
+        {
+            auto file = this->docroot.open_file((path + extension).c_str());
+            if (not file || file->info.st_mtime < info.st_mtime || file->length > MEMORY_MAX_FILE) return std::nullopt;
+            return read(*file);
+        }
+
+        // builds the entry for a file, returns null if it shouldn't be held in memory
+        std::shared_ptr<const MemoryFile> build(const std::string& path)
+        {
+            auto file = this->docroot.open_file(path.c_str());
+            if (not file || file->length > MEMORY_MAX_FILE) return nullptr;
+
+            std::optional<std::string> body = read(*file);
+            if (not body) return nullptr;
+
+            const std::string& mime = get_mime(std::string_view(path));
+            auto entry = std::make_shared<MemoryFile>();
+            entry->last_modified = file_last_modified(file->info);
+
+            std::string headers = "Server: " SERVER_NAME "\r\n";
+            headers += "Content-Type: " + mime + "\r\n";
+            headers += "Last-Modified: " + entry->last_modified + "\r\n";
+            headers += "Accept-Ranges: bytes\r\n";
+
+            std::optional<std::string> br = this->sidecar(path, ".br", file->info);
+            std::optional<std::string> gz = this->sidecar(path, ".gz", file->info);
+            if (not gz && compressible(mime)) {
+                gz = hussar::gzip(*body);
+                if (gz && gz->size() >= body->size()) gz.reset();
+            }
+            if (br || gz || compressible(mime)) headers += "Vary: Accept-Encoding\r\n";
+
+            fill(entry->identity, headers, *body, "", file->info);
+            if (gz) fill(entry->gzip, headers, *gz, "gzip", file->info);
+            if (br) fill(entry->br, headers, *br, "br", file->info);
+
+            for (auto* v : { &entry->identity, &entry->gzip, &entry->br }) {
+                if (v->full) entry->bytes += v->full->size() + v->head->size();
+            }
+            return entry;
+        }
+
+        void add(table& t, const std::string& path)
+        {
+            auto entry = this->build(path);
+            if (not entry || this->bytes + entry->bytes > this->max_bytes) return;
+            this->bytes += entry->bytes;
+            t[path] = std::move(entry);
+        }
+
+        // adds every file below dir, dir is relative to the root
+        void scan(table& t, const std::string& dir)
+        {
+            std::error_code error;
+            std::filesystem::path start = dir.empty() ? this->docroot.path() : this->docroot.path() / dir;
+            for (auto it = std::filesystem::recursive_directory_iterator(start, error);
+                    not error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+                if (it->is_regular_file(error)) {
+                    this->add(t, std::filesystem::relative(it->path(), this->docroot.path()).string());
+                }
+            }
+        }
+
+        // drops path and everything below it, then loads them again
+        void refresh(table& t, const std::string& path)
+        {
+            if (path.empty()) {
+                t.clear();
+                this->bytes = 0;
+                this->scan(t, "");
+                return;
+            }
+
+            std::string below = path + "/";
+            for (auto it = t.begin(); it != t.end();) {
+                if (it->first == path || it->first.starts_with(below)) {
+                    this->bytes -= it->second->bytes;
+                    it = t.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            std::error_code error;
+            auto status = std::filesystem::symlink_status(this->docroot.path() / path, error);
+            if (error) return;
+            if (std::filesystem::is_directory(status)) {
+                this->scan(t, path);
+            } else {
+                this->add(t, path);
+            }
+        }
+
+        void apply(const std::vector<std::string>& changed)
+        {
+            auto next = std::make_shared<table>(*this->files.load());
+            for (const std::string& path : changed) {
+                this->refresh(*next, path);
+
+                // a changed sidecar changes the file it belongs to
+                if (path.ends_with(".gz") || path.ends_with(".br")) {
+                    std::string base = path.substr(0, path.size() - 3);
+                    if (next->count(base) || std::filesystem::is_regular_file(this->docroot.path() / base)) {
+                        this->refresh(*next, base);
+                    }
+                }
+            }
+            this->files.store(std::move(next));
+        }
+
+    public:
+        MemoryDocroot(Docroot& docroot, size_t max_bytes)
+            : docroot(docroot), max_bytes(max_bytes), bytes(0), files(std::make_shared<const table>())
+        {}
+
+        // delete copy constructors
+        MemoryDocroot(MemoryDocroot& m) = delete;
+        MemoryDocroot(const MemoryDocroot& m) = delete;
+        MemoryDocroot& operator=(MemoryDocroot& m) = delete;
+        MemoryDocroot& operator=(const MemoryDocroot& m) = delete;
+
+        /**
+         * loads the docroot and starts following its changes
+         */
+        void load()
+        {
+            auto t = std::make_shared<table>();
+            this->scan(*t, "");
+            this->files.store(std::move(t));
+
+            this->docroot.on_change([this](const std::vector<std::string>& changed) {
+                // reading files blocks, keep it off the loop thread
+                io_loop.blocking([this, changed] { this->apply(changed); });
+            });
+        }
+
+        /**
+         * returns the file at a normalized path, or null if it isn't in memory
+         */
+        std::shared_ptr<const MemoryFile> find(std::string_view path) const
+        {
+            std::shared_ptr<const table> t = this->files.load();
+            auto found = t->find(path);
+            return found != t->end() ? found->second : nullptr;
+        }
+
+        /**
+         * bytes of memory held by loaded files
+         */
+        size_t size() const
+        {
+            size_t total = 0;
+            for (auto& [path, file] : *this->files.load()) total += file->bytes;
+            return total;
+        }
+    };
+};
@@ -0,0 +1,110 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "libs.h"
+#include "request.h"
+#include "response.h"
+#include "router.h"
+#include "docroot.h"
+
+namespace hussar {
+    /**
+     * a file compiled into the binary, everything about it is worked out when
+     * the bundle is generated. gzip is empty if compressing didn't help
+     */
+    struct EmbeddedAsset {
+        std::string_view path;  // relative to the bundled directory, without a leading slash
+        std::string_view mime;
+        std::string_view etag;
+        std::string_view body;
+        std::string_view gzip;
+    };
+
+    /**
+     * the assets of a generated bundle and their perfect hash index.
+     *
+     * a path's bucket is seeded_hash(path, 0) % buckets, and the bucket's seed
+     * picks its slot with seeded_hash(path, seed) % table_size. the generator
+     * searches for seeds until no two paths share a slot, so a lookup is two
+     * hashes and one compare. empty slots hold -1
+     */
+    struct EmbeddedBundle {
+        const EmbeddedAsset* assets;
+        size_t count;
+        const uint32_t* seeds;
+        size_t buckets;
+        const int32_t* slots;
+        size_t table_size;
+
+        constexpr const EmbeddedAsset* find(std::string_view path) const
+        {
+            if (this->count == 0) return nullptr;
+            uint32_t seed = this->seeds[seeded_hash(path, 0) % this->buckets];
+            int32_t slot = this->slots[seeded_hash(path, seed) % this->table_size];
+            if (slot < 0 || this->assets[slot].path != path) return nullptr;
+            return &this->assets[slot];
+        }
+    };
+
+    /**
+     * answers with the embedded asset at the normalized path, returns false if
+     * the bundle doesn't hold it. the body is sent straight from the binary, so
+     * range requests get the whole asset
+     */
+    bool serve_embedded(const EmbeddedBundle& bundle, Request& req, Response& resp, std::string_view path)
+    {
+        const EmbeddedAsset* asset = bundle.find(path);
+        if (not asset) return false;
+
+        bool gzipped = not asset->gzip.empty() && req.accepts_encoding("gzip");
+
+        resp.code = "200";
+        resp.headers["Content-Type"] = asset->mime;
+        if (not asset->gzip.empty()) resp.headers["Vary"] = "Accept-Encoding";
+        if (gzipped) {
+            resp.headers["Content-Encoding"] = "gzip";
+            // a distinct tag per coding, the quotes stay around the whole tag
+            std::string etag(asset->etag.substr(0, asset->etag.size() - 1));
+            etag += "-gzip\"";
+            resp.headers["ETag"] = etag;
+        } else {
+            resp.headers["ETag"] = asset->etag;
+        }
+        if (resp.not_modified()) return true;
+
+        resp.send_static(gzipped ? asset->gzip : asset->body);
+        return true;
+    }
+
+    /**
+     * route handler serving a bundle, the request's document is looked up
+     * the same way the docroot resolves it
+     */
+    handler embedded(const EmbeddedBundle& bundle)
+    {
+        return [&bundle](Request& req, Response& resp) {
+            char path[DOCROOT_PATH_MAX];
+            size_t length = normalize_path(req.document, path);
+            if (length == 0 || not serve_embedded(bundle, req, resp, std::string_view(path, length))) {
+                resp.code = "404";
+                resp.body = "<h1>404: File Not found!</h1>";
+            }
+        };
+    }
+};
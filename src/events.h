@@ -0,0 +1,223 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+
+#include "libs.h"
+#include "loop.h"
+#include "parked.h"
+#include "request.h"
+#include "response.h"
+
+#define SSE_MAX_QUEUE 1048576   // bytes of events waiting for a subscriber, see Overflow
+#define SSE_HEARTBEAT 15        // seconds between the comments that keep idle streams open
+
+namespace hussar {
+    /**
+     * formats a server-sent event. each line of data becomes a data field,
+     * event and id are single lines so line breaks in them are dropped
+     */
+    std::string format_event(std::string_view data, std::string_view event = {}, std::string_view id = {})
+    {
+        std::string formatted;
+        formatted.reserve(data.size() + event.size() + id.size() + 24);
+
+        auto field = [&formatted](std::string_view name, std::string_view value) {
+            formatted += name;
+            for (char c : value) {
+                if (c != '\r' && c != '\n' && c != '\0') formatted += c;
+            }
+            formatted += '\n';
+        };
+        if (not event.empty()) field("event: ", event);
+        if (not id.empty()) field("id: ", id);
+
+        // any of the three line endings splits data
+        size_t start = 0;
+        while (true) {
+            size_t end = data.find_first_of("\r\n", start);
+            formatted += "data: ";
+            formatted += data.substr(start, end - start);
+            formatted += '\n';
+            if (end == std::string_view::npos) break;
+            start = end + (data[end] == '\r' && end + 1 < data.size() && data[end + 1] == '\n' ? 2 : 1);
+        }
+
+        formatted += '\n';
+        return formatted;
+    }
+
+    /**
+     * answers the request of an event stream route. the response has no
+     * length, the events follow it until the connection closes
+     */
+    void event_stream_open(Request& req, Response& resp)
+    {
+        resp.code = "200";
+        resp.headers["Content-Type"] = "text/event-stream";
+        resp.headers["Cache-Control"] = "no-cache";
+        resp.headers["Connection"] = "close";
+        resp.open_ended = true;
+
+        // the connection carries on after the response, as an event stream
+        req.keep_alive = true;
+    }
+
+    class EventStream;
+
+    /**
+     * the callbacks of an event stream route, called on the io loop thread so
+     * they must not block. on_open is where a stream joins its channels, or
+     * catches up from the Last-Event-ID header of a reconnecting client
+     */
+    struct EventStreamHandler {
+        std::function<void (EventStream&)> on_open;
+        std::function<void (EventStream&)> on_close;
+        size_t max_queue = SSE_MAX_QUEUE;
+        Overflow overflow = Overflow::DISCONNECT;   // what happens to a subscriber that falls behind
+        unsigned retry = 0;                         // milliseconds clients wait to reconnect, sent first if set
+    };
+
+    /**
+     * a server-sent event stream, parked on the io loop rather than a pool
+     * thread. a subscriber costs its queue and request, not a thread.
+     * send() and close() may be called from any thread
+     */
+    class EventStream : public ParkedSocket {
+    private:
+        std::shared_ptr<const EventStreamHandler> handler;
+
+        void opened() override
+        {
+            if (this->handler->retry) {
+                this->push(std::make_shared<const std::string>("retry: " + std::to_string(this->handler->retry) + "\n\n"));
+            }
+            if (this->handler->on_open) {
+                try {
+                    this->handler->on_open(*this);
+                } catch (...) {
+                    this->finish();
+                }
+            }
+        }
+
+        void ended() override
+        {
+            if (this->handler->on_close) this->handler->on_close(*this);
+        }
+
+        // clients don't send anything on an event stream, reading only notices them leave
+        void consume(char* data, size_t size) override
+        {}
+
+    public:
+        EventStream(int client, SSL* ssl, std::unique_ptr<Request> req, std::shared_ptr<const EventStreamHandler> handler)
+            : ParkedSocket(client, ssl, std::move(req), handler->max_queue, handler->overflow), handler(std::move(handler))
+        {}
+
+        /**
+         * sends an event to this subscriber only, callable from any thread
+         */
+        void send(std::string_view data, std::string_view event = {}, std::string_view id = {})
+        {
+            this->send_bytes(std::make_shared<const std::string>(format_event(data, event, id)));
+        }
+
+        /**
+         * ends the stream once what is queued is sent, callable from any thread
+         */
+        void close()
+        {
+            if (not io_loop.in_loop()) {
+                io_loop.post([self = std::static_pointer_cast<EventStream>(this->shared_from_this())] {
+                    self->close();
+                });
+                return;
+            }
+            if (this->closed) return;
+            this->running = false;
+            this->finish();
+        }
+    };
+
+    /**
+     * a topic that events are published to. an event is formatted once and
+     * the same bytes are queued to every subscriber, see Channel.
+     *
+     * while it has subscribers, the channel sends them a comment every
+     * heartbeat so proxies keep idle streams open and dead clients are noticed
+     */
+    class EventChannel : public Channel {
+    private:
+        std::chrono::seconds heartbeat;
+        bool beating;   // loop thread only
+
+        void joined() override
+        {
+            if (this->beating || this->heartbeat.count() <= 0) return;
+            this->beating = true;
+            io_loop.after(this->heartbeat, [this] {
+                this->beat();
+            });
+        }
+
+        void beat()
+        {
+            if (this->size() == 0) {
+                this->beating = false;
+                return;
+            }
+
+            static const auto comment = std::make_shared<const std::string>(":\n\n");
+            this->fan_out(comment);
+            io_loop.after(this->heartbeat, [this] {
+                this->beat();
+            });
+        }
+
+    public:
+        EventChannel(std::chrono::seconds heartbeat = std::chrono::seconds(SSE_HEARTBEAT))
+            : heartbeat(heartbeat), beating(false)
+        {}
+
+        /**
+         * subscribes a stream to the channel, callable from any thread
+         */
+        void join(EventStream& stream)
+        {
+            this->add(stream);
+        }
+
+        /**
+         * unsubscribes a stream from the channel, callable from any thread
+         */
+        void leave(EventStream& stream)
+        {
+            this->remove(stream);
+        }
+
+        /**
+         * sends an event to every subscriber, callable from any thread
+         */
+        void publish(std::string_view data, std::string_view event = {}, std::string_view id = {})
+        {
+            this->fan_out(std::make_shared<const std::string>(format_event(data, event, id)));
+        }
+    };
+};
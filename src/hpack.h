@@ -0,0 +1,464 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <deque>
+
+#include "libs.h"
+
+#define HPACK_TABLE_SIZE 4096           // dynamic table size, the protocol default
+#define HPACK_MAX_HEADER_LIST 65536     // decoded header bytes accepted per request
+
+namespace hussar {
+    /**
+     * a decoded header, names are lowercase
+     */
+    struct HeaderField {
+        std::string name;
+        std::string value;
+    };
+
+    // the huffman code of every byte, from RFC 7541 appendix B
+    constexpr uint32_t huffman_codes[256] = {
+        0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5, 0x0fffffe6, 0x0fffffe7,
+        0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9, 0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec,
+        0x0fffffed, 0x0fffffee, 0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+        0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9, 0x0ffffffa, 0x0ffffffb,
+        0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa, 0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa,
+        0x000003fa, 0x000003fb, 0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+        0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b, 0x0000001c, 0x0000001d,
+        0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb, 0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc,
+        0x00001ffa, 0x00000021, 0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+        0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068, 0x00000069, 0x0000006a,
+        0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e, 0x0000006f, 0x00000070, 0x00000071, 0x00000072,
+        0x000000fc, 0x00000073, 0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+        0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005, 0x00000025, 0x00000026,
+        0x00000027, 0x00000006, 0x00000074, 0x00000075, 0x00000028, 0x00000029, 0x0000002a, 0x00000007,
+        0x0000002b, 0x00000076, 0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+        0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd, 0x00001ffd, 0x0ffffffc,
+        0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8, 0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9,
+        0x003fffd6, 0x007fffda, 0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+        0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1, 0x007fffe2, 0x007fffe3,
+        0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5, 0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef,
+        0x003fffda, 0x001fffdd, 0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+        0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf, 0x007fffeb, 0x007fffec,
+        0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2, 0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef,
+        0x000fffea, 0x003fffe2, 0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+        0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2, 0x003fffe8, 0x01ffffec,
+        0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde, 0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed,
+        0x0007fff2, 0x001fffe3, 0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+        0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3, 0x07ffffe4, 0x07ffffe5,
+        0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6, 0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3,
+        0x003fffea, 0x003fffeb, 0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+        0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8, 0x07ffffe9, 0x07ffffea,
+        0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed, 0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+    };
+
+    constexpr uint8_t huffman_lengths[256] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    };
+
+    // RFC 7541 appendix A
+    constexpr std::pair<std::string_view, std::string_view> hpack_static_table[61] = {
+        { ":authority", "" },
+        { ":method", "GET" },
+        { ":method", "POST" },
+        { ":path", "/" },
+        { ":path", "/index.html" },
+        { ":scheme", "http" },
+        { ":scheme", "https" },
+        { ":status", "200" },
+        { ":status", "204" },
+        { ":status", "206" },
+        { ":status", "304" },
+        { ":status", "400" },
+        { ":status", "404" },
+        { ":status", "500" },
+        { "accept-charset", "" },
+        { "accept-encoding", "gzip, deflate" },
+        { "accept-language", "" },
+        { "accept-ranges", "" },
+        { "accept", "" },
+        { "access-control-allow-origin", "" },
+        { "age", "" },
+        { "allow", "" },
+        { "authorization", "" },
+        { "cache-control", "" },
+        { "content-disposition", "" },
+        { "content-encoding", "" },
+        { "content-language", "" },
+        { "content-length", "" },
+        { "content-location", "" },
+        { "content-range", "" },
+        { "content-type", "" },
+        { "cookie", "" },
+        { "date", "" },
+        { "etag", "" },
+        { "expect", "" },
+        { "expires", "" },
+        { "from", "" },
+        { "host", "" },
+        { "if-match", "" },
+        { "if-modified-since", "" },
+        { "if-none-match", "" },
+        { "if-range", "" },
+        { "if-unmodified-since", "" },
+        { "last-modified", "" },
+        { "link", "" },
+        { "location", "" },
+        { "max-forwards", "" },
+        { "proxy-authenticate", "" },
+        { "proxy-authorization", "" },
+        { "range", "" },
+        { "referer", "" },
+        { "refresh", "" },
+        { "retry-after", "" },
+        { "server", "" },
+        { "set-cookie", "" },
+        { "strict-transport-security", "" },
+        { "transfer-encoding", "" },
+        { "user-agent", "" },
+        { "vary", "" },
+        { "via", "" },
+        { "www-authenticate", "" },
+    };
+
+    /**
+     * huffman decoding tree walked a byte at a time. a child above 0 is the
+     * next node, below 0 it is a leaf -(symbol | bits << 8) - 1 where bits is
+     * how many of the byte's bits the symbol used, and 0 is an invalid code
+     */
+    struct HuffmanNode {
+        int32_t children[256] = {};
+    };
+
+    const std::vector<HuffmanNode>& huffman_tree()
+    {
+        static const std::vector<HuffmanNode> tree = [] {
+            std::vector<HuffmanNode> tree(1);
+            for (int symbol = 0; symbol < 256; ++symbol) {
+                uint32_t code = huffman_codes[symbol];
+                uint32_t length = huffman_lengths[symbol];
+
+                size_t node = 0;
+                while (length > 8) {
+                    length -= 8;
+                    uint8_t n = static_cast<uint8_t>(code >> length);
+                    if (tree[node].children[n] == 0) {
+                        tree[node].children[n] = tree.size();
+                        tree.emplace_back();
+                    }
+                    node = tree[node].children[n];
+                }
+
+                // codes shorter than a byte fill every slot they prefix
+                uint32_t shift = 8 - length;
+                uint32_t start = static_cast<uint8_t>(code << shift);
+                for (uint32_t n = start; n < start + (1u << shift); ++n) {
+                    tree[node].children[n] = -static_cast<int32_t>(symbol | length << 8) - 1;
+                }
+            }
+            return tree;
+        }();
+        return tree;
+    }
+
+    /**
+     * appends the huffman decoded data to out, returns false if it isn't a
+     * valid encoding or isn't padded with the start of the EOS code
+     */
+    bool huffman_decode(std::string_view data, std::string& out)
+    {
+        const std::vector<HuffmanNode>& tree = huffman_tree();
+        uint64_t bits = 0;
+        uint32_t count = 0;     // bits in hand
+        uint32_t since = 0;     // bits since the last symbol
+        size_t node = 0;
+
+        for (char c : data) {
+            bits = bits << 8 | static_cast<unsigned char>(c);
+            count += 8;
+            since += 8;
+            while (count >= 8) {
+                int32_t child = tree[node].children[static_cast<uint8_t>(bits >> (count - 8))];
+                if (child == 0) return false;
+                if (child > 0) {
+                    node = child;
+                    count -= 8;
+                    continue;
+                }
+                int32_t leaf = -child - 1;
+                out += static_cast<char>(leaf & 0xff);
+                count -= leaf >> 8;
+                since = count;
+                node = 0;
+            }
+        }
+
+        // the last few bits may still hold short codes
+        while (count > 0) {
+            int32_t child = tree[node].children[static_cast<uint8_t>(bits << (8 - count))];
+            if (child == 0) return false;
+            int32_t leaf = -child - 1;
+            if (child > 0 || static_cast<uint32_t>(leaf >> 8) > count) break;
+            out += static_cast<char>(leaf & 0xff);
+            count -= leaf >> 8;
+            since = count;
+            node = 0;
+        }
+
+        uint64_t mask = (1ull << count) - 1;
+        return since <= 7 && (bits & mask) == mask;
+    }
+
+    /**
+     * bytes data takes huffman encoded
+     */
+    size_t huffman_length(std::string_view data)
+    {
+        size_t bits = 0;
+        for (char c : data) bits += huffman_lengths[static_cast<unsigned char>(c)];
+        return (bits + 7) / 8;
+    }
+
+    /**
+     * appends data huffman encoded to out
+     */
+    void huffman_encode(std::string_view data, std::string& out)
+    {
+        uint64_t bits = 0;
+        uint32_t count = 0;
+        for (char c : data) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            bits = bits << huffman_lengths[byte] | huffman_codes[byte];
+            count += huffman_lengths[byte];
+            while (count >= 8) {
+                count -= 8;
+                out += static_cast<char>(bits >> count);
+            }
+        }
+        // pad with the most significant bits of EOS, which are all ones
+        if (count) out += static_cast<char>(bits << (8 - count) | 0xff >> count);
+    }
+
+    /**
+     * appends an HPACK integer with a prefix of bits, flags fills the rest of the first byte
+     */
+    void hpack_write_int(std::string& out, uint64_t value, uint32_t bits, uint8_t flags)
+    {
+        uint64_t limit = (1u << bits) - 1;
+        if (value < limit) {
+            out += static_cast<char>(flags | value);
+            return;
+        }
+        out += static_cast<char>(flags | limit);
+        value -= limit;
+        while (value >= 128) {
+            out += static_cast<char>(value % 128 + 128);
+            value /= 128;
+        }
+        out += static_cast<char>(value);
+    }
+
+    /**
+     * appends a string literal, huffman encoded when that makes it shorter
+     */
+    void hpack_write_string(std::string& out, std::string_view data)
+    {
+        size_t encoded = huffman_length(data);
+        if (encoded < data.size()) {
+            hpack_write_int(out, encoded, 7, 0x80);
+            huffman_encode(data, out);
+        } else {
+            hpack_write_int(out, data.size(), 7, 0);
+            out += data;
+        }
+    }
+
+    /**
+     * appends a header field to a header block. fields in the static table
+     * are referenced by index and everything else is sent as a literal that
+     * isn't indexed, so the encoder keeps no state and needs no table size
+     * updates however the client sizes its table
+     */
+    void hpack_encode(std::string& out, std::string_view name, std::string_view value)
+    {
+        size_t name_index = 0;
+        for (size_t n = 0; n < 61; ++n) {
+            if (hpack_static_table[n].first != name) continue;
+            if (hpack_static_table[n].second == value) {
+                hpack_write_int(out, n + 1, 7, 0x80);
+                return;
+            }
+            if (name_index == 0) name_index = n + 1;
+        }
+
+        hpack_write_int(out, name_index, 4, 0);
+        if (name_index == 0) hpack_write_string(out, name);
+        hpack_write_string(out, value);
+    }
+
+    /**
+     * decodes the header blocks of one connection, in order, keeping the
+     * dynamic table they share
+     */
+    class HpackDecoder {
+    private:
+        std::deque<HeaderField> table;  // newest first
+        size_t size;                    // of the table as the protocol counts it
+        size_t capacity;
+
+        static size_t entry_size(const HeaderField& field)
+        {
+            return field.name.size() + field.value.size() + 32;
+        }
+
+        void evict(size_t limit)
+        {
+            while (this->size > limit) {
+                this->size -= entry_size(this->table.back());
+                this->table.pop_back();
+            }
+        }
+
+        void insert(const HeaderField& field)
+        {
+            size_t needed = entry_size(field);
+            if (needed > this->capacity) {
+                this->evict(0);
+                return;
+            }
+            this->evict(this->capacity - needed);
+            this->table.push_front(field);
+            this->size += needed;
+        }
+
+        bool lookup(uint64_t index, HeaderField& field) const
+        {
+            if (index == 0) return false;
+            if (index <= 61) {
+                field.name = hpack_static_table[index - 1].first;
+                field.value = hpack_static_table[index - 1].second;
+                return true;
+            }
+            if (index - 62 >= this->table.size()) return false;
+            field = this->table[index - 62];
+            return true;
+        }
+
+        static bool read_int(std::string_view block, size_t& at, uint32_t bits, uint64_t& value)
+        {
+            if (at >= block.size()) return false;
+            uint64_t limit = (1u << bits) - 1;
+            value = static_cast<unsigned char>(block[at++]) & limit;
+            if (value < limit) return true;
+
+            for (uint32_t shift = 0; at < block.size(); shift += 7) {
+                // anything this large is an attack, not a header
+                if (shift > 28) return false;
+                unsigned char byte = block[at++];
+                value += static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (not (byte & 0x80)) return true;
+            }
+            return false;
+        }
+
+        static bool read_string(std::string_view block, size_t& at, std::string& out)
+        {
+            if (at >= block.size()) return false;
+            bool huffman = block[at] & 0x80;
+            uint64_t length;
+            if (not read_int(block, at, 7, length) || length > block.size() - at) return false;
+
+            std::string_view data = block.substr(at, length);
+            at += length;
+            out.clear();
+            if (huffman) return huffman_decode(data, out);
+            out = data;
+            return true;
+        }
+
+    public:
+        bool oversized;     // the last block decoded to more than HPACK_MAX_HEADER_LIST
+
+        HpackDecoder()
+            : size(0), capacity(HPACK_TABLE_SIZE), oversized(false)
+        {}
+
+        /**
+         * decodes a complete header block into fields, returns false if it is
+         * malformed, which breaks the connection's compression state. fields
+         * past HPACK_MAX_HEADER_LIST are decoded but not kept, see oversized
+         */
+        bool decode(std::string_view block, std::vector<HeaderField>& fields)
+        {
+            size_t at = 0;
+            size_t list_size = 0;
+            this->oversized = false;
+
+            while (at < block.size()) {
+                unsigned char first = block[at];
+                HeaderField field;
+                uint64_t index;
+
+                if (first & 0x80) {
+                    // indexed field
+                    if (not read_int(block, at, 7, index) || not this->lookup(index, field)) return false;
+                } else if ((first & 0xe0) == 0x20) {
+                    // dynamic table size update, only before the first field
+                    if (not read_int(block, at, 5, index) || index > HPACK_TABLE_SIZE || not fields.empty() || list_size) return false;
+                    this->capacity = index;
+                    this->evict(this->capacity);
+                    continue;
+                } else {
+                    // literal, with incremental indexing or not
+                    bool indexing = (first & 0xc0) == 0x40;
+                    if (not read_int(block, at, indexing ? 6 : 4, index)) return false;
+                    if (index) {
+                        if (not this->lookup(index, field)) return false;
+                    } else if (not read_string(block, at, field.name)) {
+                        return false;
+                    }
+                    if (not read_string(block, at, field.value)) return false;
+                    if (indexing) this->insert(field);
+                }
+
+                list_size += entry_size(field);
+                if (list_size > HPACK_MAX_HEADER_LIST) this->oversized = true;
+                if (not this->oversized) fields.push_back(std::move(field));
+            }
+            if (this->oversized) fields.clear();
+            return true;
+        }
+    };
+};
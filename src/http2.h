@@ -0,0 +1,1169 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <sys/eventfd.h>    // waking the connection thread
+#include <poll.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include "libs.h"
+#include "hpack.h"
+#include "request.h"
+#include "response.h"
+#include "output.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_MAX_FRAME 16384          // largest frame payload accepted, the protocol default
+#define H2_MAX_STREAMS 100          // streams a client may have open at once
+#define H2_STREAM_WINDOW 65535      // receive window of a stream until its body is read, the protocol default
+#define H2_WINDOW 1048576           // receive window of a stream while its body is read
+#define H2_WORKERS 8                // streams of a connection answered at once
+#define H2_SESSION_WINDOW ((H2_MAX_STREAMS + 1) * H2_STREAM_WINDOW + H2_WORKERS * H2_WINDOW) // receive window of the connection, room for every stream's
+#define H2_SEND_BATCH 262144        // bytes of DATA framed between writes to the socket
+#define H2_MAX_HEADER_BLOCK 65536   // bytes of a compressed header block accepted
+#define H2_READ_CHUNK 32768         // bytes read off the socket at a time
+
+// frame flags
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY 0x20
+
+namespace hussar {
+    enum class H2Frame : uint8_t {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum class H2Error : uint32_t {
+        NONE = 0x0,
+        PROTOCOL = 0x1,
+        INTERNAL = 0x2,
+        FLOW_CONTROL = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE = 0x6,
+        REFUSED_STREAM = 0x7,
+        CANCEL = 0x8,
+        COMPRESSION = 0x9,
+        ENHANCE_YOUR_CALM = 0xb,
+        HTTP_1_1_REQUIRED = 0xd
+    };
+
+    /**
+     * a stretch of a response body waiting to be framed, in memory or a
+     * range of a file. both belong to the stream's worker, which waits
+     * until the stretch is framed before letting go of it
+     */
+    struct Http2Output {
+        std::string_view data;
+        const FileBody* file = nullptr;
+        off_t offset = 0;
+        size_t length = 0;          // of the file range
+        bool last = false;          // ends the stream
+
+        size_t size() const
+        {
+            return this->file ? this->length : this->data.size();
+        }
+
+        void advance(size_t count)
+        {
+            if (this->file) {
+                this->offset += count;
+                this->length -= count;
+            } else {
+                this->data.remove_prefix(count);
+            }
+        }
+    };
+
+    /**
+     * a request on an HTTP/2 connection, from its headers until it is answered.
+     * shared by the connection thread and the stream's worker, under the
+     * session's lock
+     */
+    struct Http2Stream {
+        uint32_t id;
+        std::vector<HeaderField> headers;
+        std::optional<uint64_t> declared;   // content-length, checked against the DATA that arrives
+        uint64_t received = 0;              // body bytes that arrived
+        std::string body;                   // body bytes not read by the handler yet
+        size_t body_at = 0;                 // start of the unread body
+        int64_t send_window;                // bytes that may be sent before the client opens the window
+        int64_t recv_window;                // bytes the client may send before it is opened again
+        int64_t credit = 0;                 // bytes read or dropped the client hasn't been told of
+        bool reading = false;               // the handler is reading the body, its window is opened wide
+        bool credited = false;              // waiting for the connection thread to open the window
+        std::string block;                  // response header block waiting to be sent
+        bool block_ends = false;            // the response has no body
+        std::deque<Http2Output> output;     // response body waiting to be sent
+        bool scheduled = false;             // in the session's turns for sending
+        bool dispatched = false;            // taken by a worker
+        bool closed = false;                // all of the response was sent
+        bool ended = false;                 // the client sent all of the request
+        bool reset = false;                 // the stream was cancelled by either side
+        bool large_headers = false;         // more than HPACK_MAX_HEADER_LIST
+        bool large_body = false;            // declared as more than max_upload
+
+        /**
+         * the request as an HTTP/1.1 head for Request to parse. header names
+         * are capitalized the way Request looks for them and split cookies
+         * are joined, the body follows as the handler reads it
+         */
+        std::string request_head() const
+        {
+            std::string_view method, path, authority;
+            std::string cookies;
+            std::string fields;
+
+            for (const HeaderField& field : this->headers) {
+                const std::string& name = field.name;
+                if (name == ":method") {
+                    method = field.value;
+                } else if (name == ":path") {
+                    path = field.value;
+                } else if (name == ":authority") {
+                    authority = field.value;
+                } else if (name == "host") {
+                    if (authority.empty()) authority = field.value;
+                } else if (name == "cookie") {
+                    if (not cookies.empty()) cookies += "; ";
+                    cookies += field.value;
+                } else if (name[0] != ':') {
+                    for (size_t n = 0; n < name.size(); ++n) {
+                        fields += n == 0 || name[n - 1] == '-' ? static_cast<char>(std::toupper(name[n])) : name[n];
+                    }
+                    fields += ": ";
+                    fields += field.value;
+                    fields += "\r\n";
+                }
+            }
+
+            std::string head;
+            head.reserve(method.size() + path.size() + authority.size() + cookies.size() + fields.size() + 64);
+            head += method;
+            head += ' ';
+            head += path;
+            head += " HTTP/1.1\r\nHost: ";
+            head += authority;
+            head += "\r\n";
+            if (not cookies.empty()) {
+                head += "Cookie: ";
+                head += cookies;
+                head += "\r\n";
+            }
+            head += fields;
+            head += "\r\n";
+            return head;
+        }
+    };
+
+    /**
+     * the HTTP/2 framing layer of one connection.
+     *
+     * the connection's thread does all of its reading and writing in run(),
+     * a TLS connection can't be shared between threads. a stream is handed
+     * to one of up to H2_WORKERS workers once its headers are in, where the
+     * handler reads the body as the client sends it and queues the
+     * response. the connection thread frames what the streams queued a
+     * DATA frame each in turn, as far as flow control allows, so a slow
+     * handler or a large response holds up only its own stream.
+     *
+     * a stream's window is only opened as its handler reads the body, and
+     * the connection's window has room for every stream's at once, so
+     * however many streams a client opens it can't make the session hold
+     * more than H2_SESSION_WINDOW bytes of bodies.
+     */
+    class Http2Session {
+    public:
+        using handler = std::function<void (Http2Session& session, Http2Stream& stream)>;
+
+    private:
+        int client;
+        SSL* ssl;
+        OutputQueue& out;
+        uint64_t max_body;
+        handler serve;                  // answers a stream, on a worker
+
+        std::string input;
+        size_t input_at;                // start of the unread input
+        HpackDecoder decoder;
+        std::map<uint32_t, Http2Stream> streams;
+        std::deque<uint32_t> ready;     // streams waiting for a worker, in order
+        uint32_t last_stream;           // highest stream the client opened
+        int64_t send_window;            // connection window for sending
+        int64_t recv_window;            // connection window for receiving
+        int64_t credit;                 // bytes read or dropped the client hasn't been told of
+        int64_t initial_window;         // the client's window for new streams
+        uint32_t max_frame;             // largest frame the client accepts
+
+        std::string block;              // header block being collected
+        uint32_t block_stream;          // its stream, 0 when there is none
+        bool block_ends_stream;
+
+        std::mutex mtx;                 // guards the streams and everything else the workers touch
+        std::condition_variable changed;
+        int wakefd;                     // a worker wakes the connection thread with it
+        std::vector<std::thread> workers;
+        size_t idle;                    // workers waiting for a stream
+        std::deque<uint32_t> sending;   // streams with output queued, in turn
+        std::vector<uint32_t> credited; // streams whose window is to be opened
+        std::vector<std::pair<uint32_t, H2Error>> resets;   // streams workers let go of early
+
+        bool going_away;                // the client sent GOAWAY
+        bool failed;
+        bool done;                      // run() is over, the workers stop
+
+        static uint32_t read_u32(const char* data)
+        {
+            const unsigned char* d = reinterpret_cast<const unsigned char*>(data);
+            return static_cast<uint32_t>(d[0]) << 24 | d[1] << 16 | d[2] << 8 | d[3];
+        }
+
+        static void write_u32(std::string& out, uint32_t value)
+        {
+            out += static_cast<char>(value >> 24);
+            out += static_cast<char>(value >> 16);
+            out += static_cast<char>(value >> 8);
+            out += static_cast<char>(value);
+        }
+
+        static std::string frame_head(H2Frame type, uint8_t flags, uint32_t stream, size_t length)
+        {
+            std::string head;
+            head += static_cast<char>(length >> 16);
+            head += static_cast<char>(length >> 8);
+            head += static_cast<char>(length);
+            head += static_cast<char>(type);
+            head += static_cast<char>(flags);
+            write_u32(head, stream & 0x7fffffff);
+            return head;
+        }
+
+        void send_frame(H2Frame type, uint8_t flags, uint32_t stream, std::string_view payload = {})
+        {
+            std::string frame = frame_head(type, flags, stream, payload.size());
+            frame += payload;
+            this->out.push(std::move(frame));
+        }
+
+        void send_window_update(uint32_t stream, uint32_t increment)
+        {
+            std::string payload;
+            write_u32(payload, increment);
+            this->send_frame(H2Frame::WINDOW_UPDATE, 0, stream, payload);
+        }
+
+        void wake()
+        {
+            uint64_t one = 1;
+            ssize_t status = ::write(this->wakefd, &one, sizeof(one));
+            (void)status;
+        }
+
+        /**
+         * drops a stream cancelled by either side. one a worker has is only
+         * marked, the worker lets go of it
+         */
+        void cancel(Http2Stream& stream)
+        {
+            if (stream.dispatched) {
+                stream.reset = true;
+                this->changed.notify_all();
+                return;
+            }
+            this->credit += stream.body.size() - stream.body_at;
+            this->streams.erase(stream.id);
+        }
+
+        void reset_stream(uint32_t stream, H2Error error)
+        {
+            std::string payload;
+            write_u32(payload, static_cast<uint32_t>(error));
+            this->send_frame(H2Frame::RST_STREAM, 0, stream, payload);
+
+            auto s = this->streams.find(stream);
+            if (s != this->streams.end()) this->cancel(s->second);
+        }
+
+        /**
+         * sends GOAWAY and gives up on the connection, always returns false
+         */
+        bool connection_error(H2Error error)
+        {
+            if (this->failed) return false;
+            std::string payload;
+            write_u32(payload, this->last_stream);
+            write_u32(payload, static_cast<uint32_t>(error));
+            this->send_frame(H2Frame::GOAWAY, 0, 0, payload);
+            this->out.flush();
+            this->failed = true;
+            this->changed.notify_all();
+            return false;
+        }
+
+        // reads until count unread bytes are buffered
+        bool fill(size_t count)
+        {
+            if (this->input_at == this->input.size()) {
+                this->input.clear();
+                this->input_at = 0;
+            } else if (this->input_at > H2_READ_CHUNK) {
+                this->input.erase(0, this->input_at);
+                this->input_at = 0;
+            }
+
+            while (this->input.size() - this->input_at < count) {
+                size_t old_size = this->input.size();
+                this->input.resize(old_size + H2_READ_CHUNK);
+                ssize_t status;
+                do {
+                    status = this->ssl
+                        ? SSL_read(this->ssl, this->input.data() + old_size, H2_READ_CHUNK)
+                        : ::read(this->client, this->input.data() + old_size, H2_READ_CHUNK);
+                } while (not this->ssl && status < 0 && errno == EINTR);
+                this->input.resize(old_size + std::max<ssize_t>(status, 0));
+                if (status <= 0) return false;
+            }
+            return true;
+        }
+
+        static uint32_t frame_length(const char* head)
+        {
+            return static_cast<unsigned char>(head[0]) << 16 | static_cast<unsigned char>(head[1]) << 8 | static_cast<unsigned char>(head[2]);
+        }
+
+        // reads until the next frame is buffered whole, one that's too long is left for read_frame() to refuse
+        bool fill_frame()
+        {
+            if (not this->fill(9)) return false;
+            uint32_t length = frame_length(this->input.data() + this->input_at);
+            return length > H2_MAX_FRAME || this->fill(9 + length);
+        }
+
+        /**
+         * waits for the client to send something or a worker to wake the
+         * connection thread, or only checks with block false. returns true
+         * if there's input to read
+         */
+        bool wait_input(bool block)
+        {
+            if (this->input_at < this->input.size() || (this->ssl && SSL_has_pending(this->ssl))) return true;
+
+            pollfd fds[2] = { { this->client, POLLIN, 0 }, { this->wakefd, POLLIN, 0 } };
+            if (poll(fds, 2, block ? -1 : 0) < 0) {
+                // anything but an interruption shows up as a failed read
+                return errno != EINTR;
+            }
+            if (fds[1].revents & POLLIN) {
+                uint64_t value;
+                ssize_t status = ::read(this->wakefd, &value, sizeof(value));
+                (void)status;
+            }
+            return fds[0].revents != 0;
+        }
+
+        /**
+         * acts on the frame fill_frame() buffered, returns false once the connection is done
+         */
+        bool read_frame()
+        {
+            const char* head = this->input.data() + this->input_at;
+            uint32_t length = frame_length(head);
+            H2Frame type = static_cast<H2Frame>(head[3]);
+            uint8_t flags = head[4];
+            uint32_t stream = read_u32(head + 5) & 0x7fffffff;
+
+            if (length > H2_MAX_FRAME) return this->connection_error(H2Error::FRAME_SIZE);
+            std::string_view payload(this->input.data() + this->input_at + 9, length);
+            this->input_at += 9 + length;
+
+            // nothing may come between the frames of a header block
+            if (this->block_stream && (type != H2Frame::CONTINUATION || stream != this->block_stream)) {
+                return this->connection_error(H2Error::PROTOCOL);
+            }
+
+            switch (type) {
+                case H2Frame::DATA:
+                    return this->on_data(flags, stream, payload);
+                case H2Frame::HEADERS:
+                    return this->on_headers(flags, stream, payload);
+                case H2Frame::CONTINUATION:
+                    if (this->block_stream == 0) return this->connection_error(H2Error::PROTOCOL);
+                    if (this->block.size() + payload.size() > H2_MAX_HEADER_BLOCK) return this->connection_error(H2Error::ENHANCE_YOUR_CALM);
+                    this->block += payload;
+                    return (flags & H2_END_HEADERS) ? this->end_headers() : true;
+                case H2Frame::PRIORITY:
+                    if (stream == 0) return this->connection_error(H2Error::PROTOCOL);
+                    if (length != 5) return this->connection_error(H2Error::FRAME_SIZE);
+                    return true;
+                case H2Frame::RST_STREAM:
+                    if (stream == 0 || stream > this->last_stream) return this->connection_error(H2Error::PROTOCOL);
+                    if (length != 4) return this->connection_error(H2Error::FRAME_SIZE);
+                    if (auto s = this->streams.find(stream); s != this->streams.end()) this->cancel(s->second);
+                    return true;
+                case H2Frame::SETTINGS:
+                    return this->on_settings(flags, stream, payload);
+                case H2Frame::PUSH_PROMISE:
+                    return this->connection_error(H2Error::PROTOCOL);
+                case H2Frame::PING:
+                    if (stream != 0) return this->connection_error(H2Error::PROTOCOL);
+                    if (length != 8) return this->connection_error(H2Error::FRAME_SIZE);
+                    if (not (flags & H2_ACK)) this->send_frame(H2Frame::PING, H2_ACK, 0, payload);
+                    return true;
+                case H2Frame::GOAWAY:
+                    if (stream != 0) return this->connection_error(H2Error::PROTOCOL);
+                    this->going_away = true;
+                    return true;
+                case H2Frame::WINDOW_UPDATE:
+                    return this->on_window_update(stream, payload);
+                default:
+                    return true; // unknown frame types are ignored
+            }
+        }
+
+        /**
+         * strips the padding of a DATA or HEADERS frame, returns false if
+         * the padding is longer than the frame
+         */
+        static bool unpad(uint8_t flags, std::string_view& payload)
+        {
+            if (not (flags & H2_PADDED)) return true;
+            if (payload.empty()) return false;
+            size_t padding = static_cast<unsigned char>(payload[0]);
+            if (padding >= payload.size()) return false;
+            payload = payload.substr(1, payload.size() - 1 - padding);
+            return true;
+        }
+
+        // hands a stream to a worker, starting another if every one is busy
+        void dispatch(Http2Stream& stream)
+        {
+            this->ready.push_back(stream.id);
+            if (this->ready.size() > this->idle && this->workers.size() < H2_WORKERS) {
+                this->workers.emplace_back(&Http2Session::work, this);
+            }
+            this->changed.notify_all();
+        }
+
+        // the client sent the last of the request, a body short of its content-length is malformed
+        void end_stream(Http2Stream& stream)
+        {
+            stream.ended = true;
+            this->changed.notify_all();
+            if (stream.declared && stream.received != *stream.declared) this->reset_stream(stream.id, H2Error::PROTOCOL);
+        }
+
+        bool on_data(uint8_t flags, uint32_t id, std::string_view payload)
+        {
+            if (id == 0) return this->connection_error(H2Error::PROTOCOL);
+
+            // the whole frame counts against the windows, padding included
+            size_t length = payload.size();
+            this->recv_window -= length;
+            if (this->recv_window < 0) return this->connection_error(H2Error::FLOW_CONTROL);
+            if (not unpad(flags, payload)) return this->connection_error(H2Error::PROTOCOL);
+            // padding is never held, it's given back with the next window update
+            this->credit += length - payload.size();
+
+            auto found = this->streams.find(id);
+            if (found == this->streams.end() || found->second.reset) {
+                // a stream already answered or reset may still have data in flight
+                this->credit += payload.size();
+                return id <= this->last_stream ? true : this->connection_error(H2Error::PROTOCOL);
+            }
+
+            Http2Stream& stream = found->second;
+            if (stream.ended) {
+                this->credit += payload.size();
+                this->reset_stream(id, H2Error::STREAM_CLOSED);
+                return true;
+            }
+            stream.recv_window -= length;
+            stream.credit += length - payload.size();
+            stream.received += payload.size();
+            if (stream.recv_window < 0 || (stream.declared && stream.received > *stream.declared)) {
+                this->credit += payload.size();
+                this->reset_stream(id, stream.recv_window < 0 ? H2Error::FLOW_CONTROL : H2Error::PROTOCOL);
+                return true;
+            }
+
+            stream.body += payload;
+            this->changed.notify_all();
+            if (flags & H2_END_STREAM) this->end_stream(stream);
+            return true;
+        }
+
+        bool on_headers(uint8_t flags, uint32_t id, std::string_view payload)
+        {
+            if (id == 0) return this->connection_error(H2Error::PROTOCOL);
+            if (not unpad(flags, payload)) return this->connection_error(H2Error::PROTOCOL);
+            if (flags & H2_PRIORITY) {
+                if (payload.size() < 5) return this->connection_error(H2Error::PROTOCOL);
+                payload.remove_prefix(5);
+            }
+
+            this->block.assign(payload);
+            this->block_stream = id;
+            this->block_ends_stream = flags & H2_END_STREAM;
+            return (flags & H2_END_HEADERS) ? this->end_headers() : true;
+        }
+
+        // lowercase tchar from RFC 9110 5.6.2, the only characters allowed in a field name
+        static bool name_char(char c)
+        {
+            return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || std::string_view("!#$%&'*+-.^_`|~").find(c) != std::string_view::npos;
+        }
+
+        /**
+         * checks the fields of a request against RFC 9113 8.2 before they're
+         * turned into an HTTP/1.1 head. names are lowercase tokens, with
+         * pseudo-headers before the rest. values hold no line break or NUL
+         * and no whitespace at either end, pseudo-header values none at all.
+         * connection-specific fields aren't allowed
+         */
+        static bool valid_fields(const std::vector<HeaderField>& fields)
+        {
+            bool regular = false;
+            for (const HeaderField& field : fields) {
+                std::string_view name = field.name;
+                bool pseudo = name.starts_with(':');
+                if (pseudo) {
+                    if (regular) return false;
+                    name.remove_prefix(1);
+                } else {
+                    regular = true;
+                }
+                if (name.empty()) return false;
+                for (char c : name) {
+                    if (not name_char(c)) return false;
+                }
+
+                const std::string& value = field.value;
+                for (unsigned char c : value) {
+                    if (c == '\r' || c == '\n' || c == '\0') return false;
+                    if (pseudo && (c <= ' ' || c == 0x7f)) return false;
+                }
+                if (not value.empty() && (value.front() == ' ' || value.front() == '\t' || value.back() == ' ' || value.back() == '\t')) {
+                    return false;
+                }
+
+                if (name == "connection" || name == "transfer-encoding" || name == "keep-alive" || name == "upgrade" || name == "proxy-connection") {
+                    return false;
+                }
+                if (name == "te" && value != "trailers") return false;
+            }
+            return true;
+        }
+
+        bool end_headers()
+        {
+            std::vector<HeaderField> fields;
+            bool decoded = this->decoder.decode(this->block, fields);
+            uint32_t id = this->block_stream;
+            this->block_stream = 0;
+            this->block.clear();
+            if (not decoded) return this->connection_error(H2Error::COMPRESSION);
+
+            auto found = this->streams.find(id);
+            if (found != this->streams.end()) {
+                // trailers, they have to end the request and are dropped
+                Http2Stream& stream = found->second;
+                if (stream.reset) return true;
+                if (stream.ended) {
+                    this->reset_stream(id, H2Error::STREAM_CLOSED);
+                } else if (not this->block_ends_stream) {
+                    this->reset_stream(id, H2Error::PROTOCOL);
+                } else {
+                    this->end_stream(stream);
+                }
+                return true;
+            }
+
+            if (id % 2 == 0) return this->connection_error(H2Error::PROTOCOL);
+            if (id <= this->last_stream) return true; // trailers of a stream already answered
+            this->last_stream = id;
+
+            if (this->going_away) return true;
+            if (this->streams.size() >= H2_MAX_STREAMS) {
+                this->reset_stream(id, H2Error::REFUSED_STREAM);
+                return true;
+            }
+            if (not valid_fields(fields)) {
+                this->reset_stream(id, H2Error::PROTOCOL);
+                return true;
+            }
+
+            Http2Stream& stream = this->streams[id];
+            stream.id = id;
+            stream.headers = std::move(fields);
+            stream.send_window = this->initial_window;
+            stream.recv_window = H2_STREAM_WINDOW;
+            stream.ended = this->block_ends_stream;
+            stream.large_headers = this->decoder.oversized;
+            for (const HeaderField& field : stream.headers) {
+                uint64_t length;
+                const char* end = field.value.data() + field.value.size();
+                auto [ptr, error] = std::from_chars(field.value.data(), end, length);
+                if (field.name == "content-length" && error == std::errc() && ptr == end) {
+                    stream.declared = length;
+                    // a body announced as too large is refused before any of it arrives
+                    if (length > this->max_body) stream.large_body = true;
+                }
+            }
+            if (stream.ended && stream.declared.value_or(0) != 0) {
+                this->reset_stream(id, H2Error::PROTOCOL);
+                return true;
+            }
+            this->dispatch(stream);
+            return true;
+        }
+
+        bool on_settings(uint8_t flags, uint32_t stream, std::string_view payload)
+        {
+            if (stream != 0) return this->connection_error(H2Error::PROTOCOL);
+            if (flags & H2_ACK) {
+                return payload.empty() ? true : this->connection_error(H2Error::FRAME_SIZE);
+            }
+            if (payload.size() % 6) return this->connection_error(H2Error::FRAME_SIZE);
+
+            for (size_t n = 0; n < payload.size(); n += 6) {
+                uint16_t id = static_cast<unsigned char>(payload[n]) << 8 | static_cast<unsigned char>(payload[n + 1]);
+                uint32_t value = read_u32(payload.data() + n + 2);
+                switch (id) {
+                    case 0x2: // ENABLE_PUSH, nothing is pushed anyway
+                        if (value > 1) return this->connection_error(H2Error::PROTOCOL);
+                        break;
+                    case 0x4: { // INITIAL_WINDOW_SIZE, applies to open streams too
+                        if (value > 0x7fffffff) return this->connection_error(H2Error::FLOW_CONTROL);
+                        int64_t delta = static_cast<int64_t>(value) - this->initial_window;
+                        for (auto& [id, s] : this->streams) {
+                            s.send_window += delta;
+                            if (s.send_window > 0x7fffffff) return this->connection_error(H2Error::FLOW_CONTROL);
+                        }
+                        this->initial_window = value;
+                        break;
+                    }
+                    case 0x5: // MAX_FRAME_SIZE
+                        if (value < 16384 || value > 16777215) return this->connection_error(H2Error::PROTOCOL);
+                        this->max_frame = value;
+                        break;
+                    default: // the header table size doesn't matter to an encoder that never indexes
+                        break;
+                }
+            }
+            this->send_frame(H2Frame::SETTINGS, H2_ACK, 0);
+            return true;
+        }
+
+        bool on_window_update(uint32_t id, std::string_view payload)
+        {
+            if (payload.size() != 4) return this->connection_error(H2Error::FRAME_SIZE);
+            uint32_t increment = read_u32(payload.data()) & 0x7fffffff;
+
+            if (id == 0) {
+                if (increment == 0) return this->connection_error(H2Error::PROTOCOL);
+                this->send_window += increment;
+                if (this->send_window > 0x7fffffff) return this->connection_error(H2Error::FLOW_CONTROL);
+                return true;
+            }
+
+            auto found = this->streams.find(id);
+            if (found == this->streams.end()) return true;
+            if (increment == 0) {
+                this->reset_stream(id, H2Error::PROTOCOL);
+                return true;
+            }
+            found->second.send_window += increment;
+            if (found->second.send_window > 0x7fffffff) this->reset_stream(id, H2Error::FLOW_CONTROL);
+            return true;
+        }
+
+        /**
+         * tells the client of the windows opened as bodies were read, and
+         * resets the streams workers let go of early
+         */
+        void send_updates()
+        {
+            for (auto [id, error] : this->resets) {
+                std::string payload;
+                write_u32(payload, static_cast<uint32_t>(error));
+                this->send_frame(H2Frame::RST_STREAM, 0, id, payload);
+            }
+            this->resets.clear();
+
+            bool opened = false;
+            for (uint32_t id : this->credited) {
+                auto found = this->streams.find(id);
+                if (found == this->streams.end()) continue;
+                Http2Stream& stream = found->second;
+                stream.credited = false;
+                // the client has nothing left to send on an ended stream
+                if (stream.credit > 0 && not stream.ended && not stream.reset) {
+                    this->send_window_update(id, stream.credit);
+                    stream.recv_window += stream.credit;
+                    opened = true;
+                }
+                stream.credit = 0;
+            }
+            this->credited.clear();
+
+            if (this->credit >= H2_STREAM_WINDOW || (opened && this->credit > 0)) {
+                this->send_window_update(0, this->credit);
+                this->recv_window += this->credit;
+                this->credit = 0;
+            }
+        }
+
+        // largest DATA payload sent, a frame and its head fit in one TLS record
+        size_t data_frame_size() const
+        {
+            return std::min<size_t>(this->max_frame, OUTPUT_TLS_RECORD - 9);
+        }
+
+        // sends the stream's response header block, in as many frames as it needs
+        void send_block(Http2Stream& stream, size_t& framed)
+        {
+            std::string_view rest = stream.block;
+            size_t piece = std::min<size_t>(rest.size(), this->max_frame);
+            this->send_frame(H2Frame::HEADERS, (stream.block_ends ? H2_END_STREAM : 0) | (piece == rest.size() ? H2_END_HEADERS : 0), stream.id, rest.substr(0, piece));
+            rest.remove_prefix(piece);
+            while (not rest.empty()) {
+                piece = std::min<size_t>(rest.size(), this->max_frame);
+                this->send_frame(H2Frame::CONTINUATION, piece == rest.size() ? H2_END_HEADERS : 0, stream.id, rest.substr(0, piece));
+                rest.remove_prefix(piece);
+            }
+
+            framed += stream.block.size();
+            stream.block.clear();
+            if (stream.block_ends) stream.closed = true;
+        }
+
+        /**
+         * sends a DATA frame of the stream's output, returns false if the
+         * windows don't let any of it through
+         */
+        bool send_piece(Http2Stream& stream, size_t& framed)
+        {
+            Http2Output& piece = stream.output.front();
+            size_t size = piece.size();
+            int64_t window = std::min(stream.send_window, this->send_window);
+            if (size > 0 && window <= 0) return false;
+
+            size_t take = std::min<size_t>({ size, static_cast<size_t>(std::max<int64_t>(window, 0)), this->data_frame_size() });
+            bool end = piece.last && take == size;
+            std::string frame = frame_head(H2Frame::DATA, end ? H2_END_STREAM : 0, stream.id, take);
+            if (piece.file) {
+                frame.resize(9 + take);
+                for (size_t got = 0; got < take; ) {
+                    ssize_t status = pread(piece.file->fd, frame.data() + 9 + got, take - got, piece.offset + got);
+                    if (status < 0 && errno == EINTR) continue;
+                    if (status <= 0) {
+                        // the file shrank or can't be read
+                        this->reset_stream(stream.id, H2Error::INTERNAL);
+                        return true;
+                    }
+                    got += status;
+                }
+            } else {
+                frame += piece.data.substr(0, take);
+            }
+            this->out.push(std::move(frame));
+
+            stream.send_window -= take;
+            this->send_window -= take;
+            framed += take;
+            piece.advance(take);
+            if (piece.size() == 0) stream.output.pop_front();
+            if (end) stream.closed = true;
+            return true;
+        }
+
+        /**
+         * frames the output the workers queued, a frame per stream in turn
+         * as far as the windows allow, so one large response doesn't hold up
+         * the rest. the frames are copies, a worker gets its output back as
+         * soon as it's framed. returns true if it stopped at H2_SEND_BATCH
+         * with more that could be sent
+         */
+        bool send_output()
+        {
+            size_t framed = 0;
+            bool progress = true;
+            while (progress && framed < H2_SEND_BATCH) {
+                progress = false;
+                for (size_t turns = this->sending.size(); turns > 0; --turns) {
+                    uint32_t id = this->sending.front();
+                    this->sending.pop_front();
+                    auto found = this->streams.find(id);
+                    if (found == this->streams.end()) continue;
+                    Http2Stream& stream = found->second;
+
+                    if (not stream.reset && not stream.block.empty()) {
+                        this->send_block(stream, framed);
+                        progress = true;
+                    } else if (not stream.reset && not stream.output.empty()) {
+                        progress = this->send_piece(stream, framed) || progress;
+                    }
+
+                    if (not stream.reset && (not stream.block.empty() || not stream.output.empty())) {
+                        this->sending.push_back(id);
+                    } else {
+                        // its worker waits for all of it to go out
+                        stream.scheduled = false;
+                        this->changed.notify_all();
+                    }
+                }
+            }
+            return progress;
+        }
+
+        // schedules the stream's queued output and waits until it's all framed, false if the stream or the connection went away
+        bool drain(std::unique_lock<std::mutex>& hold, Http2Stream& stream)
+        {
+            if (not stream.scheduled) {
+                stream.scheduled = true;
+                this->sending.push_back(stream.id);
+            }
+            this->wake();
+            this->changed.wait(hold, [this, &stream] {
+                return (stream.block.empty() && stream.output.empty()) || stream.reset || this->failed;
+            });
+            return not stream.reset && not this->failed;
+        }
+
+        // queues a piece of the response body, empty ones are only kept to end the stream
+        static void queue(Http2Stream& stream, Http2Output piece)
+        {
+            if (piece.size() || piece.last) stream.output.push_back(piece);
+        }
+
+        // asks the connection thread to open the window of a stream being read, once there's enough to be worth a frame
+        void open_window(Http2Stream& stream)
+        {
+            bool starved = stream.body_at == stream.body.size();
+            if (stream.credited || stream.credit <= 0 || (stream.credit < H2_WINDOW / 4 && not starved)) return;
+            stream.credited = true;
+            this->credited.push_back(stream.id);
+            this->wake();
+        }
+
+        // a worker, answering streams until the session is over
+        void work()
+        {
+            while (Http2Stream* stream = this->take()) {
+                try {
+                    this->serve(*this, *stream);
+                } catch (...) {
+                    // released below, a response that never went out is reset
+                }
+                this->release(*stream);
+            }
+        }
+
+        // waits for a stream to answer, null once the session is over
+        Http2Stream* take()
+        {
+            std::unique_lock<std::mutex> hold(this->mtx);
+            while (not this->done && not this->failed) {
+                while (not this->ready.empty()) {
+                    auto found = this->streams.find(this->ready.front());
+                    this->ready.pop_front();
+                    if (found != this->streams.end()) {
+                        found->second.dispatched = true;
+                        return &found->second;
+                    }
+                }
+                ++this->idle;
+                this->changed.wait(hold);
+                --this->idle;
+            }
+            return nullptr;
+        }
+
+        /**
+         * lets go of a stream once its handler is done. a response that
+         * didn't all go out is reset, and so is a request answered before
+         * all of it arrived, the client has nothing more to send
+         */
+        void release(Http2Stream& stream)
+        {
+            std::lock_guard<std::mutex> hold(this->mtx);
+            if (not stream.reset && not stream.closed) {
+                this->resets.emplace_back(stream.id, H2Error::INTERNAL);
+            } else if (not stream.reset && not stream.ended) {
+                this->resets.emplace_back(stream.id, H2Error::NONE);
+            }
+            this->credit += stream.body.size() - stream.body_at;
+            this->streams.erase(stream.id);
+            this->wake();
+        }
+
+        /**
+         * appends the header lines of an HTTP/1.1 head to a header block,
+         * with the names lowercased and the hop-by-hop headers left out
+         */
+        static void encode_lines(std::string& block, std::string_view lines)
+        {
+            std::string name;
+            while (not lines.empty()) {
+                size_t end = lines.find("\r\n");
+                std::string_view line = lines.substr(0, end);
+                lines = end == std::string_view::npos ? std::string_view() : lines.substr(end + 2);
+
+                size_t colon = line.find(':');
+                if (colon == std::string_view::npos || colon == 0) continue;
+                name.assign(line.substr(0, colon));
+                for (char& c : name) c = static_cast<char>(std::tolower(c));
+                if (name == "connection" || name == "keep-alive" || name == "transfer-encoding" || name == "upgrade") continue;
+                hpack_encode(block, name, trim(line.substr(colon + 1)));
+            }
+        }
+
+    public:
+        Http2Session(int client, SSL* ssl, OutputQueue& out, uint64_t max_body, handler serve)
+            : client(client), ssl(ssl), out(out), max_body(max_body), serve(std::move(serve)), input_at(0), last_stream(0),
+              send_window(65535), recv_window(65535), credit(0), initial_window(65535), max_frame(16384),
+              block_stream(0), block_ends_stream(false), wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), idle(0),
+              going_away(false), failed(false), done(false)
+        {}
+
+        ~Http2Session()
+        {
+            if (this->wakefd >= 0) ::close(this->wakefd);
+        }
+
+        // delete copy constructors
+        Http2Session(Http2Session& s) = delete;
+        Http2Session(const Http2Session& s) = delete;
+        Http2Session& operator=(Http2Session& s) = delete;
+        Http2Session& operator=(const Http2Session& s) = delete;
+
+        /**
+         * reads the client's connection preface and sends the server's
+         * settings, returns false if the client doesn't speak HTTP/2
+         */
+        bool start()
+        {
+            constexpr std::string_view preface = H2_PREFACE;
+            if (this->wakefd < 0 || not this->fill(preface.size()) || std::string_view(this->input).substr(0, preface.size()) != preface) {
+                return false;
+            }
+            this->input_at = preface.size();
+
+            // streams keep the protocol's default window, H2_STREAM_WINDOW, until they're read
+            std::string settings;
+            auto setting = [&settings](uint16_t id, uint32_t value) {
+                settings += static_cast<char>(id >> 8);
+                settings += static_cast<char>(id);
+                write_u32(settings, value);
+            };
+            setting(0x3, H2_MAX_STREAMS);           // MAX_CONCURRENT_STREAMS
+            setting(0x6, HPACK_MAX_HEADER_LIST);    // MAX_HEADER_LIST_SIZE
+            this->send_frame(H2Frame::SETTINGS, 0, 0, settings);
+            this->send_window_update(0, H2_SESSION_WINDOW - this->recv_window);
+            this->recv_window = H2_SESSION_WINDOW;
+            return this->out.flush();
+        }
+
+        /**
+         * reads frames and sends what the workers queued until the
+         * connection ends, on the connection's thread. returns once every
+         * worker is done
+         */
+        void run()
+        {
+            std::unique_lock<std::mutex> hold(this->mtx);
+            while (true) {
+                this->send_updates();
+                bool more = this->send_output();
+                bool finished = this->failed || (this->going_away && this->streams.empty());
+                hold.unlock();
+
+                // the socket is only used outside the lock, so workers never wait on the client
+                bool good = this->out.flush();
+                bool readable = good && not finished && this->wait_input(not more);
+                if (readable) good = this->fill_frame();
+
+                hold.lock();
+                if (not good) this->failed = true;
+                if (finished || this->failed) break;
+                if (readable) this->read_frame();
+            }
+
+            this->done = true;
+            this->changed.notify_all();
+            hold.unlock();
+            for (std::thread& worker : this->workers) {
+                worker.join();
+            }
+        }
+
+        /**
+         * reads up to count bytes of the stream's body into dst, on its
+         * worker. waits for the client to send more, the stream's window is
+         * opened as the body is read. returns 0 at the end of the body and
+         * -1 if the stream was reset or the connection failed
+         */
+        ssize_t read(Http2Stream& stream, char* dst, size_t count)
+        {
+            std::unique_lock<std::mutex> hold(this->mtx);
+            if (not stream.reading) {
+                // the handler wants the body, so more of it may be in flight than for a stream waiting its turn
+                stream.reading = true;
+                stream.credit += H2_WINDOW - H2_STREAM_WINDOW;
+                this->open_window(stream);
+            }
+            this->changed.wait(hold, [this, &stream] {
+                return stream.body_at < stream.body.size() || stream.ended || stream.reset || this->failed;
+            });
+            if (stream.reset || this->failed) return -1;
+
+            size_t take = std::min(count, stream.body.size() - stream.body_at);
+            if (take == 0) return 0;
+            std::memcpy(dst, stream.body.data() + stream.body_at, take);
+            stream.body_at += take;
+            if (stream.body_at == stream.body.size()) {
+                stream.body.clear();
+                stream.body_at = 0;
+            } else if (stream.body_at > stream.body.size() / 2) {
+                stream.body.erase(0, stream.body_at);
+                stream.body_at = 0;
+            }
+
+            stream.credit += take;
+            this->credit += take;
+            this->open_window(stream);
+            return take;
+        }
+
+        /**
+         * queues the response on the stream and waits until it's all framed,
+         * on the stream's worker. returns false if the stream was reset or
+         * the connection failed. the head is serialized as it would be for
+         * HTTP/1.1 and its lines become the header block, so responses built
+         * for either protocol, including cached ones, look the same
+         */
+        bool respond(Http2Stream& stream, Request& req, Response& resp)
+        {
+            std::string head;
+            auto iov = resp.serialize(head);
+            std::string_view entity(static_cast<char*>(iov[1].iov_base), iov[1].iov_len);
+            bool head_only = req.method_id == Method::HEAD;
+
+            std::string block;
+            hpack_encode(block, ":status", resp.code);
+            encode_lines(block, std::string_view(head).substr(head.find("\r\n") + 2));
+
+            std::string_view body = entity;
+            if (resp.prebuilt) {
+                // a cached entity carries its own headers ahead of the body
+                size_t end = entity.find("\r\n\r\n");
+                encode_lines(block, entity.substr(0, end));
+                body = end == std::string_view::npos ? std::string_view() : entity.substr(end + 4);
+                if (head_only) body = {};
+            }
+
+            bool has_body = not head_only && (not body.empty() || (not resp.prebuilt && (not resp.parts.empty() || resp.file || resp.streaming())));
+
+            bool streamed = has_body && not resp.prebuilt && resp.parts.empty() && not resp.file && resp.streaming();
+
+            std::unique_lock<std::mutex> hold(this->mtx);
+            stream.block = std::move(block);
+            stream.block_ends = not has_body;
+            if (has_body && not streamed) {
+                if (resp.prebuilt || (resp.parts.empty() && not resp.file)) {
+                    queue(stream, { .data = body, .last = true });
+                } else if (not resp.parts.empty()) {
+                    for (auto& part : resp.parts) {
+                        if (part.file) {
+                            queue(stream, { .file = part.file.get(), .offset = part.offset, .length = part.length });
+                        } else {
+                            queue(stream, { .data = part.data });
+                        }
+                    }
+                    queue(stream, { .last = true });
+                } else {
+                    queue(stream, { .file = resp.file.get(), .offset = resp.file->offset, .length = resp.file->length, .last = true });
+                }
+            }
+            if (not this->drain(hold, stream)) return false;
+            if (not streamed) return true;
+            hold.unlock();
+
+            ResponseWriter writer([this, &stream](iovec* iov, int count) {
+                std::unique_lock<std::mutex> hold(this->mtx);
+                for (int n = 0; n < count; ++n) {
+                    queue(stream, { .data = { static_cast<char*>(iov[n].iov_base), iov[n].iov_len } });
+                }
+                return this->drain(hold, stream);
+            }, false);
+            try {
+                resp.streamer(writer);
+                if (not writer.finish()) return false;
+            } catch (...) {
+                // the status is already sent, the reset tells the client the body is cut short
+                this->refuse(stream, H2Error::INTERNAL);
+                return false;
+            }
+
+            hold.lock();
+            queue(stream, { .last = true });
+            return this->drain(hold, stream);
+        }
+
+        /**
+         * resets the stream instead of answering it or finishing its answer,
+         * on its worker
+         */
+        void refuse(Http2Stream& stream, H2Error error)
+        {
+            std::lock_guard<std::mutex> hold(this->mtx);
+            if (stream.reset) return;
+            stream.reset = true;
+            this->resets.emplace_back(stream.id, error);
+            this->wake();
+        }
+
+        /**
+         * tells the client no more streams will be taken, ahead of closing
+         */
+        void close()
+        {
+            if (this->failed) return;
+            std::string payload;
+            write_u32(payload, this->last_stream);
+            write_u32(payload, static_cast<uint32_t>(H2Error::NONE));
+            this->send_frame(H2Frame::GOAWAY, 0, 0, payload);
+            this->out.flush();
+        }
+    };
+};
@@ -22,8 +22,35 @@
 #include "response.h"
 #include "router.h"
 #include "config.h"
+#include "loop.h"
+#include "output.h"
+#include "compress.h"
+#include "docroot.h"
+#include "embedded.h"
+#include "multipart.h"
+#include "body.h"
+#include "http2.h"
+#include "websocket.h"
+#include "events.h"
+#include "proxy.h"
+#include "balancer.h"
 
 namespace hussar {
+    /**
+     * an accepted client and the queue of bytes waiting to be sent to it
+     */
+    struct Connection {
+        int client;
+        SSL* ssl;
+        char* host;
+        OutputQueue out;
+        std::string input;  // bytes read past the end of the previous request
+
+        Connection(int client, SSL* ssl, char* host, size_t max_output)
+            : client(client), ssl(ssl), host(host), out(client, ssl, max_output)
+        {}
+    };
+
     class Hussar : public Router {
     private:
         int sockfd;                     // Server socket
@@ -64,7 +91,7 @@ namespace hussar {
             if (this->config.verbosity == 1) {
                 print_lock.lock();
                 std::cout << req.remote_host <<
-                    "\t" << resp.headers["Date"] <<
+                    "\t" << http_date() <<
                     "\t" << strip_terminal_chars(req.method) <<
                     "\t" << resp.code <<
                     "\t" << strip_terminal_chars(req.document_raw) <<
@@ -83,50 +110,354 @@ namespace hussar {
         }
 
         /**
-         * checks for transfer headers and adds relevant data to the request object
+         * reads until the end of the request head, or until max_stdbuf bytes
+         * arrived without one. bytes left over from the previous request come
+         * first. returns the bytes read, 0 if the client disconnected and -1
+         * on a connection error
          */
-        void handle_transfer_headers(int client, SSL* ssl, Request& req, Response& resp)
+        ssize_t read_head(Connection* conn, std::string& raw)
         {
-            if (req.content_type.find("multipart/form-data") != std::string::npos) {
-                // get stard and end form boundary strings
-                std::vector<std::string> getting_boundary = split_string<std::string>(req.content_type, "boundary=");
-                std::string boundary = getting_boundary.back();
-                std::ostringstream oss("\r\n");
-                oss << boundary << "--\r\n";
-                std::string end_boundary = oss.str();
-
-                // if the body doesn't contain the end boundary, the socket needs to be read
-                if (req.body.size() == 0 && req.body.find(end_boundary) == std::string::npos) {
-                    oss.clear();
-                    oss.str("");
-                    char inbound[2048];
-                recv_more:
-                    std::memset(inbound, 0, 2048);
-                    int status = this->readsock(client, ssl, inbound, 2048);
-                    switch (status) {
-                        case -1:
-                            return;
-                        case 0:
-                            // exit case, no more data to read
-                            break;
-                        default:
-                            oss.write(inbound, status);
-                            // check the read data for an end boundary, if none, read socket again
-                            if (oss.view().find(end_boundary) == std::string_view::npos) {
-                                goto recv_more;
+            raw = std::move(conn->input);
+            conn->input.clear();
+
+            size_t scanned = 0;
+            while (raw.find("\r\n\r\n", scanned) == std::string::npos && raw.size() < this->config.max_stdbuf) {
+                scanned = raw.size() < 3 ? 0 : raw.size() - 3;
+                size_t old_size = raw.size();
+                raw.resize(this->config.max_stdbuf);
+                ssize_t status = this->readsock(conn->client, conn->ssl, raw.data() + old_size, raw.size() - old_size);
+                if (status <= 0) return status < 0 ? -1 : 0;
+                raw.resize(old_size + status);
+            }
+            return raw.size();
+        }
+
+        /**
+         * decides whether the request's body will be read before any of it is.
+         * a Content-Length over max_upload, a transfer coding other than
+         * chunked or an unknown expectation fills in an error response and
+         * returns false. a client waiting on "Expect: 100-continue" is told to
+         * go ahead once the body is accepted
+         */
+        bool accept_body(Connection* conn, Request& req, Response& resp)
+        {
+            bool chunked = req.chunked();
+            if (not chunked && not req.header("Transfer-Encoding").empty()) {
+                resp.code = "501";
+                resp.body = "<h1>501: Not Implemented!</h1>";
+                return false;
+            }
+
+            std::optional<uint64_t> length = chunked ? std::nullopt : req.declared_length();
+            if (length && *length > this->config.max_upload) {
+                resp.code = "413";
+                resp.body = "<h1>413: Payload Too Large!</h1>";
+                return false;
+            }
+
+            // a body framed two ways may be framed differently by a proxy in front,
+            // so nothing after it is trusted
+            if (chunked && not req.content_length.empty()) req.keep_alive = false;
+
+            std::string_view expect = req.header("Expect");
+            if (expect.empty() || req.version == "HTTP/1.0") return true;
+            if (not iequals(expect, "100-continue")) {
+                resp.code = "417";
+                resp.body = "<h1>417: Expectation Failed!</h1>";
+                return false;
+            }
+
+            // nothing to wait for if the body already arrived with the head
+            if (chunked ? req.body.empty() : length && req.body.size() < *length) {
+                // a failed write shows up as a failed read of the body
+                conn->out.push_view("HTTP/1.1 100 Continue\r\n\r\n");
+                conn->out.flush();
+            }
+            return true;
+        }
+
+        /**
+         * sorts the parts of a multipart body into the request. file parts go
+         * to req.files and plain fields to req.post, moving their contents
+         * rather than copying them. a field too large to be held in memory
+         * stays in req.files with its temp file, empty file inputs are dropped
+         */
+        void collect_parts(Request& req, std::vector<UploadedFile>& parts)
+        {
+            for (UploadedFile& part : parts) {
+                if (part.is_file || part.spilled()) {
+                    if (part.name.empty() && part.size == 0) continue; // no file was chosen
+                    req.files.emplace(part.id, std::move(part));
+                } else if (part.size && validate_param_name(part.id)) {
+                    req.post[part.id] = std::move(part.data);
+                }
+            }
+        }
+
+        /**
+         * hands the rest of the body to consume piece by piece. a chunked
+         * body growing past max_upload or with broken framing fills in an
+         * error response
+         */
+        BodyStatus drain_body(BodyReader& body, Response& resp, const std::function<void (std::string_view)>& consume)
+        {
+            std::string_view piece;
+            while (true) {
+                ssize_t status = body.next(piece);
+                if (status == 0) return BodyStatus::READ;
+                if (status == -1) return BodyStatus::FAILED;
+                if (status == -2) {
+                    resp.code = "400";
+                    resp.body = "<h1>400: Bad Request!</h1>";
+                    return BodyStatus::REJECTED;
+                }
+                if (body.size() > this->config.max_upload) {
+                    resp.code = "413";
+                    resp.body = "<h1>413: Payload Too Large!</h1>";
+                    return BodyStatus::REJECTED;
+                }
+                consume(piece);
+            }
+        }
+
+        /**
+         * writes a raw request body into an anonymous file in the sink's
+         * directory and adds it to req.files as "body". without hashing, a
+         * plain connection splices a Content-Length body from the socket into
+         * the file through a pipe so it never enters user space.
+         */
+        BodyStatus sink_body(Connection* conn, Request& req, Response& resp, const UploadSink& sink, BodyReader& body)
+        {
+            UploadedFile file;
+            file.id = "body";
+            file.name = filter_name(req.document.substr(req.document.rfind('/') + 1));
+            file.mime = req.content_type;
+            file.is_file = true;
+            file.valid = true;
+
+            // a sink that can't be written still has to consume the body
+            uint64_t reserve = body.sized() ? body.size() + body.remaining() : 0;
+            bool good = file.spill_to(sink.dir.string(), reserve) && (not sink.sha256 || file.hash_sha256());
+            good = good && file.append(req.body, 0, "");
+            req.body.clear();
+
+            if (good && not conn->ssl && not sink.sha256 && body.remaining()) {
+                int pipefd[2];
+                if (pipe2(pipefd, O_CLOEXEC) == 0) {
+                    while (good && body.remaining()) {
+                        ssize_t in = splice(conn->client, nullptr, pipefd[1], nullptr, std::min<uint64_t>(UPLOAD_READ_CHUNK, body.remaining()), SPLICE_F_MOVE | SPLICE_F_MORE);
+                        if (in < 0 && errno == EINTR) continue;
+                        if (in <= 0) {
+                            close(pipefd[0]);
+                            close(pipefd[1]);
+                            return BodyStatus::FAILED;
+                        }
+                        body.consumed(in);
+                        for (ssize_t left = in; left > 0; ) {
+                            ssize_t out = splice(pipefd[0], nullptr, file.fd, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+                            if (out < 0 && errno == EINTR) continue;
+                            if (out <= 0) {
+                                good = false;
+                                break;
                             }
+                            file.appended(out);
+                            left -= out;
+                        }
+                    }
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                }
+            }
+
+            BodyStatus status = this->drain_body(body, resp, [&](std::string_view piece) {
+                good = good && file.append(piece, 0, "");
+            });
+            if (status == BodyStatus::READ && good && file.finish()) req.files.emplace(file.id, std::move(file));
+            return status;
+        }
+
+        /**
+         * sets up the reader of an HTTP/1.1 request's body, framed by
+         * Content-Length or the chunked transfer coding. bytes read past it
+         * are kept for the next request
+         */
+        void frame_body(Connection* conn, Request& req, std::optional<BodyReader>& body)
+        {
+            bool chunked = req.chunked();
+            std::optional<uint64_t> length = chunked ? std::nullopt : req.declared_length();
+
+            // without a Content-Length or chunked coding there is no body, what came with the head is the next request
+            body.emplace(conn->client, conn->ssl, conn->input, chunked, length.value_or(0));
+        }
+
+        /**
+         * reads the rest of the request body from body. bodies without a
+         * length are held to max_upload as they grow. multipart bodies are
+         * parsed as they arrive and parts growing past upload_spill go to
+         * temp files instead of memory, or straight to the route's upload
+         * sink. a rejected body fills in an error response
+         */
+        BodyStatus read_body(Connection* conn, Request& req, Response& resp, const UploadSink* sink, BodyReader& body)
+        {
+            if (not body.start(req.body)) {
+                resp.code = "400";
+                resp.body = "<h1>400: Bad Request!</h1>";
+                return BodyStatus::REJECTED;
+            }
+            if (body.size() > this->config.max_upload) {
+                resp.code = "413";
+                resp.body = "<h1>413: Payload Too Large!</h1>";
+                return BodyStatus::REJECTED;
+            }
+
+            bool multipart = req.content_type.find("multipart/form-data") != std::string::npos;
+            bool form = req.content_type == "application/x-www-form-urlencoded";
+            if (sink && (not body.sized() || body.size() || body.remaining()) && not multipart && not form) {
+                return this->sink_body(conn, req, resp, *sink, body);
+            }
+
+            BodyStatus status;
+            if (not multipart) {
+                status = this->drain_body(body, resp, [&req](std::string_view piece) {
+                    req.body.append(piece);
+                });
+                req.parse_post();
+                return status;
+            }
+
+            MultipartParser parser(multipart_boundary(req.content_type), this->config.upload_spill, this->config.upload_dir, sink, body.sized() ? body.size() + body.remaining() : 0);
+            parser.feed(req.body);
+            req.body.clear();
+
+            // a malformed body is still read to its end so the connection stays usable
+            status = this->drain_body(body, resp, [&parser](std::string_view piece) {
+                parser.feed(piece);
+            });
+            if (status == BodyStatus::READ && not parser.failed()) this->collect_parts(req, parser.parts);
+            return status;
+        }
+
+        /**
+         * leaves the body of a stream_body route unread for the handler to
+         * pull through req.read_body(), the reader has to outlive the
+         * handler. the bytes that came with the head are decoded into
+         * req.body first, the rest is held to max_upload as it's read. a
+         * malformed start fills in an error response
+         */
+        BodyStatus open_body(Request& req, Response& resp, BodyReader& reader)
+        {
+            if (not reader.start(req.body)) {
+                resp.code = "400";
+                resp.body = "<h1>400: Bad Request!</h1>";
+                return BodyStatus::REJECTED;
+            }
+            if (reader.size() > this->config.max_upload) {
+                resp.code = "413";
+                resp.body = "<h1>413: Payload Too Large!</h1>";
+                return BodyStatus::REJECTED;
+            }
+
+            // once a read fails the reader can't be trusted to frame the body
+            req.body_source = [this, body = &reader, failed = ssize_t(0)](std::string_view& piece) mutable -> ssize_t {
+                if (failed) return failed;
+                ssize_t status = body->next(piece);
+                if (status > 0 && body->size() > this->config.max_upload) status = -3;
+                if (status < 0) failed = status;
+                return status;
+            };
+            return BodyStatus::READ;
+        }
+
+        /**
+         * a request whose coroutine route is running on the io loop
+         */
+        struct PendingRequest {
+            Connection* conn;
+            std::string raw;
+            std::unique_ptr<Request> req;
+            std::unique_ptr<Response> resp;
+        };
+
+        /**
+         * logs, serializes and sends the response
+         */
+        void respond(Connection* conn, std::string& raw_req, Request& req, Response& resp)
+        {
+            this->log(raw_req, req, resp);
+
+            std::string head;
+            auto iov = resp.serialize(head);
+            OutputQueue& out = conn->out;
+            out.push_view({ static_cast<char*>(iov[0].iov_base), iov[0].iov_len });
+            out.push_view({ static_cast<char*>(iov[1].iov_base), iov[1].iov_len });
+            if (not resp.prebuilt && req.method_id != Method::HEAD) {
+                if (not resp.parts.empty()) {
+                    for (auto& part : resp.parts) {
+                        if (part.file) {
+                            out.push(part.file, part.offset, part.length);
+                        } else {
+                            out.push_view(part.data);
+                        }
+                    }
+                } else if (resp.file) {
+                    out.push(resp.file);
+                }
+            }
+            if (not out.flush()) {
+                req.keep_alive = false;
+                return;
+            }
+
+            if (resp.streaming() && req.method_id != Method::HEAD) {
+                ResponseWriter writer([&out](iovec* iov, int count) {
+                    for (int n = 0; n < count; ++n) {
+                        out.push_view({ static_cast<char*>(iov[n].iov_base), iov[n].iov_len });
                     }
-                    req.body = oss.str();
+                    return out.flush();
+                }, resp.chunked_stream());
+                try {
+                    resp.streamer(writer);
+                } catch (...) {
+                    // the status is already sent, cut the body short so the client sees it failed
+                    req.keep_alive = false;
+                    return;
                 }
+                if (not writer.finish()) req.keep_alive = false;
+            }
+        }
 
-                // nothing to handle
-                if (req.body.size() == 0) return;
-                
-                // emplace an UploadedFile into the files vector in request object
-                UploadedFile u_f(boundary, req.body);
-                if (u_f.valid) {
-                    req.files.emplace(std::make_pair(u_f.id, std::move(u_f)));
+        /**
+         * starts a coroutine route, the pool thread is released as soon as the
+         * coroutine suspends and the connection resumes on the pool once it finishes
+         */
+        void route_async(const Route* r, PendingRequest* pending)
+        {
+            spawn(r->run_async(*pending->req, *pending->resp), [this, pending](std::exception_ptr error) {
+                if (error) {
+                    Response& resp = *pending->resp;
+                    resp.code = "500";
+                    resp.headers["Content-Type"] = "text/html";
+                    resp.body = "<h1>500: Internal Server Error</h1>";
                 }
+                this->thread_pool.dispatch(&Hussar::finish_async, this, pending);
+            });
+        }
+
+        /**
+         * sends the response of a finished coroutine route and carries on with the connection
+         */
+        void finish_async(PendingRequest* pending)
+        {
+            Connection* conn = pending->conn;
+
+            this->respond(conn, pending->raw, *pending->req, *pending->resp);
+            bool keep_alive = pending->req->keep_alive;
+            delete pending;
+
+            if (keep_alive) {
+                this->serve_connection(conn);
+            } else {
+                this->disconnect(conn);
             }
         }
 
@@ -134,26 +465,102 @@ namespace hussar {
          * handles a single client connection
          */
         void handle_connection(int client, SSL* ssl, char* host) {
-            // allocate buffer for service string
-            char svc[NI_MAXSERV];
-            memset(svc, 0, NI_MAXSERV);
-        
-            // allocate a buffer for recieved data
-            char buf[this->config.max_stdbuf];
-
             if (this->config.verbosity) {
                 print_lock.lock();
                     std::cout << host <<" connected" << std::endl;
                 print_lock.unlock();
             }
 
-            // read and handle bytes until the connection ends
+            Connection* conn = new Connection(client, ssl, host, this->config.max_output);
+            if (ssl) {
+                const unsigned char* protocol;
+                unsigned int length;
+                SSL_get0_alpn_selected(ssl, &protocol, &length);
+                if (length == 2 && std::memcmp(protocol, "h2", 2) == 0) {
+                    this->serve_http2(conn);
+                    return;
+                }
+            }
+            this->serve_connection(conn);
+        }
+
+        /**
+         * answers the streams of an HTTP/2 connection until it ends. this
+         * thread does the connection's reading and writing, while the
+         * session's workers run serve_stream() for several streams at once
+         */
+        void serve_http2(Connection* conn)
+        {
+            Http2Session session(conn->client, conn->ssl, conn->out, this->config.max_upload, [this, conn](Http2Session& session, Http2Stream& stream) {
+                this->serve_stream(conn, session, stream);
+            });
+            if (not session.start()) {
+                this->disconnect(conn);
+                return;
+            }
+
+            session.run();
+            session.close();
+            this->disconnect(conn);
+        }
+
+        /**
+         * answers one stream of an HTTP/2 connection, on a worker of its
+         * session. the request is rebuilt as its HTTP/1.1 equivalent and its
+         * body read the same way, so routes, middleware, caching and uploads
+         * behave the same whichever protocol was used
+         */
+        void serve_stream(Connection* conn, Http2Session& session, Http2Stream& stream)
+        {
+            std::string raw = stream.request_head();
+            auto req = std::make_unique<Request>(raw, conn->host);
+            req->version = "HTTP/2";
+            auto resp = std::make_unique<Response>(*req);
+
+            // the session frames the body, a declared length is checked against what arrives
+            BodyReader body([&session, &stream](char* dst, size_t count) {
+                return session.read(stream, dst, count);
+            }, req->declared_length());
+
+            if (stream.large_headers) {
+                resp->code = "431";
+                resp->body = "<h1>431: Request Header Fields Too Large!</h1>";
+            } else if (stream.large_body) {
+                resp->code = "413";
+                resp->body = "<h1>413: Payload Too Large!</h1>";
+            } else {
+                const Route* r = this->resolve(*req, *resp);
+                if (r && (r->websocket || r->events)) {
+                    // only HTTP/1.1 connections can be parked, the client retries the request on one
+                    session.refuse(stream, H2Error::HTTP_1_1_REQUIRED);
+                    return;
+                }
+                if (req->is_good && r && r->stream_body) {
+                    if (this->open_body(*req, *resp, body) != BodyStatus::READ) r = nullptr;
+                } else if (req->is_good) {
+                    const UploadSink* sink = r && not r->upload.dir.empty() ? &r->upload : nullptr;
+                    BodyStatus status = this->read_body(conn, *req, *resp, sink, body);
+                    // the stream was reset or the connection failed, there's no one to answer
+                    if (status == BodyStatus::FAILED) return;
+                    if (status == BodyStatus::REJECTED) r = nullptr;
+                }
+                if (r) (*r)(*req, *resp);
+            }
+
+            this->log(raw, *req, *resp);
+            session.respond(stream, *req, *resp);
+        }
+
+        /**
+         * reads and answers requests until the connection ends or is handed to the io loop
+         */
+        void serve_connection(Connection* conn) {
+            char* host = conn->host;
+
+            // read and handle requests until the connection ends
             while (true) {
-                // set the recv buffer to null chars
-                memset(buf, 0, this->config.max_stdbuf);
-        
-                // read data incoming from the client into the recv buffer
-                int status = this->readsock(client, ssl, buf, this->config.max_stdbuf);
+                std::string buf_str;
+                ssize_t status = this->read_head(conn, buf_str);
         
                 switch (status) {
                     case -1: // connection error
@@ -168,30 +575,62 @@ namespace hussar {
                         goto srv_disconnect; // disconnect
                         break;
                     default:
-                        std::string buf_str{buf};
-                        Request req{buf_str, host};
-                        Response resp{req};
+                        auto req = std::make_unique<Request>(buf_str, host);
+                        auto resp = std::make_unique<Response>(*req);
  
-                        this->handle_transfer_headers(client, ssl, req, resp);
-
-                        this->route(req, resp);
+                        if (req->is_good && not this->accept_body(conn, *req, *resp)) {
+                            // the body is never read, so the connection can't carry another request
+                            req->keep_alive = false;
+                            this->respond(conn, buf_str, *req, *resp);
+                            goto srv_disconnect;
+                        }
 
-                        this->log(buf_str, req, resp);
+                        // the route decides where uploaded files go, so it is found before the body is read
+                        const Route* r = this->resolve(*req, *resp);
+                        std::optional<BodyReader> unread;
+                        if (req->is_good && r && r->stream_body) {
+                            this->frame_body(conn, *req, unread);
+                            if (this->open_body(*req, *resp, *unread) != BodyStatus::READ) {
+                                req->keep_alive = false;
+                                this->respond(conn, buf_str, *req, *resp);
+                                goto srv_disconnect;
+                            }
+                        } else if (req->is_good) {
+                            const UploadSink* sink = r && not r->upload.dir.empty() ? &r->upload : nullptr;
+                            std::optional<BodyReader> reader;
+                            this->frame_body(conn, *req, reader);
+                            BodyStatus body = this->read_body(conn, *req, *resp, sink, *reader);
+                            if (body == BodyStatus::FAILED) goto srv_disconnect;
+                            if (body == BodyStatus::REJECTED) {
+                                // what's left of the body is never read
+                                req->keep_alive = false;
+                                this->respond(conn, buf_str, *req, *resp);
+                                goto srv_disconnect;
+                            }
+                        }
+                        if (r && r->is_async()) {
+                            this->route_async(r, new PendingRequest{
+                                conn, std::move(buf_str), std::move(req), std::move(resp)
+                            });
+                            return;
+                        }
+                        if (r) (*r)(*req, *resp);
+
+                        // whatever the handler left of its body is skipped to reach the next request
+                        if (unread) {
+                            std::string_view piece;
+                            ssize_t left;
+                            while ((left = req->read_body(piece)) > 0)
+                                ;
+                            if (left < 0) req->keep_alive = false;
+                        }
 
-                        std::string response = resp.serialize();
-                        this->writesock(client, ssl, response.c_str(), response.size());
+                        this->respond(conn, buf_str, *req, *resp);
 
-                        //if (req.content_type != "") {
-                        //    print_lock.lock();
-                        //    auto parts = split_string<std::string_view>(req.content_type, ';');
-                        //    for (auto& s : parts) {
-                        //        std::cout << s << std::endl;
-                        //    }
-                        //    print_lock.unlock();
-                        //}
+                        if (this->park(conn, r, req, *resp)) return;
 
                         // if keep alive
-                        if (req.keep_alive) {
+                        if (req->keep_alive) {
                             continue;
                         }
 
@@ -201,18 +640,59 @@ namespace hussar {
             }
 
         srv_disconnect:
+            this->disconnect(conn);
+        }
+
+        /**
+         * hands a connection that stays open after its response, an upgraded
+         * websocket or an event stream, to the io loop and frees the pool
+         * thread. returns false if the route didn't take the connection over
+         */
+        bool park(Connection* conn, const Route* r, std::unique_ptr<Request>& req, Response& resp)
+        {
+            if (not r || not req->keep_alive) return false;
+            bool upgraded = r->websocket && resp.code == "101";
+            bool streaming = r->events && resp.open_ended;
+            if (not upgraded && not streaming) return false;
+
+            // whatever the client sent after the head is its first frames
+            std::string initial = std::move(conn->input);
+            conn->input.clear();
+
+            std::shared_ptr<ParkedSocket> socket;
+            if (upgraded) {
+                socket = std::make_shared<WebSocket>(conn->client, conn->ssl, std::move(req), r->websocket);
+            } else {
+                socket = std::make_shared<EventStream>(conn->client, conn->ssl, std::move(req), r->events);
+            }
+            io_loop.post([socket, initial = std::move(initial)]() mutable {
+                socket->start(std::move(initial));
+            });
+
+            // the socket belongs to the loop now
+            std::free(conn->host);
+            delete conn;
+            return true;
+        }
+
+        /**
+         * closes the connection and frees its resources
+         */
+        void disconnect(Connection* conn)
+        {
             if (this->config.verbosity) {
                 print_lock.lock();
-                    std::cout << host << " disconnected" << std::endl;
+                    std::cout << conn->host << " disconnected" << std::endl;
                 print_lock.unlock();
             }
 
-            if (ssl) {
-                SSL_shutdown(ssl);
-                SSL_free(ssl);
+            if (conn->ssl) {
+                SSL_shutdown(conn->ssl);
+                SSL_free(conn->ssl);
             }
-            close(client);
-            std::free(host);
+            close(conn->client);
+            std::free(conn->host);
+            delete conn;
         }
 
         void init_socket()
@@ -239,6 +719,19 @@ namespace hussar {
             }
         }
 
+        /**
+         * picks the protocol during the TLS handshake, h2 if the client offers it
+         */
+        static int select_protocol(SSL* ssl, const unsigned char** out, unsigned char* out_length,
+            const unsigned char* in, unsigned int in_length, void* arg)
+        {
+            static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+            if (SSL_select_next_proto(const_cast<unsigned char**>(out), out_length, protocols, sizeof(protocols) - 1, in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+                return SSL_TLSEXT_ERR_NOACK;
+            }
+            return SSL_TLSEXT_ERR_OK;
+        }
+
         void init_ssl_context(const std::string& cert, const std::string& privkey)
         {
             SSL_load_error_strings();
@@ -262,6 +755,10 @@ namespace hussar {
                 fatal_error("can't use privatekey pem file: " + privkey);
             }
 
+            if (this->config.http2) {
+                SSL_CTX_set_alpn_select_cb(this->ssl_ctx, &Hussar::select_protocol, nullptr);
+            }
+
         }
 
     public:
@@ -269,11 +766,12 @@ namespace hussar {
         Hussar(Config& config)
             : config(std::move(config)), thread_pool(this->config.thread_count), ssl_ctx(nullptr)
         {
-            print_lock.unlock();
-            openssl_rand_lock.unlock();
-            sessions_lock.unlock();
+            io_loop.start();
             this->init_socket();
 
+            // a client closing its end mid write is an error to handle, not a reason to exit
+            signal(SIGPIPE, SIG_IGN);
+
             // if ssl
             if (this->config.certificate != "" && this->config.private_key != "") {
                 if (this->config.verbosity) {
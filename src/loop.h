@@ -0,0 +1,473 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <sys/epoll.h>      // epoll
+#include <sys/eventfd.h>    // loop wakeups
+#include <atomic>
+#include <chrono>
+#include <queue>
+
+#include "libs.h"
+#include "task.h"
+
+namespace hussar {
+    using io_callback = std::function<void (uint32_t)>;
+
+    /**
+     * single threaded epoll loop that waits on file descriptors and timers.
+     *
+     * callbacks and coroutines resumed by the loop run on the loop thread, so
+     * they must not block. blocking work such as file reads goes through
+     * blocking(), which runs it on a helper thread and continues on the loop.
+     *
+     * watch() fires once, descriptors the loop owns for their whole life,
+     * such as upgraded connections, are attach()ed instead.
+     */
+    class EventLoop {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct Timer {
+            clock::time_point deadline;
+            std::function<void()> func;
+
+            bool operator>(const Timer& t) const
+            {
+                return this->deadline > t.deadline;
+            }
+        };
+
+        struct Watch {
+            int fd;
+            io_callback func;
+            bool persistent;    // registered with attach(), kept until detach()
+        };
+
+        int epfd;
+        int wakefd;
+        std::thread loop_thread;
+        std::thread blocking_thread;
+        std::once_flag started;
+        std::atomic<bool> running;
+
+        std::mutex posted_mtx;
+        std::vector<std::function<void()>> posted;
+
+        // only touched on the loop thread
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+        std::unordered_map<int, Watch*> attached;
+        std::vector<Watch*> retired;    // detached watches, freed once no event can refer to them
+
+        std::mutex blocking_mtx;
+        std::condition_variable blocking_cv;
+        std::queue<std::function<void()>> blocking_jobs;
+
+        void wake()
+        {
+            uint64_t one = 1;
+            ssize_t status = ::write(this->wakefd, &one, sizeof(one));
+            (void)status;
+        }
+
+        // milliseconds until the next timer is due, -1 if there are none
+        int next_timeout()
+        {
+            if (this->timers.empty()) return -1;
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(this->timers.top().deadline - clock::now());
+            return wait.count() < 0 ? 0 : static_cast<int>(wait.count());
+        }
+
+        void run()
+        {
+            epoll_event events[64];
+            std::vector<std::function<void()>> ready;
+
+            while (this->running) {
+                int count = epoll_wait(this->epfd, events, 64, this->next_timeout());
+
+                for (int n = 0; n < count; ++n) {
+                    if (events[n].data.ptr == nullptr) {
+                        uint64_t value;
+                        ssize_t status = ::read(this->wakefd, &value, sizeof(value));
+                        (void)status;
+                        continue;
+                    }
+
+                    Watch* w = static_cast<Watch*>(events[n].data.ptr);
+                    if (w->persistent) {
+                        // detached by an earlier callback of this batch
+                        if (w->fd >= 0) w->func(events[n].events);
+                        continue;
+                    }
+                    epoll_ctl(this->epfd, EPOLL_CTL_DEL, w->fd, nullptr);
+                    io_callback func = std::move(w->func);
+                    delete w;
+                    func(events[n].events);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(this->posted_mtx);
+                    ready.swap(this->posted);
+                }
+                for (auto& func : ready) {
+                    func();
+                }
+                ready.clear();
+
+                auto now = clock::now();
+                while (not this->timers.empty() && this->timers.top().deadline <= now) {
+                    std::function<void()> func = std::move(const_cast<Timer&>(this->timers.top()).func);
+                    this->timers.pop();
+                    func();
+                }
+
+                for (Watch* w : this->retired) {
+                    delete w;
+                }
+                this->retired.clear();
+            }
+        }
+
+        void run_blocking()
+        {
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(this->blocking_mtx);
+                    this->blocking_cv.wait(lock, [this] {
+                        return not this->running || not this->blocking_jobs.empty();
+                    });
+                    if (this->blocking_jobs.empty()) return;
+                    job = std::move(this->blocking_jobs.front());
+                    this->blocking_jobs.pop();
+                }
+                job();
+            }
+        }
+
+    public:
+        EventLoop()
+            : epfd(-1), wakefd(-1), running(false)
+        {}
+
+        // delete copy constructors
+        EventLoop(EventLoop& l) = delete;
+        EventLoop(const EventLoop& l) = delete;
+        EventLoop& operator=(EventLoop& l) = delete;
+        EventLoop& operator=(const EventLoop& l) = delete;
+
+        ~EventLoop()
+        {
+            if (not this->running) return;
+
+            this->running = false;
+            this->wake();
+            this->blocking_cv.notify_all();
+            this->loop_thread.join();
+            this->blocking_thread.join();
+            close(this->epfd);
+            close(this->wakefd);
+        }
+
+        /**
+         * starts the loop and blocking threads, calling it again does nothing
+         */
+        void start()
+        {
+            std::call_once(this->started, [this] {
+                this->epfd = epoll_create1(EPOLL_CLOEXEC);
+                this->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (this->epfd < 0 || this->wakefd < 0) {
+                    fatal_error("ERROR can't create event loop");
+                }
+
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.ptr = nullptr;
+                epoll_ctl(this->epfd, EPOLL_CTL_ADD, this->wakefd, &ev);
+
+                this->running = true;
+                this->loop_thread = std::thread(&EventLoop::run, this);
+                this->blocking_thread = std::thread(&EventLoop::run_blocking, this);
+            });
+        }
+
+        bool in_loop() const
+        {
+            return std::this_thread::get_id() == this->loop_thread.get_id();
+        }
+
+        /**
+         * runs func on the loop thread, callable from any thread
+         */
+        void post(std::function<void()> func)
+        {
+            this->start();
+            {
+                std::lock_guard<std::mutex> lock(this->posted_mtx);
+                this->posted.emplace_back(std::move(func));
+            }
+            this->wake();
+        }
+
+        /**
+         * runs func on the loop thread once delay has passed
+         */
+        void after(clock::duration delay, std::function<void()> func)
+        {
+            this->start();
+            if (not this->in_loop()) {
+                this->post([this, delay, func = std::move(func)]() mutable {
+                    this->after(delay, std::move(func));
+                });
+                return;
+            }
+            this->timers.push(Timer{clock::now() + delay, std::move(func)});
+        }
+
+        /**
+         * calls func(events) on the loop thread the next time fd is ready for
+         * events, the watch is removed once it fires
+         */
+        void watch(int fd, uint32_t events, io_callback func)
+        {
+            this->start();
+            Watch* w = new Watch{fd, std::move(func), false};
+
+            epoll_event ev{};
+            ev.events = events | EPOLLONESHOT;
+            ev.data.ptr = w;
+            if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                io_callback failed = std::move(w->func);
+                delete w;
+                this->post([failed = std::move(failed)] { failed(EPOLLERR); });
+            }
+        }
+
+        /**
+         * calls func(events) on the loop thread every time fd is ready for
+         * events until it is detached, for descriptors owned by the loop.
+         * only call it on the loop thread, returns false if fd can't be watched
+         */
+        bool attach(int fd, uint32_t events, io_callback func)
+        {
+            Watch* w = new Watch{fd, std::move(func), true};
+
+            epoll_event ev{};
+            ev.events = events;
+            ev.data.ptr = w;
+            if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                delete w;
+                return false;
+            }
+            this->attached[fd] = w;
+            return true;
+        }
+
+        /**
+         * changes the events an attached fd is watched for, only call it on the loop thread
+         */
+        void rearm(int fd, uint32_t events)
+        {
+            auto found = this->attached.find(fd);
+            if (found == this->attached.end()) return;
+
+            epoll_event ev{};
+            ev.events = events;
+            ev.data.ptr = found->second;
+            epoll_ctl(this->epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+
+        /**
+         * stops watching an attached fd, only call it on the loop thread.
+         * func is released after the current batch of events, so a callback
+         * may detach its own fd
+         */
+        void detach(int fd)
+        {
+            auto found = this->attached.find(fd);
+            if (found == this->attached.end()) return;
+
+            epoll_ctl(this->epfd, EPOLL_CTL_DEL, fd, nullptr);
+            found->second->fd = -1;
+            this->retired.push_back(found->second);
+            this->attached.erase(found);
+        }
+
+        /**
+         * runs job on the blocking helper thread
+         */
+        void blocking(std::function<void()> job)
+        {
+            this->start();
+            {
+                std::lock_guard<std::mutex> lock(this->blocking_mtx);
+                this->blocking_jobs.emplace(std::move(job));
+            }
+            this->blocking_cv.notify_one();
+        }
+    };
+
+    EventLoop io_loop;
+
+    // awaitable that resumes the coroutine on the loop after a delay
+    struct sleep_awaiter {
+        std::chrono::steady_clock::duration delay;
+
+        bool await_ready() const noexcept
+        {
+            return this->delay.count() <= 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            io_loop.after(this->delay, [h] { h.resume(); });
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    // awaitable that resumes the coroutine on the loop once a file descriptor is ready
+    struct fd_awaiter {
+        int fd;
+        uint32_t events;
+        uint32_t revents = 0;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            io_loop.watch(this->fd, this->events, [this, h](uint32_t revents) {
+                this->revents = revents;
+                h.resume();
+            });
+        }
+
+        uint32_t await_resume() noexcept
+        {
+            return this->revents;
+        }
+    };
+
+    // awaitable that runs a job on the blocking thread and resumes the coroutine on the loop
+    struct blocking_awaiter {
+        std::function<void()> job;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            io_loop.blocking([this, h] {
+                this->job();
+                io_loop.post([h] { h.resume(); });
+            });
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    /**
+     * suspends the coroutine for the given duration
+     */
+    template <typename Rep, typename Period>
+    sleep_awaiter sleep_for(std::chrono::duration<Rep, Period> delay)
+    {
+        return sleep_awaiter{std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay)};
+    }
+
+    /**
+     * suspends the coroutine until fd is readable, returns the epoll events
+     */
+    fd_awaiter readable(int fd)
+    {
+        return fd_awaiter{fd, EPOLLIN | EPOLLRDHUP};
+    }
+
+    /**
+     * suspends the coroutine until fd is writable, returns the epoll events
+     */
+    fd_awaiter writable(int fd)
+    {
+        return fd_awaiter{fd, EPOLLOUT};
+    }
+
+    /**
+     * suspends the coroutine while job runs on the blocking thread
+     */
+    blocking_awaiter run_blocking(std::function<void()> job)
+    {
+        return blocking_awaiter{std::move(job)};
+    }
+
+    /**
+     * reads up to count bytes from a socket without blocking the calling thread
+     */
+    task<ssize_t> async_recv(int fd, char* dst, size_t count)
+    {
+        while (true) {
+            ssize_t status = recv(fd, dst, count, MSG_DONTWAIT);
+            if (status >= 0) co_return status;
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) co_return -1;
+            co_await readable(fd);
+        }
+    }
+
+    /**
+     * writes all count bytes to a socket without blocking the calling thread,
+     * returns the number of bytes written or -1 on error
+     */
+    task<ssize_t> async_send(int fd, const char* payload, size_t count)
+    {
+        size_t sent = 0;
+        while (sent < count) {
+            ssize_t status = send(fd, payload + sent, count - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (status >= 0) {
+                sent += status;
+                continue;
+            }
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) co_return -1;
+            co_await writable(fd);
+        }
+        co_return static_cast<ssize_t>(sent);
+    }
+
+    /**
+     * reads a whole file on the blocking thread, returns nothing if it can't be opened
+     */
+    task<std::optional<std::string>> async_read_file(std::filesystem::path path)
+    {
+        std::optional<std::string> contents;
+        std::function<void()> job = [&path, &contents] {
+            std::ifstream file(path, std::ios::binary);
+            if (file) {
+                contents.emplace((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            }
+        };
+        co_await run_blocking(std::move(job));
+        co_return contents;
+    }
+};
@@ -20,12 +20,17 @@
 #include <string>
 
 #include "hussar.h"
+#ifdef EMBED_ASSETS
+#include "assets.gen.h" // generated by `make bundle`
+#endif
 
-std::string DOCROOT = "";
+hus::Docroot DOCROOT;
+std::unique_ptr<hus::MemoryDocroot> MEMORY; // set when the docroot is served from memory
+hus::GzipCache GZIP_CACHE;
 
 void print_help(char* arg0)
 {
-    std::cout << "Usage: " << arg0 << " [-hv -i <ipv4> -p <port> -t <thread count> -d <document root> -k <ssl private key> -c <ssl certificate>]\n";
+    std::cout << "Usage: " << arg0 << " [-hv -i <ipv4> -p <port> -t <thread count> -d <document root> -m <memory MB> -k <ssl private key> -c <ssl certificate>]\n";
     std::cout << "\t-h\t\tDisplay this help\n";
     std::cout << "\t-v\t\tVerbose console output\n";
     std::cout << "\t-vv\t\tForensic console output\n";
@@ -33,78 +38,141 @@ void print_help(char* arg0)
     std::cout << "\t-p <PORT>\tPort to listen on\n";
     std::cout << "\t-t <THREAD>\tThreads to use\n";
     std::cout << "\t-d <DIR>\tDocument root directory\n";
+    std::cout << "\t-m <MB>\t\tServe the document root from memory, up to MB megabytes\n";
     std::cout << "\t-k <key.pem>\tSSL Private key\n";
     std::cout << "\t-c <cert.pem>\tSSL Certificate\n";
 }
 
-void web_server(hus::Request& req, hus::Response& resp)
+/**
+ * picks the content coding for a file body. a .br or .gz sidecar next to the
+ * file that is at least as new replaces the body, otherwise returns true if
+ * the file should be gzipped on the fly, Content-Encoding is set either way
+ */
+bool negotiate_encoding(hus::Request& req, hus::Response& resp, std::string_view path, const std::string& mime)
 {
-    std::filesystem::path p;
-    std::regex slashes("/+");
-    std::regex dots("[.][.]+");
-    std::string document = req.document;
-
-    if (req.is_good) {
-        document = std::regex_replace(document, slashes, "/"); // collapse slashes into a single slash
-        document = std::regex_replace(document, dots, ""); // collapse 2 or more dots into nothing
-
-        // if a directory traversal is attempted, make the document target index.html
-        if (document.find("../") != std::string::npos) {
-            document = "/index.html";
-        } else if (document == "/") { // if directory is /, then make the document target index.html
-            document = "/index.html";
-        } else if (document == "") { // if directory is nothing somehow
-            goto nonexistent_file;
-        } else if (document.size() > 255) {
-                resp.code = "414";
-                resp.status = "URI TOO LONG";
-                resp.body = "<h1>414: Uri Too Long!</h1>";
-                return;
+    static const std::pair<const char*, const char*> sidecars[] = { { "br", ".br" }, { "gzip", ".gz" } };
+
+    for (auto [coding, extension] : sidecars) {
+        if (not req.accepts_encoding(coding)) continue;
+
+        char sidecar_path[DOCROOT_PATH_MAX + 3];
+        std::snprintf(sidecar_path, sizeof(sidecar_path), "%.*s%s", static_cast<int>(path.size()), path.data(), extension);
+        auto sidecar = DOCROOT.open_file(sidecar_path);
+        if (sidecar && sidecar->info.st_mtime >= resp.file->info.st_mtime) {
+            resp.file = std::move(sidecar);
+            resp.headers["Content-Encoding"] = coding;
+            resp.headers["Vary"] = "Accept-Encoding";
+            return false;
         }
+    }
 
-        // get the absolute path of the requested document
-        p = std::filesystem::current_path();
-        p /= DOCROOT;
-        p += document;
-        p = std::filesystem::weakly_canonical(p);
-
-        if (std::filesystem::exists(p)) {
-            if (std::filesystem::is_regular_file(p)) {
-                // file exists, load it
-                std::ifstream file(p);
-                resp.code = "200";
-                resp.headers["Content-Type"] = hus::get_mime(p);
-                resp.body = std::string(
-                            (std::istreambuf_iterator<char>(file)),
-                             std::istreambuf_iterator<char>());
-            } else {
-                goto nonexistent_file;
-            }
-        } else {
-        nonexistent_file:
-            // try a custom 404 page
-            p = std::filesystem::current_path();
-            p /= DOCROOT;
-            p += "/404.html";
-            p = std::filesystem::weakly_canonical(p);
-
-            // if it exists, use it for the 404 page else use the default page
-            if (std::filesystem::exists(p)) {
-                std::ifstream file(p);
-                resp.code = "404";
-                resp.body = std::string(
-                            (std::istreambuf_iterator<char>(file)),
-                             std::istreambuf_iterator<char>());
-            } else {
-                resp.code = "404";
-                resp.body = "<h1>404: File Not found!</h1>";
-            }
+    if (hus::compressible(mime)) {
+        resp.headers["Vary"] = "Accept-Encoding";
+        if (req.accepts_encoding("gzip")) {
+            resp.headers["Content-Encoding"] = "gzip";
+            return true;
         }
+    }
+    return false;
+}
+
+/**
+ * swaps the file body for its gzipped copy from the cache, files that don't
+ * compress are sent as they are
+ */
+void gzip_body(hus::Response& resp, std::string_view path, const struct stat& info)
+{
+    auto gz = GZIP_CACHE.get(std::string(path), *resp.file);
+    if (gz) {
+        resp.send_shared(std::move(gz));
+        return;
+    }
+    resp.headers.erase("Content-Encoding");
+    resp.set_validators(info);
+}
 
+/**
+ * answers from the in memory copy of the file, returns false if it isn't held
+ * in memory or only a range of it was asked for
+ */
+bool serve_memory(hus::Request& req, hus::Response& resp, std::string_view path)
+{
+    if (not MEMORY || not req.header("Range").empty()) return false;
+
+    auto entry = MEMORY->find(path);
+    if (not entry) return false;
+
+    const hus::MemoryFile::Variant* variant = &entry->identity;
+    if (entry->br.full && req.accepts_encoding("br")) {
+        variant = &entry->br;
+    } else if (entry->gzip.full && req.accepts_encoding("gzip")) {
+        variant = &entry->gzip;
+    }
+
+    resp.code = "200";
+    resp.headers["Content-Type"] = hus::get_mime(path);
+    resp.headers["ETag"] = variant->etag;
+    resp.headers["Last-Modified"] = entry->last_modified;
+    if (resp.not_modified()) return true;
+
+    resp.prebuilt = req.method_id == hus::Method::HEAD ? variant->head : variant->full;
+    return true;
+}
+
+/**
+ * answers with the docroot's 404.html, or a default page if there isn't one
+ */
+void not_found(hus::Response& resp)
+{
+    resp.code = "404";
+    auto page = DOCROOT.page("404.html");
+    if (page) {
+        resp.send_shared(std::move(page));
     } else {
+        resp.body = "<h1>404: File Not found!</h1>";
+    }
+}
+
+void web_server(hus::Request& req, hus::Response& resp)
+{
+    if (not req.is_good) {
         resp.code= "400";
         resp.body = "<h1>400: Bad Request!</h1>";
+        return;
     }
+
+    if (req.document.size() > 255) {
+        resp.code = "414";
+        resp.status = "URI TOO LONG";
+        resp.body = "<h1>414: Uri Too Long!</h1>";
+        return;
+    }
+
+    // traversal attempts are treated as missing files
+    char path[DOCROOT_PATH_MAX];
+    size_t length = hus::normalize_path(req.document, path);
+#ifdef EMBED_ASSETS
+    if (length && hus::serve_embedded(hus::embedded_assets, req, resp, std::string_view(path, length))) return;
+#endif
+    if (length && serve_memory(req, resp, std::string_view(path, length))) return;
+    if (length == 0 || not resp.send_file(DOCROOT.open_file(path))) {
+        not_found(resp);
+        return;
+    }
+
+    // file exists, it is sent straight from disk
+    resp.code = "200";
+    const std::string& mime = hus::get_mime(std::string_view(path, length));
+    resp.headers["Content-Type"] = mime;
+
+    // revalidation is answered before anything is read from the file
+    struct stat info = resp.file->info;
+    bool compress = negotiate_encoding(req, resp, std::string_view(path, length), mime);
+    resp.set_validators(info);
+    if (resp.not_modified()) return;
+
+    if (compress) gzip_body(resp, std::string_view(path, length), info);
+    resp.send_ranges();
 }
 
 int main(int argc, char* argv[])
@@ -118,11 +186,13 @@ int main(int argc, char* argv[])
     config.verbosity    = 0;
 
     bool config_changed = false;
+    std::string docroot = "";
+    size_t memory_mb = 0;
 
     std::stringstream ss;
 
     int c;
-    while ((c = getopt(argc, argv, "hvi:p:t:d:k:c:")) != -1) {
+    while ((c = getopt(argc, argv, "hvi:p:t:d:m:k:c:")) != -1) {
         switch (c) {
 
             case 'h':
@@ -173,7 +243,18 @@ int main(int argc, char* argv[])
 
             case 'd':
                 config_changed = true;
-                DOCROOT = optarg;
+                docroot = optarg;
+                break;
+
+            case 'm':
+                config_changed = true;
+                ss.clear();
+                ss << optarg;
+                ss >> memory_mb;
+                if (ss.fail()) {
+                    std::cerr << "Error: " << optarg << " is not a valid memory size, serving from disk\n";
+                    memory_mb = 0;
+                }
                 break;
        }
     }
@@ -194,8 +275,18 @@ int main(int argc, char* argv[])
         config.certificate = "";
     }
 
+    DOCROOT.open(std::filesystem::current_path() / docroot);
+    if (memory_mb) {
+        MEMORY = std::make_unique<hus::MemoryDocroot>(DOCROOT, memory_mb * 1'000'000);
+        MEMORY->load();
+        if (config.verbosity) {
+            std::cout << "Loaded " << MEMORY->size() << " bytes of " << DOCROOT.path().string() << " into memory\n";
+        }
+    }
+
     hus::Hussar server(config);
     server.fallback(&web_server);
+    server.freeze();
     server.serve();
 
     return 0;
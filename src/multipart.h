@@ -0,0 +1,218 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "libs.h"
+#include "upload.h"
+
+#define MULTIPART_MAX_HEADERS 8192  // bytes of headers allowed per part
+#define MULTIPART_MAX_PARTS 256
+#define MULTIPART_MAX_BOUNDARY 70
+
+namespace hussar {
+    /**
+     * returns the boundary parameter of a multipart content type, or an empty
+     * string if it is missing or too long
+     */
+    std::string multipart_boundary(std::string_view content_type)
+    {
+        size_t at = content_type.find("boundary=");
+        if (at == std::string_view::npos) return "";
+
+        std::string_view boundary = content_type.substr(at + 9);
+        boundary = trim(boundary.substr(0, boundary.find(';')));
+        if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+            boundary = boundary.substr(1, boundary.size() - 2);
+        }
+        if (boundary.size() > MULTIPART_MAX_BOUNDARY) return "";
+        return std::string(boundary);
+    }
+
+    /**
+     * incremental multipart/form-data parser fed the body as it is read.
+     *
+     * the delimiter is searched for with boyer-moore-horspool, and only the
+     * bytes that could still start a delimiter are kept between reads, so
+     * every byte is scanned about once and memory stays bounded by the
+     * part size where contents spill to a temp file.
+     *
+     * with an UploadSink, file parts go straight into anonymous files in the
+     * sink's directory, with the rest of the body reserved for them up front.
+     */
+    class MultipartParser {
+    private:
+        enum class State {
+            PREAMBLE,   // before the first delimiter
+            DELIMITER,  // after a delimiter, waiting for CRLF or the closing "--"
+            HEADERS,
+            BODY,
+            DONE,
+            FAILED
+        };
+
+        State state;
+        std::string delimiter;  // CRLF "--" boundary
+        size_t shift[256];      // horspool bad character shifts
+        std::string pending;    // bytes received but not consumed yet
+        size_t spill;
+        std::string temp_dir;
+        const UploadSink* sink;
+        uint64_t body_size;     // from Content-Length, 0 if unknown
+        uint64_t fed;           // bytes of the body fed so far
+        UploadedFile part;      // the part being read
+
+        // returns the offset of the first delimiter in data
+        size_t find_delimiter(std::string_view data) const
+        {
+            size_t size = this->delimiter.size();
+            size_t last = size - 1;
+            const char* d = this->delimiter.data();
+
+            for (size_t n = 0; n + size <= data.size(); n += this->shift[static_cast<unsigned char>(data[n + last])]) {
+                if (data[n + last] == d[last] && std::memcmp(data.data() + n, d, last) == 0) return n;
+            }
+            return std::string_view::npos;
+        }
+
+        // bytes at the end of data that can't be part of a delimiter
+        size_t safe_prefix(std::string_view data) const
+        {
+            size_t keep = this->delimiter.size() - 1;
+            return data.size() > keep ? data.size() - keep : 0;
+        }
+
+        bool fail()
+        {
+            this->state = State::FAILED;
+            this->pending.clear();
+            return false;
+        }
+
+    public:
+        std::vector<UploadedFile> parts;
+
+        MultipartParser(std::string_view boundary, size_t spill, std::string temp_dir, const UploadSink* sink = nullptr, uint64_t body_size = 0)
+            : state(State::PREAMBLE), spill(spill), temp_dir(std::move(temp_dir)), sink(sink), body_size(body_size), fed(0)
+        {
+            this->delimiter = "\r\n--";
+            this->delimiter += boundary;
+            for (size_t& s : this->shift) s = this->delimiter.size();
+            for (size_t n = 0; n + 1 < this->delimiter.size(); ++n) {
+                this->shift[static_cast<unsigned char>(this->delimiter[n])] = this->delimiter.size() - 1 - n;
+            }
+
+            // the first delimiter isn't preceded by a line break
+            this->pending = "\r\n";
+            if (boundary.empty()) this->fail();
+        }
+
+        // delete copy constructors
+        MultipartParser(MultipartParser& p) = delete;
+        MultipartParser(const MultipartParser& p) = delete;
+        MultipartParser& operator=(MultipartParser& p) = delete;
+        MultipartParser& operator=(const MultipartParser& p) = delete;
+
+        /**
+         * parses the next bytes of the body, returns false once the body is malformed.
+         * bytes after the closing delimiter are ignored
+         */
+        bool feed(std::string_view data)
+        {
+            if (this->state == State::FAILED) return false;
+            if (this->state == State::DONE) return true;
+
+            this->pending += data;
+            this->fed += data.size();
+            size_t used = 0;
+
+            while (this->state != State::DONE) {
+                std::string_view rest = std::string_view(this->pending).substr(used);
+
+                if (this->state == State::PREAMBLE || this->state == State::BODY) {
+                    size_t at = this->find_delimiter(rest);
+                    size_t take = at == std::string_view::npos ? this->safe_prefix(rest) : at;
+
+                    if (this->state == State::BODY && not this->part.append(rest.substr(0, take), this->spill, this->temp_dir)) {
+                        return this->fail();
+                    }
+                    used += take;
+                    if (at == std::string_view::npos) break;
+
+                    used += this->delimiter.size();
+                    if (this->state == State::BODY) {
+                        if (not this->part.finish()) return this->fail();
+                        this->parts.push_back(std::move(this->part));
+                    }
+                    this->part = UploadedFile();
+                    this->state = State::DELIMITER;
+                } else if (this->state == State::DELIMITER) {
+                    if (rest.size() < 2) break;
+                    if (rest.starts_with("--")) {
+                        this->state = State::DONE;
+                    } else if (rest.starts_with("\r\n")) {
+                        used += 2;
+                        this->state = State::HEADERS;
+                    } else if (rest[0] == ' ' || rest[0] == '\t') {
+                        used += 1; // padding allowed before the line break
+                    } else {
+                        return this->fail();
+                    }
+                } else if (this->state == State::HEADERS) {
+                    size_t end = rest.starts_with("\r\n") ? 0 : rest.find("\r\n\r\n");
+                    if (end == std::string_view::npos) {
+                        if (rest.size() > MULTIPART_MAX_HEADERS) return this->fail();
+                        break;
+                    }
+                    if (end > MULTIPART_MAX_HEADERS || this->parts.size() >= MULTIPART_MAX_PARTS) return this->fail();
+
+                    this->part.parse_headers(rest.substr(0, end));
+                    used += end + (end ? 4 : 2);
+
+                    if (this->sink && this->part.is_file) {
+                        // the rest of the body bounds the part's size
+                        uint64_t unread = this->pending.size() - used;
+                        uint64_t reserve = this->body_size >= this->fed ? this->body_size - this->fed + unread : 0;
+                        if (not this->part.spill_to(this->sink->dir.string(), reserve)) return this->fail();
+                        if (this->sink->sha256 && not this->part.hash_sha256()) return this->fail();
+                    }
+                    this->state = State::BODY;
+                }
+            }
+
+            if (this->state == State::DONE) {
+                this->pending.clear();
+            } else {
+                this->pending.erase(0, used);
+            }
+            return true;
+        }
+
+        /**
+         * true once the closing delimiter was read
+         */
+        bool done() const
+        {
+            return this->state == State::DONE;
+        }
+
+        bool failed() const
+        {
+            return this->state == State::FAILED;
+        }
+    };
+};
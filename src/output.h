@@ -0,0 +1,357 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <sys/sendfile.h>   // sendfile
+#include <sys/stat.h>       // fstat
+#include <sys/uio.h>        // writev
+#include <fcntl.h>          // open
+#include <poll.h>           // waiting for writability
+#include <climits>          // IOV_MAX
+#include <deque>
+#include <memory>
+
+#include "libs.h"
+
+#define OUTPUT_FILE_CHUNK 65536 // bytes read per SSL write of a file segment
+#define OUTPUT_TLS_RECORD 16384 // small buffers are joined up to one TLS record
+
+namespace hussar {
+    /**
+     * an open file, or a range of one, sent as a response body.
+     * the descriptor is closed when the last reference goes away
+     */
+    struct FileBody {
+        int fd;
+        off_t offset;
+        size_t length;
+        struct stat info;   // filled in by open()
+
+        FileBody(int fd, off_t offset, size_t length)
+            : fd(fd), offset(offset), length(length), info{}
+        {}
+
+        // delete copy constructors
+        FileBody(FileBody& f) = delete;
+        FileBody(const FileBody& f) = delete;
+        FileBody& operator=(FileBody& f) = delete;
+        FileBody& operator=(const FileBody& f) = delete;
+
+        ~FileBody()
+        {
+            if (this->fd >= 0) close(this->fd);
+        }
+
+        /**
+         * opens a regular file for sending in full, returns null if it can't be opened
+         */
+        static std::shared_ptr<const FileBody> open(const std::filesystem::path& path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return nullptr;
+            return from_fd(fd);
+        }
+
+        /**
+         * takes ownership of an open descriptor, returns null and closes it if
+         * it isn't a regular file
+         */
+        static std::shared_ptr<const FileBody> from_fd(int fd)
+        {
+            struct stat st;
+            if (fstat(fd, &st) < 0 || not S_ISREG(st.st_mode)) {
+                close(fd);
+                return nullptr;
+            }
+            auto body = std::make_shared<FileBody>(fd, 0, static_cast<size_t>(st.st_size));
+            body->info = st;
+            return body;
+        }
+    };
+
+    /**
+     * per connection queue of buffers and file segments waiting to be sent.
+     *
+     * memory segments are gathered into writev calls and file segments go out
+     * with sendfile, or through SSL_write_ex on TLS connections. short writes
+     * resume where they stopped and EAGAIN waits for the socket to drain, so a
+     * flushed queue has always sent everything or failed. pushing past
+     * max_buffered bytes of memory segments flushes the queue first.
+     */
+    class OutputQueue {
+    private:
+        struct Segment {
+            std::string owned;                     // data when the queue owns it
+            std::shared_ptr<const std::string> shared;
+            std::string_view data;                 // unsent bytes of a memory segment
+            std::shared_ptr<const FileBody> file;
+            off_t offset = 0;                      // unsent range of a file segment
+            size_t length = 0;
+        };
+
+        int client;
+        SSL* ssl;
+        size_t max_buffered;
+        size_t buffered;                           // unsent bytes of memory segments
+        std::deque<Segment> segments;
+        bool good;
+
+        // blocks until the socket can take more data
+        bool wait_writable(short events = POLLOUT)
+        {
+            pollfd p = { this->client, events, 0 };
+            while (true) {
+                int status = poll(&p, 1, -1);
+                if (status > 0) return not (p.revents & (POLLERR | POLLNVAL));
+                if (status < 0 && errno != EINTR) return false;
+            }
+        }
+
+        // drops count sent bytes from the leading memory segments
+        void consume(size_t count)
+        {
+            this->buffered -= count;
+            while (count > 0) {
+                Segment& s = this->segments.front();
+                if (count < s.data.size()) {
+                    s.data.remove_prefix(count);
+                    return;
+                }
+                count -= s.data.size();
+                this->segments.pop_front();
+            }
+        }
+
+        // writes the leading memory segments with one writev
+        bool send_plain()
+        {
+            iovec iov[IOV_MAX];
+            int count = 0;
+            for (auto& s : this->segments) {
+                if (s.file || count == IOV_MAX) break;
+                iov[count++] = { const_cast<char*>(s.data.data()), s.data.size() };
+            }
+
+            while (true) {
+                ssize_t status = writev(this->client, iov, count);
+                if (status >= 0) {
+                    this->consume(status);
+                    return true;
+                }
+                if (errno == EINTR) continue;
+                if ((errno != EAGAIN && errno != EWOULDBLOCK) || not this->wait_writable()) return false;
+            }
+        }
+
+        // writes a buffer over TLS, waiting out WANT_READ/WANT_WRITE
+        bool ssl_write(const char* data, size_t count)
+        {
+            while (count > 0) {
+                size_t written = 0;
+                if (SSL_write_ex(this->ssl, data, count, &written) > 0) {
+                    data += written;
+                    count -= written;
+                    continue;
+                }
+
+                int error = SSL_get_error(this->ssl, 0);
+                if (error == SSL_ERROR_WANT_WRITE) {
+                    if (not this->wait_writable()) return false;
+                } else if (error == SSL_ERROR_WANT_READ) {
+                    if (not this->wait_writable(POLLIN)) return false;
+                } else {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // writes the leading memory segments over TLS, joining small ones into one record
+        bool send_tls()
+        {
+            Segment& first = this->segments.front();
+            if (first.data.size() >= OUTPUT_TLS_RECORD) {
+                if (not this->ssl_write(first.data.data(), first.data.size())) return false;
+                this->consume(first.data.size());
+                return true;
+            }
+
+            std::string record;
+            record.reserve(OUTPUT_TLS_RECORD);
+            for (auto& s : this->segments) {
+                if (s.file || record.size() + s.data.size() > OUTPUT_TLS_RECORD) break;
+                record += s.data;
+            }
+            if (not this->ssl_write(record.data(), record.size())) return false;
+            this->consume(record.size());
+            return true;
+        }
+
+        // sends the file segment at the front of the queue
+        bool send_file()
+        {
+            Segment& s = this->segments.front();
+            int fd = s.file->fd;
+
+            if (this->ssl) {
+                std::unique_ptr<char[]> chunk(new char[OUTPUT_FILE_CHUNK]);
+                while (s.length > 0) {
+                    ssize_t got = pread(fd, chunk.get(), std::min<size_t>(s.length, OUTPUT_FILE_CHUNK), s.offset);
+                    if (got <= 0) {
+                        if (got < 0 && errno == EINTR) continue;
+                        return false; // the file shrank or can't be read
+                    }
+                    if (not this->ssl_write(chunk.get(), got)) return false;
+                    s.offset += got;
+                    s.length -= got;
+                }
+            } else {
+                while (s.length > 0) {
+                    ssize_t sent = sendfile(this->client, fd, &s.offset, s.length);
+                    if (sent > 0) {
+                        s.length -= sent;
+                        continue;
+                    }
+                    if (sent == 0) return false; // the file shrank
+                    if (errno == EINTR) continue;
+                    if ((errno != EAGAIN && errno != EWOULDBLOCK) || not this->wait_writable()) return false;
+                }
+            }
+
+            this->segments.pop_front();
+            return true;
+        }
+
+        bool push_segment(Segment&& s, std::string_view data)
+        {
+            if (not this->good) return false;
+            if (data.empty()) return true;
+
+            if (this->buffered + data.size() > this->max_buffered && not this->flush()) return false;
+
+            Segment& queued = this->segments.emplace_back(std::move(s));
+            queued.data = queued.owned.empty() ? data : std::string_view(queued.owned);
+            this->buffered += data.size();
+            return true;
+        }
+
+    public:
+        OutputQueue(int client, SSL* ssl, size_t max_buffered)
+            : client(client), ssl(ssl), max_buffered(max_buffered), buffered(0), good(true)
+        {}
+
+        // delete copy constructors
+        OutputQueue(OutputQueue& q) = delete;
+        OutputQueue(const OutputQueue& q) = delete;
+        OutputQueue& operator=(OutputQueue& q) = delete;
+        OutputQueue& operator=(const OutputQueue& q) = delete;
+
+        /**
+         * queues a buffer owned by the queue
+         */
+        bool push(std::string data)
+        {
+            Segment s;
+            s.owned = std::move(data);
+            std::string_view view = s.owned;
+            return this->push_segment(std::move(s), view);
+        }
+
+        /**
+         * queues a shared buffer, it stays alive until it is sent
+         */
+        bool push(std::shared_ptr<const std::string> data)
+        {
+            if (not data) return this->good;
+            Segment s;
+            std::string_view view = *data;
+            s.shared = std::move(data);
+            return this->push_segment(std::move(s), view);
+        }
+
+        /**
+         * queues a view of a buffer, which must stay valid until the next flush()
+         */
+        bool push_view(std::string_view data)
+        {
+            return this->push_segment(Segment{}, data);
+        }
+
+        /**
+         * queues a file segment, it is sent straight from the file
+         */
+        bool push(std::shared_ptr<const FileBody> file)
+        {
+            if (not file) return this->good;
+            off_t offset = file->offset;
+            size_t length = file->length;
+            return this->push(std::move(file), offset, length);
+        }
+
+        /**
+         * queues length bytes of a file starting at offset
+         */
+        bool push(std::shared_ptr<const FileBody> file, off_t offset, size_t length)
+        {
+            if (not this->good) return false;
+            if (not file || length == 0) return true;
+
+            Segment& s = this->segments.emplace_back();
+            s.offset = offset;
+            s.length = length;
+            s.file = std::move(file);
+            return true;
+        }
+
+        /**
+         * sends everything queued, returns false and drops the queue if the
+         * connection failed
+         */
+        bool flush()
+        {
+            while (this->good && not this->segments.empty()) {
+                if (this->segments.front().file) {
+                    this->good = this->send_file();
+                } else if (this->ssl) {
+                    this->good = this->send_tls();
+                } else {
+                    this->good = this->send_plain();
+                }
+            }
+
+            if (not this->good) {
+                this->segments.clear();
+                this->buffered = 0;
+            }
+            return this->good;
+        }
+
+        /**
+         * bytes of memory segments waiting to be sent
+         */
+        size_t size() const
+        {
+            return this->buffered;
+        }
+
+        bool is_good() const
+        {
+            return this->good;
+        }
+    };
+};
@@ -0,0 +1,452 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <fcntl.h>          // non-blocking sockets
+#include <sys/uio.h>        // iovec
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <unordered_set>
+
+#include "libs.h"
+#include "loop.h"
+#include "request.h"
+
+#define PARKED_READ_CHUNK 65536     // bytes read from a parked socket at a time
+
+namespace hussar {
+    /**
+     * what a parked socket does with bytes that would take its queue past its limit
+     */
+    enum class Overflow {
+        DISCONNECT,     // drop the client
+        DROP_OLDEST,    // discard queued messages that haven't started sending
+        DROP_NEWEST     // discard the new message
+    };
+
+    class Channel;
+
+    /**
+     * a client connection handed from a pool thread to the io loop once its
+     * request is answered, for connections that stay open, such as websockets
+     * and event streams.
+     *
+     * the socket is non-blocking and watched by the loop until it closes.
+     * what is sent is queued as shared buffers, so bytes sent to many clients
+     * are never copied per client. a queue past max_queue is handled by its
+     * Overflow policy. everything but the public methods runs on the loop.
+     */
+    class ParkedSocket : public std::enable_shared_from_this<ParkedSocket> {
+    private:
+        friend class Channel;
+
+        struct Pending {
+            std::shared_ptr<const std::string> bytes;
+            size_t sent;
+        };
+
+        std::deque<Pending> output;
+        size_t queued;                  // bytes of output not sent yet
+        uint32_t interest;              // events the socket is watched for
+        bool read_wants_write;          // SSL_read has to write before it can go on
+        bool finishing;                 // the socket closes once output is sent
+        std::vector<Channel*> channels;
+
+        // every read happens on the loop thread, so they share one buffer
+        static char* read_buffer()
+        {
+            static char buf[PARKED_READ_CHUNK];
+            return buf;
+        }
+
+        void update_interest()
+        {
+            uint32_t events = EPOLLIN | EPOLLRDHUP;
+            if (not this->output.empty() || this->read_wants_write) events |= EPOLLOUT;
+            if (events != this->interest) {
+                this->interest = events;
+                io_loop.rearm(this->client, events);
+            }
+        }
+
+        void on_events(uint32_t events)
+        {
+            if (this->closed) return;
+            if (events & EPOLLOUT) this->flush();
+            bool readable = events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+            if (not this->closed && (readable || this->read_wants_write)) this->receive();
+            if (not this->closed) this->update_interest();
+        }
+
+        /**
+         * reads what the socket has and hands it to consume()
+         */
+        void receive()
+        {
+            char* buf = read_buffer();
+            do {
+                ssize_t status;
+                if (this->ssl) {
+                    status = SSL_read(this->ssl, buf, PARKED_READ_CHUNK);
+                    this->read_wants_write = false;
+                    if (status <= 0) {
+                        int error = SSL_get_error(this->ssl, status);
+                        if (error == SSL_ERROR_WANT_READ) return;
+                        if (error == SSL_ERROR_WANT_WRITE) {
+                            this->read_wants_write = true;
+                            return;
+                        }
+                        this->drop();
+                        return;
+                    }
+                } else {
+                    status = recv(this->client, buf, PARKED_READ_CHUNK, MSG_DONTWAIT);
+                    if (status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+                    if (status <= 0) {
+                        this->drop();
+                        return;
+                    }
+                }
+                this->consume(buf, status);
+            } while (not this->closed && this->ssl && SSL_pending(this->ssl) > 0);
+        }
+
+        void flush()
+        {
+            while (not this->output.empty()) {
+                ssize_t status;
+                if (this->ssl) {
+                    Pending& front = this->output.front();
+                    status = SSL_write(this->ssl, front.bytes->data() + front.sent, front.bytes->size() - front.sent);
+                    if (status <= 0) {
+                        int error = SSL_get_error(this->ssl, status);
+                        if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) break;
+                        this->drop();
+                        return;
+                    }
+                } else {
+                    iovec iov[64];
+                    size_t count = 0;
+                    for (auto it = this->output.begin(); it != this->output.end() && count < 64; ++it, ++count) {
+                        iov[count] = { const_cast<char*>(it->bytes->data()) + it->sent, it->bytes->size() - it->sent };
+                    }
+
+                    msghdr msg{};
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = count;
+                    status = sendmsg(this->client, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if (status < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        this->drop();
+                        return;
+                    }
+                }
+
+                this->queued -= status;
+                for (size_t left = status; left > 0; ) {
+                    Pending& front = this->output.front();
+                    size_t take = std::min(left, front.bytes->size() - front.sent);
+                    front.sent += take;
+                    left -= take;
+                    if (front.sent == front.bytes->size()) this->output.pop_front();
+                }
+            }
+
+            if (this->output.empty() && this->finishing) {
+                this->drop();
+                return;
+            }
+            this->update_interest();
+        }
+
+        void teardown();
+
+    protected:
+        int client;
+        SSL* ssl;
+        std::unique_ptr<Request> req;
+        size_t max_queue;
+        Overflow overflow;
+        bool closed;                    // torn down, or about to be
+        std::atomic<bool> running;      // open and taking more output
+
+        /**
+         * handles bytes read from the client
+         */
+        virtual void consume(char* data, size_t size) = 0;
+
+        /**
+         * called once the loop owns the socket, before anything is read
+         */
+        virtual void opened() {}
+
+        /**
+         * called once the socket is closed, after it left its channels
+         */
+        virtual void ended() {}
+
+        /**
+         * queues bytes and sends as much as the socket takes
+         */
+        void push(std::shared_ptr<const std::string> bytes)
+        {
+            if (this->closed || not this->running) return;
+
+            if (this->queued + bytes->size() > this->max_queue) {
+                if (this->overflow == Overflow::DISCONNECT) {
+                    // a client this far behind would hold on to everything it missed
+                    this->drop();
+                    return;
+                }
+                if (this->overflow == Overflow::DROP_OLDEST) {
+                    // a message that started sending has to be finished
+                    auto it = this->output.begin();
+                    if (it != this->output.end() && it->sent) ++it;
+                    while (it != this->output.end() && this->queued + bytes->size() > this->max_queue) {
+                        this->queued -= it->bytes->size();
+                        it = this->output.erase(it);
+                    }
+                }
+                if (this->queued + bytes->size() > this->max_queue) return;
+            }
+
+            this->queued += bytes->size();
+            this->output.push_back(Pending{std::move(bytes), 0});
+
+            // anything queued before is waiting for the socket to be writable
+            if (this->output.size() == 1) this->flush();
+        }
+
+        // closes the connection once the output is sent
+        void finish()
+        {
+            this->finishing = true;
+            if (this->output.empty()) this->drop();
+        }
+
+        /**
+         * tears the connection down once the loop is done with the current
+         * events, so callers may be iterating over it
+         */
+        void drop()
+        {
+            if (this->closed) return;
+            this->closed = true;
+            this->running = false;
+            io_loop.post([self = this->shared_from_this()] {
+                self->teardown();
+            });
+        }
+
+    public:
+        ParkedSocket(int client, SSL* ssl, std::unique_ptr<Request> req, size_t max_queue, Overflow overflow)
+            : queued(0), interest(0), read_wants_write(false), finishing(false), client(client), ssl(ssl),
+              req(std::move(req)), max_queue(max_queue), overflow(overflow), closed(false), running(true)
+        {}
+
+        // delete copy constructors
+        ParkedSocket(ParkedSocket& s) = delete;
+        ParkedSocket(const ParkedSocket& s) = delete;
+        ParkedSocket& operator=(ParkedSocket& s) = delete;
+        ParkedSocket& operator=(const ParkedSocket& s) = delete;
+
+        virtual ~ParkedSocket()
+        {
+            // only still open if the loop never got to start it
+            if (this->ssl) SSL_free(this->ssl);
+            if (this->client >= 0) ::close(this->client);
+        }
+
+        /**
+         * makes the socket non-blocking and hands it to the loop, initial are
+         * bytes that arrived along with the request. only call it on the loop thread
+         */
+        void start(std::string initial)
+        {
+            int flags = fcntl(this->client, F_GETFL);
+            fcntl(this->client, F_SETFL, flags | O_NONBLOCK);
+            if (this->ssl) SSL_set_mode(this->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+            this->interest = EPOLLIN | EPOLLRDHUP;
+            bool attached = io_loop.attach(this->client, this->interest, [self = this->shared_from_this()](uint32_t events) {
+                self->on_events(events);
+            });
+            if (not attached) {
+                this->closed = true;
+                this->running = false;
+                return;
+            }
+
+            this->opened();
+            if (not this->closed && not initial.empty()) this->consume(initial.data(), initial.size());
+
+            // TLS may have decrypted more than the request, the socket won't show it as readable
+            if (not this->closed && this->ssl && SSL_pending(this->ssl) > 0) this->receive();
+        }
+
+        /**
+         * the request that opened the connection, with its params, cookies and session
+         */
+        Request& request()
+        {
+            return *this->req;
+        }
+
+        /**
+         * true until the connection starts closing, callable from any thread
+         */
+        bool is_open() const
+        {
+            return this->running;
+        }
+
+        /**
+         * queues bytes that are already in the protocol's framing, so the same
+         * bytes can be sent to several clients. callable from any thread
+         */
+        void send_bytes(std::shared_ptr<const std::string> bytes)
+        {
+            if (io_loop.in_loop()) {
+                this->push(std::move(bytes));
+                return;
+            }
+            io_loop.post([self = this->shared_from_this(), bytes = std::move(bytes)]() mutable {
+                self->push(std::move(bytes));
+            });
+        }
+    };
+
+    /**
+     * a group of parked sockets that the same bytes are sent to.
+     *
+     * fan_out() queues one shared buffer to every member, so sending to
+     * thousands of sockets costs a reference per socket instead of a copy.
+     * membership lives on the io loop, members leave by themselves when they
+     * close. a channel has to outlive its members, so channels are usually
+     * globals
+     */
+    class Channel {
+    private:
+        friend class ParkedSocket;
+
+        std::unordered_set<ParkedSocket*> members;     // loop thread only
+        std::atomic<size_t> count;
+
+    protected:
+        /**
+         * called on the loop thread after a member joined
+         */
+        virtual void joined() {}
+
+        // add and remove members, callable from any thread
+        void add(ParkedSocket& socket)
+        {
+            if (not io_loop.in_loop()) {
+                io_loop.post([this, self = socket.shared_from_this()] {
+                    this->add(*self);
+                });
+                return;
+            }
+            if (socket.closed || not this->members.insert(&socket).second) return;
+            socket.channels.push_back(this);
+            ++this->count;
+            this->joined();
+        }
+
+        void remove(ParkedSocket& socket)
+        {
+            if (not io_loop.in_loop()) {
+                io_loop.post([this, self = socket.shared_from_this()] {
+                    this->remove(*self);
+                });
+                return;
+            }
+            if (this->members.erase(&socket) == 0) return;
+            std::erase(socket.channels, this);
+            --this->count;
+        }
+
+    public:
+        Channel()
+            : count(0)
+        {}
+
+        // delete copy constructors
+        Channel(Channel& c) = delete;
+        Channel(const Channel& c) = delete;
+        Channel& operator=(Channel& c) = delete;
+        Channel& operator=(const Channel& c) = delete;
+
+        virtual ~Channel() = default;
+
+        /**
+         * queues the same bytes to every member, callable from any thread
+         */
+        void fan_out(std::shared_ptr<const std::string> bytes)
+        {
+            std::function<void()> send_all = [this, bytes = std::move(bytes)] {
+                // members that fail are torn down after this, so the set doesn't change under it
+                for (ParkedSocket* socket : this->members) {
+                    socket->push(bytes);
+                }
+            };
+            if (io_loop.in_loop()) {
+                send_all();
+            } else {
+                io_loop.post(std::move(send_all));
+            }
+        }
+
+        /**
+         * the number of members, callable from any thread
+         */
+        size_t size() const
+        {
+            return this->count;
+        }
+    };
+
+    /**
+     * closes the socket and lets go of everything it holds on the loop
+     */
+    void ParkedSocket::teardown()
+    {
+        io_loop.detach(this->client);
+        for (Channel* channel : this->channels) {
+            channel->members.erase(this);
+            --channel->count;
+        }
+        this->channels.clear();
+
+        try {
+            this->ended();
+        } catch (...) {}
+
+        if (this->ssl) {
+            SSL_shutdown(this->ssl);
+            SSL_free(this->ssl);
+            this->ssl = nullptr;
+        }
+        ::close(this->client);
+        this->client = -1;
+        this->output.clear();
+        this->queued = 0;
+    }
+};
@@ -0,0 +1,727 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <fcntl.h>          // non-blocking connect
+#include <poll.h>           // connect timeout
+#include <sys/un.h>         // unix socket upstreams
+#include <sys/uio.h>        // iovec
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <charconv>         // to_chars, from_chars
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+
+#include "libs.h"
+#include "request.h"
+#include "response.h"
+#include "body.h"
+
+#define PROXY_READ_CHUNK 65536      // bytes of an upstream response body read at a time
+#define PROXY_MAX_HEAD 65536        // largest upstream response head accepted
+#define PROXY_BUFFER_BODY 65536     // upstream bodies up to this size are read into resp.body instead of streamed
+
+namespace hussar {
+    /**
+     * timeouts and pool limits of an upstream server
+     */
+    struct UpstreamOptions {
+        std::chrono::milliseconds connect_timeout{5000};
+        std::chrono::milliseconds read_timeout{30000};  // longest the upstream may go quiet, or take to accept a write
+        size_t max_idle = 32;                           // idle keep-alive connections kept for reuse
+        std::chrono::milliseconds idle_timeout{30000};  // pooled connections idle for longer are closed instead
+    };
+
+    /**
+     * an HTTP/1.1 server that requests are forwarded to, over TCP as
+     * "host:port" or a unix socket as "unix:/path". the address is resolved
+     * once, when the upstream is created.
+     *
+     * connections are kept alive between requests in a pool of up to
+     * max_idle. the most recently released one is reused first, so the
+     * others age out when there are more than the load needs.
+     */
+    class Upstream {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct Idle {
+            int fd;
+            clock::time_point since;
+        };
+
+        std::string address;
+        std::string host;           // Host header for requests that came without one
+        UpstreamOptions options;
+        sockaddr_storage addr;
+        socklen_t addr_length;
+        std::mutex mtx;
+        std::deque<Idle> idle;      // most recently released at the back
+
+        // opens a new connection, -1 with errno set if it can't be made in time
+        int open()
+        {
+            bool connecting;
+            int fd = this->connect_start(connecting);
+            if (fd < 0) return -1;
+
+            int error = 0;
+            if (connecting) {
+                pollfd wait = { fd, POLLOUT, 0 };
+                int ready;
+                do {
+                    ready = poll(&wait, 1, this->options.connect_timeout.count());
+                } while (ready < 0 && errno == EINTR);
+
+                socklen_t length = sizeof(error);
+                if (ready == 0) {
+                    error = ETIMEDOUT;
+                } else if (ready < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                    error = errno;
+                }
+            }
+            if (error) {
+                ::close(fd);
+                errno = error;
+                return -1;
+            }
+
+            // the connection is used blocking, the timeouts bound every read and write
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            timeval timeout = {
+                static_cast<time_t>(this->options.read_timeout.count() / 1000),
+                static_cast<suseconds_t>(this->options.read_timeout.count() % 1000 * 1000)
+            };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (this->addr.ss_family != AF_UNIX) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            return fd;
+        }
+
+    public:
+        /**
+         * starts connecting a non-blocking socket, connecting is set while the
+         * connect is still in progress. returns -1 with errno set if it failed
+         */
+        int connect_start(bool& connecting)
+        {
+            int fd = socket(this->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) return -1;
+
+            connecting = false;
+            if (connect(fd, reinterpret_cast<sockaddr*>(&this->addr), this->addr_length) < 0) {
+                if (errno != EINPROGRESS) {
+                    int error = errno;
+                    ::close(fd);
+                    errno = error;
+                    return -1;
+                }
+                connecting = true;
+            }
+            return fd;
+        }
+
+        Upstream(const std::string& address, UpstreamOptions options = {})
+            : address(address), options(std::move(options)), addr{}, addr_length(0)
+        {
+            if (address.starts_with("unix:")) {
+                sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&this->addr);
+                std::string path = address.substr(5);
+                if (path.empty() || path.size() >= sizeof(un->sun_path)) {
+                    fatal_error("ERROR bad unix socket upstream: " + address);
+                }
+                un->sun_family = AF_UNIX;
+                std::memcpy(un->sun_path, path.data(), path.size());
+                this->addr_length = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+                this->host = "localhost";
+                return;
+            }
+
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+                fatal_error("ERROR upstream needs a host and port: " + address);
+            }
+            std::string name = address.substr(0, colon);
+            if (name.starts_with('[') && name.ends_with(']')) name = name.substr(1, name.size() - 2);
+
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* found;
+            if (getaddrinfo(name.c_str(), address.c_str() + colon + 1, &hints, &found) != 0) {
+                fatal_error("ERROR can't resolve upstream: " + address);
+            }
+            std::memcpy(&this->addr, found->ai_addr, found->ai_addrlen);
+            this->addr_length = found->ai_addrlen;
+            freeaddrinfo(found);
+            this->host = address;
+        }
+
+        // delete copy constructors
+        Upstream(Upstream& u) = delete;
+        Upstream(const Upstream& u) = delete;
+        Upstream& operator=(Upstream& u) = delete;
+        Upstream& operator=(const Upstream& u) = delete;
+
+        ~Upstream()
+        {
+            for (Idle& conn : this->idle) {
+                ::close(conn.fd);
+            }
+        }
+
+        /**
+         * takes a pooled connection, or opens a new one if none are left.
+         * reused tells which, the upstream may still have closed a reused
+         * connection just as it was taken. returns -1 with errno set if a new
+         * connection can't be made
+         */
+        int acquire(bool& reused)
+        {
+            auto now = clock::now();
+            while (true) {
+                Idle conn;
+                {
+                    std::lock_guard<std::mutex> lock(this->mtx);
+                    if (this->idle.empty()) break;
+                    conn = this->idle.back();
+                    this->idle.pop_back();
+                }
+
+                // an idle connection has nothing to read unless the upstream closed it
+                char c;
+                if (now - conn.since < this->options.idle_timeout &&
+                    recv(conn.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    reused = true;
+                    return conn.fd;
+                }
+                ::close(conn.fd);
+            }
+
+            reused = false;
+            return this->open();
+        }
+
+        /**
+         * returns a connection that finished its exchange cleanly to the pool
+         */
+        void release(int fd)
+        {
+            auto now = clock::now();
+            std::lock_guard<std::mutex> lock(this->mtx);
+            while (not this->idle.empty() && (this->idle.size() >= this->options.max_idle || now - this->idle.front().since >= this->options.idle_timeout)) {
+                ::close(this->idle.front().fd);
+                this->idle.pop_front();
+            }
+            if (this->options.max_idle) {
+                this->idle.push_back({ fd, now });
+            } else {
+                ::close(fd);
+            }
+        }
+
+        const std::string& name() const
+        {
+            return this->address;
+        }
+
+        const std::string& host_header() const
+        {
+            return this->host;
+        }
+    };
+
+    /**
+     * a connection borrowed from an upstream, closed when it's dropped
+     * unless it was handed back to the pool
+     */
+    class UpstreamConnection {
+    public:
+        Upstream& upstream;
+        int fd;
+        std::string input;  // bytes read past the response head
+        bool reused;
+
+        UpstreamConnection(Upstream& upstream, int fd, bool reused)
+            : upstream(upstream), fd(fd), reused(reused)
+        {}
+
+        // delete copy constructors
+        UpstreamConnection(UpstreamConnection& c) = delete;
+        UpstreamConnection(const UpstreamConnection& c) = delete;
+        UpstreamConnection& operator=(UpstreamConnection& c) = delete;
+        UpstreamConnection& operator=(const UpstreamConnection& c) = delete;
+
+        ~UpstreamConnection()
+        {
+            if (this->fd >= 0) ::close(this->fd);
+        }
+
+        void release()
+        {
+            this->upstream.release(this->fd);
+            this->fd = -1;
+        }
+
+        ssize_t read(char* dst, size_t count)
+        {
+            while (true) {
+                ssize_t status = ::read(this->fd, dst, count);
+                if (status >= 0 || errno != EINTR) return status;
+            }
+        }
+
+        /**
+         * writes every buffer, returns false if the upstream failed or timed out
+         */
+        bool send(iovec* iov, int count)
+        {
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            while (msg.msg_iovlen) {
+                ssize_t sent = sendmsg(this->fd, &msg, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent <= 0) return false;
+                while (msg.msg_iovlen && static_cast<size_t>(sent) >= msg.msg_iov->iov_len) {
+                    sent -= msg.msg_iov->iov_len;
+                    ++msg.msg_iov;
+                    --msg.msg_iovlen;
+                }
+                if (msg.msg_iovlen) {
+                    msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + sent;
+                    msg.msg_iov->iov_len -= sent;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * sends data, as a chunk of the chunked transfer coding if chunked
+         */
+        bool send(std::string_view data, bool chunked)
+        {
+            if (data.empty()) return true;
+            if (not chunked) {
+                iovec iov = { const_cast<char*>(data.data()), data.size() };
+                return this->send(&iov, 1);
+            }
+
+            char size_line[24];
+            auto end = std::to_chars(size_line, size_line + sizeof(size_line) - 2, data.size(), 16).ptr;
+            *end++ = '\r';
+            *end++ = '\n';
+            iovec iov[3] = {
+                { size_line, static_cast<size_t>(end - size_line) },
+                { const_cast<char*>(data.data()), data.size() },
+                { const_cast<char*>("\r\n"), 2 },
+            };
+            return this->send(iov, 3);
+        }
+    };
+
+    /**
+     * returns true if sending a request with the method twice has the same
+     * effect as sending it once, so it may be sent again after a failure
+     */
+    bool idempotent(Method method)
+    {
+        return method != Method::POST && method != Method::PATCH && method != Method::OTHER;
+    }
+
+    /**
+     * returns true for headers that only describe one hop of a request and
+     * aren't passed along by a proxy
+     */
+    bool hop_by_hop(std::string_view name)
+    {
+        return iequals(name, "Connection") || iequals(name, "Keep-Alive") || iequals(name, "Proxy-Connection") ||
+            iequals(name, "TE") || iequals(name, "Trailer") || iequals(name, "Transfer-Encoding") || iequals(name, "Upgrade");
+    }
+
+    /**
+     * the rest of an upstream response body, passed on to the client as it
+     * arrives. the connection goes back to the pool once the whole body went
+     * through, and is closed if the client leaves first
+     */
+    class UpstreamBody {
+    public:
+        enum class Framing {
+            LENGTH,
+            CHUNKED,
+            CLOSE       // the body ends when the upstream closes the connection
+        };
+
+    private:
+        std::unique_ptr<UpstreamConnection> conn;
+        Framing framing;
+        uint64_t remaining;
+        ChunkedDecoder decoder;
+        bool keep_alive;
+
+        bool done() const
+        {
+            switch (this->framing) {
+                case Framing::LENGTH: return this->remaining == 0;
+                case Framing::CHUNKED: return this->decoder.done();
+                default: return false;
+            }
+        }
+
+        // passes bytes of the body on, returns false once the client is gone
+        bool forward(ResponseWriter& w, char* data, size_t size)
+        {
+            if (this->framing == Framing::CHUNKED) {
+                size_t produced;
+                size_t used = this->decoder.decode(data, size, produced);
+                if (this->decoder.failed()) throw std::runtime_error("malformed chunk from upstream " + this->conn->upstream.name());
+                if (used < size) this->keep_alive = false; // more than the response was sent
+                size = produced;
+            } else if (this->framing == Framing::LENGTH) {
+                if (size > this->remaining) {
+                    this->keep_alive = false;
+                    size = this->remaining;
+                }
+                this->remaining -= size;
+            }
+
+            // whatever the upstream sent is flushed, so a slow stream isn't held back
+            return w.write(std::string_view(data, size)) && w.flush();
+        }
+
+    public:
+        UpstreamBody(std::unique_ptr<UpstreamConnection> conn, Framing framing, uint64_t length, bool keep_alive)
+            : conn(std::move(conn)), framing(framing), remaining(length), keep_alive(keep_alive && framing != Framing::CLOSE)
+        {}
+
+        // delete copy constructors
+        UpstreamBody(UpstreamBody& b) = delete;
+        UpstreamBody(const UpstreamBody& b) = delete;
+        UpstreamBody& operator=(UpstreamBody& b) = delete;
+        UpstreamBody& operator=(const UpstreamBody& b) = delete;
+
+        /**
+         * sends the body through the writer, throws if the upstream fails
+         * part way so the client's response is cut short
+         */
+        void pipe(ResponseWriter& w)
+        {
+            std::string first = std::move(this->conn->input);
+            this->conn->input.clear();
+            if (not first.empty() && not this->forward(w, first.data(), first.size())) return;
+
+            std::unique_ptr<char[]> buf(new char[PROXY_READ_CHUNK]);
+            while (not this->done()) {
+                size_t want = this->framing == Framing::LENGTH ? std::min<uint64_t>(this->remaining, PROXY_READ_CHUNK) : PROXY_READ_CHUNK;
+                ssize_t status = this->conn->read(buf.get(), want);
+                if (status == 0 && this->framing == Framing::CLOSE) return;
+                if (status <= 0) throw std::runtime_error("upstream " + this->conn->upstream.name() + " failed mid body");
+                if (not this->forward(w, buf.get(), status)) return;
+            }
+            if (this->keep_alive) this->conn->release();
+        }
+    };
+
+    /**
+     * builds the head of the request sent upstream. hop-by-hop headers are
+     * left out, the client's address is added to X-Forwarded-For and the
+     * body is framed by length unless it's chunked
+     */
+    std::string upstream_head(Request& req, const Upstream& upstream, bool chunked, uint64_t length)
+    {
+        std::string head;
+        head.reserve(req.head_raw.size() + req.remote_host.size() + 96);
+        head += req.method;
+        head += ' ';
+        head += req.document_raw;
+        head += " HTTP/1.1\r\n";
+
+        std::string_view connection = req.header("Connection");
+        std::string forwarded;
+        bool has_host = false;
+        for (std::string_view line : req.headers) {
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0) continue;
+            std::string_view name = line.substr(0, colon);
+            if (hop_by_hop(name) || has_token(connection, name) || iequals(name, "Content-Length") || iequals(name, "Expect")) continue;
+            if (iequals(name, "X-Forwarded-For")) {
+                if (not forwarded.empty()) forwarded += ", ";
+                forwarded += trim(line.substr(colon + 1));
+                continue;
+            }
+            has_host = has_host || iequals(name, "Host");
+            head += line;
+            head += "\r\n";
+        }
+
+        if (not has_host) {
+            head += "Host: ";
+            head += upstream.host_header();
+            head += "\r\n";
+        }
+        head += "X-Forwarded-For: ";
+        if (not forwarded.empty()) {
+            head += forwarded;
+            head += ", ";
+        }
+        head += req.remote_host;
+        head += "\r\n";
+
+        if (chunked) {
+            head += "Transfer-Encoding: chunked\r\n";
+        } else if (length || not req.content_length.empty() || req.chunked()) {
+            char digits[24];
+            auto end = std::to_chars(digits, digits + sizeof(digits), length).ptr;
+            head += "Content-Length: ";
+            head.append(digits, end);
+            head += "\r\n";
+        }
+        head += "\r\n";
+        return head;
+    }
+
+    /**
+     * reads a response head off the upstream into head, bytes after it stay
+     * in conn.input. returns false if the upstream closed, failed, timed out
+     * or sent a head larger than PROXY_MAX_HEAD, with errno telling which.
+     * received counts the bytes it sent
+     */
+    bool read_upstream_head(UpstreamConnection& conn, std::string& head, size_t& received)
+    {
+        std::string& raw = conn.input;
+        size_t scanned = 0;
+        size_t end;
+        while ((end = raw.find("\r\n\r\n", scanned)) == std::string::npos) {
+            if (raw.size() >= PROXY_MAX_HEAD) {
+                errno = EPROTO;
+                return false;
+            }
+            scanned = raw.size() < 3 ? 0 : raw.size() - 3;
+            size_t old_size = raw.size();
+            raw.resize(std::max<size_t>(old_size + 4096, std::min<size_t>(old_size * 2, PROXY_MAX_HEAD)));
+            ssize_t status = conn.read(raw.data() + old_size, raw.size() - old_size);
+            raw.resize(old_size + std::max<ssize_t>(status, 0));
+            if (status == 0) errno = ECONNRESET;
+            if (status <= 0) return false;
+            received += status;
+        }
+
+        head.assign(raw, 0, end + 2);
+        raw.erase(0, end + 4);
+        return true;
+    }
+
+    /**
+     * forwards the request to upstream and fills resp with its answer.
+     *
+     * the body is sent as the handler reads it, from req.body and then
+     * req.read_body() on stream_body routes. a pooled connection the upstream
+     * closed before answering is retried on another, as long as the
+     * request is idempotent and none of its body had to be streamed. small
+     * response bodies are read into resp.body, larger ones are streamed to
+     * the client as they arrive. returns false if the upstream failed, resp
+     * is then a 502, or a 504 if it timed out
+     */
+    bool proxy_request(Upstream& upstream, Request& req, Response& resp)
+    {
+        auto fail = [&resp](int error) {
+            bool timeout = error == EAGAIN || error == EWOULDBLOCK || error == ETIMEDOUT;
+            resp.code = timeout ? "504" : "502";
+            resp.body = timeout ? "<h1>504: Gateway Timeout</h1>" : "<h1>502: Bad Gateway</h1>";
+            return false;
+        };
+
+        // a chunked body not read yet is sent on chunked, anything else by its length
+        bool chunked = req.body_source && req.chunked();
+        uint64_t length = req.body_source ? req.declared_length().value_or(req.body.size()) : req.body.size();
+        std::string request_head = upstream_head(req, upstream, chunked, length);
+
+        std::unique_ptr<UpstreamConnection> conn;
+        std::string head;
+        bool streamed = false;
+        while (true) {
+            bool reused;
+            int fd = upstream.acquire(reused);
+            if (fd < 0) return fail(errno);
+            conn = std::make_unique<UpstreamConnection>(upstream, fd, reused);
+
+            bool sent = conn->send(request_head, false) && conn->send(req.body, chunked);
+            std::string_view piece;
+            ssize_t status = 0;
+            while (sent && (status = req.read_body(piece)) > 0) {
+                streamed = true;
+                sent = conn->send(piece, chunked);
+            }
+            if (sent && status < 0) {
+                // the client's body failed, not the upstream
+                if (status == -3) {
+                    resp.code = "413";
+                    resp.body = "<h1>413: Payload Too Large!</h1>";
+                } else if (status == -2) {
+                    resp.code = "400";
+                    resp.body = "<h1>400: Bad Request!</h1>";
+                } else {
+                    // the client's connection failed, there's no one left to answer
+                    req.keep_alive = false;
+                }
+                return true;
+            }
+            if (sent && chunked) sent = conn->send("0\r\n\r\n", false);
+
+            size_t received = 0;
+            if (sent && read_upstream_head(*conn, head, received)) break;
+            int error = errno;
+
+            // the upstream may close a kept alive connection just as it's taken, nothing was lost on it
+            bool unsent = not sent && not streamed;
+            bool replayable = idempotent(req.method_id) && received == 0 && not streamed && error != EAGAIN && error != EWOULDBLOCK;
+            if (conn->reused && (unsent || replayable)) continue;
+            return fail(error);
+        }
+
+        // informational responses come ahead of the real one
+        int code;
+        std::string_view line;
+        while (true) {
+            line = std::string_view(head).substr(0, head.find("\r\n"));
+            if (not line.starts_with("HTTP/1.") || line.size() < 12 || line[8] != ' ') return fail(EPROTO);
+            code = status_number(line.substr(9, 3));
+            if (code < 100 || code == 101) return fail(EPROTO);
+            if (code >= 200) break;
+            size_t received = 0;
+            if (not read_upstream_head(*conn, head, received)) return fail(errno);
+        }
+        bool http10 = line[7] == '0';
+        std::string_view reason = line.size() > 13 ? line.substr(13) : std::string_view();
+        std::string_view lines = std::string_view(head).substr(line.size() + 2);
+
+        // the fields framing the body, split off one line at a time
+        auto next_field = [](std::string_view& rest, std::string_view& name, std::string_view& value) {
+            while (not rest.empty()) {
+                size_t end = rest.find("\r\n");
+                std::string_view field = rest.substr(0, end);
+                rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 2);
+                size_t colon = field.find(':');
+                if (colon == std::string_view::npos || colon == 0) continue;
+                name = field.substr(0, colon);
+                value = trim(field.substr(colon + 1));
+                return true;
+            }
+            return false;
+        };
+
+        std::string_view name, value, connection, transfer_encoding, content_length;
+        for (std::string_view rest = lines; next_field(rest, name, value);) {
+            if (iequals(name, "Connection")) connection = value;
+            else if (iequals(name, "Transfer-Encoding")) transfer_encoding = value;
+            else if (iequals(name, "Content-Length")) content_length = value;
+        }
+
+        bool keep_alive = http10 ? has_token(connection, "keep-alive") : not has_token(connection, "close");
+        bool no_body = req.method_id == Method::HEAD || code == 204 || code == 304;
+
+        // a transfer coding other than chunked leaves the body to end with the connection
+        uint64_t body_length = 0;
+        bool has_length = false;
+        if (transfer_encoding.empty() && not content_length.empty()) {
+            auto [end, error] = std::from_chars(content_length.data(), content_length.data() + content_length.size(), body_length);
+            if (error != std::errc() || end != content_length.data() + content_length.size()) return fail(EPROTO);
+            has_length = true;
+        }
+
+        std::string body;
+        bool buffered = not no_body && has_length && body_length <= PROXY_BUFFER_BODY;
+        if (buffered) {
+            body = std::move(conn->input);
+            conn->input.clear();
+            if (body.size() > body_length) {
+                keep_alive = false;
+                body.resize(body_length);
+            }
+            while (body.size() < body_length) {
+                size_t old_size = body.size();
+                body.resize(body_length);
+                ssize_t status = conn->read(body.data() + old_size, body_length - old_size);
+                body.resize(old_size + std::max<ssize_t>(status, 0));
+                if (status <= 0) return fail(status == 0 ? ECONNRESET : errno);
+            }
+        }
+
+        resp.code = std::string(line.substr(9, 3));
+        resp.status = reason.empty() ? resp.code : std::string(reason);
+        resp.headers.erase("Content-Type");
+        resp.headers.erase("Server");
+        for (std::string_view rest = lines; next_field(rest, name, value);) {
+            if (hop_by_hop(name) || has_token(connection, name) || iequals(name, "Content-Length") || iequals(name, "Date")) continue;
+
+            auto [found, added] = resp.headers.try_emplace(std::string(name), value);
+            if (added) continue;
+            // Set-Cookie can't be folded into one line, each value gets a line of its own
+            if (iequals(name, "Set-Cookie")) {
+                found->second += "\r\n";
+                found->second += name;
+                found->second += ": ";
+            } else {
+                found->second += ", ";
+            }
+            found->second += value;
+        }
+
+        if (no_body) {
+            // a HEAD response still tells the client how long the body would be
+            if (req.method_id == Method::HEAD && has_length) resp.stream([](ResponseWriter&) {}, body_length);
+            if (keep_alive && conn->input.empty()) conn->release();
+            return true;
+        }
+
+        if (buffered) {
+            resp.body = std::move(body);
+            if (keep_alive) conn->release();
+            return true;
+        }
+
+        UpstreamBody::Framing framing = has_length ? UpstreamBody::Framing::LENGTH
+            : has_token(transfer_encoding, "chunked") ? UpstreamBody::Framing::CHUNKED : UpstreamBody::Framing::CLOSE;
+        auto stream = std::make_shared<UpstreamBody>(std::move(conn), framing, body_length, keep_alive);
+        stream_handler producer = [stream](ResponseWriter& w) {
+            stream->pipe(w);
+        };
+        if (has_length) {
+            resp.stream(std::move(producer), body_length);
+        } else {
+            resp.stream(std::move(producer));
+        }
+        return true;
+    }
+
+    /**
+     * route handler forwarding requests to upstream. register it with
+     * RouteOptions::stream_body, or through Router::proxy(), so request
+     * bodies are streamed instead of read and parsed first
+     */
+    std::function<void (Request&, Response&)> proxy(Upstream& upstream)
+    {
+        return [&upstream](Request& req, Response& resp) {
+            proxy_request(upstream, req, resp);
+        };
+    }
+};
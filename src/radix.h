@@ -0,0 +1,312 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include "util.h"
+
+#define MAX_ROUTE_PARAMS 16
+
+namespace hussar {
+    /**
+     * fixed capacity list of captured route parameters, names point into the
+     * route tree and values point into the request document so filling it in
+     * never allocates
+     */
+    class RouteParams {
+    public:
+        using param = std::pair<std::string_view, std::string_view>;
+
+    private:
+        std::array<param, MAX_ROUTE_PARAMS> params;
+        size_t count = 0;
+
+    public:
+        bool push(std::string_view name, std::string_view value)
+        {
+            if (this->count == MAX_ROUTE_PARAMS) return false;
+            this->params[this->count++] = { name, value };
+            return true;
+        }
+
+        void truncate(size_t size)
+        {
+            if (size < this->count) this->count = size;
+        }
+
+        void clear()
+        {
+            this->count = 0;
+        }
+
+        size_t size() const
+        {
+            return this->count;
+        }
+
+        bool contains(std::string_view name) const
+        {
+            for (size_t n = 0; n < this->count; ++n) {
+                if (this->params[n].first == name) return true;
+            }
+            return false;
+        }
+
+        // returns the captured value or an empty view if the parameter doesn't exist
+        std::string_view operator[](std::string_view name) const
+        {
+            for (size_t n = 0; n < this->count; ++n) {
+                if (this->params[n].first == name) return this->params[n].second;
+            }
+            return {};
+        }
+
+        auto begin() const
+        {
+            return this->params.begin();
+        }
+
+        auto end() const
+        {
+            return this->params.begin() + this->count;
+        }
+    };
+
+    /**
+     * compressed radix tree mapping route paths to values.
+     *
+     * static text is shared between routes by common prefix, ":name" matches a
+     * single non-empty path segment and "*name" matches the rest of the path.
+     * static edges are preferred over parameters, and parameters over wildcards.
+     */
+    template <typename T>
+    class RadixTree {
+    private:
+        struct Node {
+            std::string prefix;                         // static text matched by this node
+            std::string indices;                        // first char of each static child
+            std::vector<std::unique_ptr<Node>> children;
+            std::unique_ptr<Node> param_child;          // ":name" child
+            std::unique_ptr<Node> wildcard_child;       // "*name" child
+            std::string param_name;                     // name when this is a param or wildcard node
+            bool has_value = false;
+            T value;
+        };
+
+        Node root;
+        size_t routes = 0;
+
+        /**
+         * inserts the remainder of a route below node n, n's own prefix has already been consumed
+         */
+        void add(Node* n, std::string_view path, const std::string& route, T&& value, size_t param_count)
+        {
+            if (path.empty()) {
+                if (not n->has_value) ++this->routes;
+                n->has_value = true;
+                n->value = std::move(value);
+                return;
+            }
+
+            if (path[0] == ':' || path[0] == '*') {
+                if (++param_count > MAX_ROUTE_PARAMS) {
+                    fatal_error("ERROR too many parameters in route: " + route);
+                }
+
+                bool wildcard = path[0] == '*';
+                size_t end = wildcard ? path.size() : path.find('/');
+                if (end == std::string_view::npos) end = path.size();
+                std::string_view name = path.substr(1, end - 1);
+
+                if (wildcard && end != path.size()) {
+                    fatal_error("ERROR wildcard must end the route: " + route);
+                }
+
+                std::unique_ptr<Node>& child = wildcard ? n->wildcard_child : n->param_child;
+                if (not child) {
+                    child = std::make_unique<Node>();
+                    child->param_name = name;
+                } else if (child->param_name != name) {
+                    fatal_error("ERROR conflicting parameter names in route: " + route);
+                }
+                this->add(child.get(), path.substr(end), route, std::move(value), param_count);
+                return;
+            }
+
+            // static text runs until the next parameter or wildcard
+            size_t end = path.find_first_of(":*");
+            if (end == std::string_view::npos) end = path.size();
+            std::string_view text = path.substr(0, end);
+
+            size_t index = n->indices.find(text[0]);
+            if (index == std::string::npos) {
+                auto child = std::make_unique<Node>();
+                child->prefix = text;
+                Node* next = child.get();
+                n->indices.push_back(text[0]);
+                n->children.emplace_back(std::move(child));
+                this->add(next, path.substr(end), route, std::move(value), param_count);
+                return;
+            }
+
+            // length of the prefix shared with the existing edge
+            Node* child = n->children[index].get();
+            size_t common = 0;
+            while (common < text.size() && common < child->prefix.size() && text[common] == child->prefix[common]) {
+                ++common;
+            }
+
+            // split the edge so the shared prefix gets its own node
+            if (common < child->prefix.size()) {
+                auto split = std::make_unique<Node>();
+                split->prefix = child->prefix.substr(0, common);
+                child->prefix.erase(0, common);
+                split->indices.push_back(child->prefix[0]);
+                split->children.emplace_back(std::move(n->children[index]));
+                n->children[index] = std::move(split);
+                child = n->children[index].get();
+            }
+
+            this->add(child, path.substr(common), route, std::move(value), param_count);
+        }
+
+        /**
+         * walks the tree below node n for the remaining path, backtracking out of
+         * parameter branches that don't lead to a value
+         */
+        const T* match(const Node* n, std::string_view path, RouteParams& params) const
+        {
+            if (path.empty()) {
+                if (n->has_value) return &n->value;
+            } else {
+                size_t index = n->indices.find(path[0]);
+                if (index != std::string::npos) {
+                    const Node* child = n->children[index].get();
+                    if (path.starts_with(child->prefix)) {
+                        const T* found = this->match(child, path.substr(child->prefix.size()), params);
+                        if (found) return found;
+                    }
+                }
+
+                if (n->param_child && path[0] != '/') {
+                    size_t end = path.find('/');
+                    if (end == std::string_view::npos) end = path.size();
+                    size_t mark = params.size();
+                    if (params.push(n->param_child->param_name, path.substr(0, end))) {
+                        const T* found = this->match(n->param_child.get(), path.substr(end), params);
+                        if (found) return found;
+                        params.truncate(mark);
+                    }
+                }
+            }
+
+            if (n->wildcard_child && n->wildcard_child->has_value) {
+                if (params.push(n->wildcard_child->param_name, path)) {
+                    return &n->wildcard_child->value;
+                }
+            }
+
+            return nullptr;
+        }
+
+        /**
+         * calls func for every value reachable through static text only
+         */
+        template <typename F>
+        void visit_static(const Node* n, std::string& path, F& func) const
+        {
+            size_t mark = path.size();
+            path += n->prefix;
+            if (n->has_value) func(path, n->value);
+            for (auto& child : n->children) {
+                this->visit_static(child.get(), path, func);
+            }
+            path.resize(mark);
+        }
+
+        /**
+         * calls func for every value below node n
+         */
+        template <typename F>
+        void visit(Node* n, F& func)
+        {
+            if (n->has_value) func(n->value);
+            for (auto& child : n->children) {
+                this->visit(child.get(), func);
+            }
+            if (n->param_child) this->visit(n->param_child.get(), func);
+            if (n->wildcard_child) this->visit(n->wildcard_child.get(), func);
+        }
+
+    public:
+        RadixTree() = default;
+
+        // delete copy constructors
+        RadixTree(RadixTree& t) = delete;
+        RadixTree(const RadixTree& t) = delete;
+        RadixTree& operator=(RadixTree& t) = delete;
+        RadixTree& operator=(const RadixTree& t) = delete;
+
+        RadixTree(RadixTree&& t) = default;
+        RadixTree& operator=(RadixTree&& t) = default;
+
+        /**
+         * registers value for route, replacing any value already registered for it
+         */
+        void insert(const std::string& route, T value)
+        {
+            this->add(&this->root, route, route, std::move(value), 0);
+        }
+
+        /**
+         * returns the value registered for path or nullptr, captured parameters are appended to params
+         */
+        const T* find(std::string_view path, RouteParams& params) const
+        {
+            size_t mark = params.size();
+            const T* found = this->match(&this->root, path, params);
+            if (not found) params.truncate(mark);
+            return found;
+        }
+
+        /**
+         * calls func(path, value) for every route without parameters or wildcards
+         */
+        template <typename F>
+        void for_each_static(F func) const
+        {
+            std::string path;
+            this->visit_static(&this->root, path, func);
+        }
+
+        /**
+         * calls func(value) for every registered route
+         */
+        template <typename F>
+        void for_each(F func)
+        {
+            this->visit(&this->root, func);
+        }
+
+        size_t size() const
+        {
+            return this->routes;
+        }
+    };
+};
@@ -17,12 +17,59 @@
 
 #pragma once
 
+#include <charconv>   // from_chars
+
 #include "libs.h"
 #include "upload.h"
 #include "cookie.h"
 #include "session.h"
+#include "radix.h"
 
 namespace hussar {
+    enum class Method {
+        GET,
+        HEAD,
+        POST,
+        PUT,
+        DELETE,
+        CONNECT,
+        OPTIONS,
+        TRACE,
+        PATCH,
+        OTHER
+    };
+
+    constexpr size_t METHOD_COUNT = static_cast<size_t>(Method::OTHER) + 1;
+
+    /**
+     * returns the Method for a request method token, Method::OTHER if it isn't a standard method
+     */
+    Method parse_method(std::string_view method)
+    {
+        switch (method.size()) {
+            case 3:
+                if (method == "GET") return Method::GET;
+                if (method == "PUT") return Method::PUT;
+                break;
+            case 4:
+                if (method == "HEAD") return Method::HEAD;
+                if (method == "POST") return Method::POST;
+                break;
+            case 5:
+                if (method == "PATCH") return Method::PATCH;
+                if (method == "TRACE") return Method::TRACE;
+                break;
+            case 6:
+                if (method == "DELETE") return Method::DELETE;
+                break;
+            case 7:
+                if (method == "OPTIONS") return Method::OPTIONS;
+                if (method == "CONNECT") return Method::CONNECT;
+                break;
+        }
+        return Method::OTHER;
+    }
+
     class Request {
 
     public:
@@ -30,11 +77,13 @@ namespace hussar {
         bool keep_alive;
         std::string remote_host;
         std::string method;
+        Method method_id;
         std::string document;
         std::string document_raw;
         std::string get_query_raw;
         std::string post_query_raw;
         std::string version;
+        std::string head_raw;
         std::vector<std::string_view> headers;
         std::string user_agent;
         std::string connection;
@@ -47,7 +96,9 @@ namespace hussar {
         std::unordered_map<std::string, std::string> get;
         std::unordered_map<std::string, std::string> post;
         std::unordered_map<std::string, Cookie> cookies;
-        std::unordered_map<std::string, UploadedFile> files;
+        std::unordered_multimap<std::string, UploadedFile> files; // every file of a multipart body by field name
+        RouteParams params;
+        std::function<ssize_t (std::string_view&)> body_source; // the unread rest of a stream_body route's body
 
     private:
     
@@ -224,7 +275,7 @@ namespace hussar {
          * populates the Request class data members with request data
          */
         Request(const std::string& request, std::string host)
-            : is_good(true), keep_alive(false), remote_host(host)
+            : is_good(true), keep_alive(false), remote_host(host), method_id(Method::OTHER)
         {
             std::vector<std::string> headers;
             std::vector<std::string> resource_line_split;
@@ -243,6 +294,13 @@ namespace hussar {
                     this->is_good = false;
                     return;
                 }
+                // keep the raw header lines for lookups by name
+                this->head_raw = head_body_split[0];
+                auto header_lines = split_string<std::string_view>(this->head_raw, "\r\n");
+                if (header_lines.size() > 1) {
+                    this->headers.assign(header_lines.begin() + 1, header_lines.end());
+                }
+
                 // remove the headers from the original split
                 head_body_split.erase(head_body_split.begin());
 
@@ -262,6 +320,7 @@ namespace hussar {
         
             // parse the request line
             this->method = resource_line_split[0];
+            this->method_id = parse_method(this->method);
             this->document_raw = resource_line_split[1];
             this->version = resource_line_split[2];
             this->document = this->extract_document(this->document_raw);
@@ -286,13 +345,108 @@ namespace hussar {
             // parse GET params
             this->parse_params(this->get, this->get_query_raw);
 
+            // a Content-Length that isn't a number can't frame the body
+            if (not this->content_length.empty() && not this->declared_length()) {
+                this->is_good = false;
+                return;
+            }
+
             // parse POST params if method is POST
+            this->parse_post();
+        }
+
+        /**
+         * parses url encoded POST parameters from the body, again after the
+         * rest of the body has been read
+         */
+        void parse_post()
+        {
             if (this->content_type == "application/x-www-form-urlencoded") {
+                this->post.clear();
                 this->post_query_raw = this->body;
                 this->parse_params(this->post, this->post_query_raw);
             }
         }
 
+        /**
+         * returns the body size from Content-Length, nothing if the header is
+         * missing or not a number
+         */
+        std::optional<uint64_t> declared_length() const
+        {
+            uint64_t length;
+            const char* end = this->content_length.data() + this->content_length.size();
+            auto [ptr, error] = std::from_chars(this->content_length.data(), end, length);
+            if (this->content_length.empty() || error != std::errc() || ptr != end) return std::nullopt;
+            return length;
+        }
+
+        /**
+         * true if the body is framed by the chunked transfer coding, which
+         * overrides any Content-Length
+         */
+        bool chunked() const
+        {
+            return iequals(this->header("Transfer-Encoding"), "chunked");
+        }
+
+        /**
+         * reads the next piece of a stream_body route's body, following the
+         * bytes that came with the head in req.body. the piece stays valid
+         * until the next call. returns its size, 0 at the end of the body, -1
+         * if the connection failed, -2 if the chunked framing is malformed
+         * and -3 once the body grows past max_upload. other routes have their
+         * whole body in req.body already, so this returns 0
+         */
+        ssize_t read_body(std::string_view& piece)
+        {
+            return this->body_source ? this->body_source(piece) : 0;
+        }
+
+        /**
+         * returns the value of the named header, or an empty view if it wasn't sent
+         */
+        std::string_view header(std::string_view name) const
+        {
+            for (std::string_view line : this->headers) {
+                if (line.size() > name.size() && line[name.size()] == ':' && iequals(line.substr(0, name.size()), name)) {
+                    return trim(line.substr(name.size() + 1));
+                }
+            }
+            return {};
+        }
+
+        /**
+         * returns true if the client accepts the content coding by its
+         * Accept-Encoding header, a q-value of zero refuses it
+         */
+        bool accepts_encoding(std::string_view coding) const
+        {
+            std::string_view accept = this->header("Accept-Encoding");
+            bool wildcard = false;
+
+            while (not accept.empty()) {
+                size_t end = accept.find(',');
+                std::string_view item = accept.substr(0, end);
+                accept = end == std::string_view::npos ? std::string_view() : accept.substr(end + 1);
+
+                size_t semi = item.find(';');
+                std::string_view name = trim(item.substr(0, semi));
+                bool refused = false;
+                if (semi != std::string_view::npos) {
+                    std::string_view q = trim(item.substr(semi + 1));
+                    if (q.starts_with("q=") || q.starts_with("Q=")) {
+                        q.remove_prefix(2);
+                        refused = q.find_first_not_of("0.") == std::string_view::npos;
+                    }
+                }
+
+                if (iequals(name, coding)) return not refused;
+                if (name == "*") wildcard = not refused;
+            }
+            return wildcard;
+        }
+
         // delete copy constructors
         Request(Request& req) = delete;
         Request(const Request& req) = delete;
@@ -17,15 +17,24 @@
 
 #pragma once
 
+#include <sys/uio.h>      // iovec
+#include <charconv>         // to_chars
+#include <array>
+#include <optional>
+#include <random>           // multipart boundaries
+
 #include "libs.h"
 #include "request.h"
+#include "output.h"
 
 namespace hussar {
     std::unordered_map<std::string, std::string> statuses = {
+        { "101", "SWITCHING PROTOCOLS" },
         { "200", "OK" },
         { "201", "CREATED" },
         { "202", "ACCEPTED" },
         { "204", "NO CONTENT" },
+        { "206", "PARTIAL CONTENT" },
         { "300", "MULTIPLE CHOICES" },
         { "301", "MOVED PERMANENTLY" },
         { "302", "FOUND" },
@@ -46,19 +55,255 @@ namespace hussar {
         { "413", "PAYLOAD TOO LARGE" },
         { "414", "URI TOO LONG" },
         { "415", "UNSUPPORTED MEDIA TYPE" },
+        { "416", "RANGE NOT SATISFIABLE" },
+        { "417", "EXPECTATION FAILED" },
         { "418", "I AM A TEAPOT" },
         { "426", "UPGRADE REQUIRED" },
         { "429", "TOO MANY REQUESTS" },
+        { "431", "REQUEST HEADER FIELDS TOO LARGE" },
         { "451", "UNAVAILABLE FOR LEGAL REASONS" },
         { "500", "INTERNAL SERVER ERROR" },
         { "501", "NOT IMPLEMENTED" },
         { "502", "BAD GATEWAY" },
         { "503", "SERVICE UNAVAILABLE" },
+        { "504", "GATEWAY TIMEOUT" },
+    };
+
+    /**
+     * returns the value of a three digit status code, or -1 if it isn't one
+     */
+    int status_number(std::string_view code)
+    {
+        if (code.size() != 3) return -1;
+        int number = 0;
+        for (char c : code) {
+            if (c < '0' || c > '9') return -1;
+            number = number * 10 + (c - '0');
+        }
+        return number;
+    }
+
+    /**
+     * "HTTP/1.1 <code> <status>\r\n" for every code in statuses, indexed by the
+     * numeric code and built once. unknown codes are empty strings
+     */
+    const std::array<std::string, 1000>& status_lines()
+    {
+        static const std::array<std::string, 1000> lines = [] {
+            std::array<std::string, 1000> lines;
+            for (auto& [code, text] : statuses) {
+                lines[status_number(code)] = "HTTP/1.1 " + code + " " + text + "\r\n";
+            }
+            return lines;
+        }();
+        return lines;
+    }
+
+    /**
+     * an inclusive range of byte offsets
+     */
+    struct ByteRange {
+        off_t first;
+        off_t last;
+    };
+
+    /**
+     * parses a Range header for a representation of size bytes.
+     *
+     * returns nothing if the header is missing, malformed, not in bytes or asks
+     * for more than MAX_BYTE_RANGES ranges, in which case the whole
+     * representation should be sent. an empty list means none of the ranges
+     * can be satisfied.
+     */
+    std::optional<std::vector<ByteRange>> parse_byte_ranges(std::string_view header, off_t size)
+    {
+        if (not header.starts_with("bytes=")) return std::nullopt;
+        header.remove_prefix(6);
+
+        std::vector<ByteRange> ranges;
+        size_t specs = 0;
+        while (not header.empty()) {
+            size_t end = header.find(',');
+            std::string_view spec = trim(header.substr(0, end));
+            header = end == std::string_view::npos ? std::string_view() : header.substr(end + 1);
+            if (spec.empty()) continue;
+            if (++specs > MAX_BYTE_RANGES) return std::nullopt;
+
+            size_t dash = spec.find('-');
+            if (dash == std::string_view::npos) return std::nullopt;
+            std::string_view first_text = spec.substr(0, dash);
+            std::string_view last_text = spec.substr(dash + 1);
+
+            off_t first = 0, last = 0;
+            auto number = [](std::string_view text, off_t& value) {
+                auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+                return not text.empty() && error == std::errc() && end == text.data() + text.size();
+            };
+
+            if (first_text.empty()) {
+                // suffix range, the final last bytes
+                if (not number(last_text, last)) return std::nullopt;
+                if (last == 0 || size == 0) continue;
+                ranges.push_back({ size - std::min(last, size), size - 1 });
+                continue;
+            }
+
+            if (not number(first_text, first)) return std::nullopt;
+            if (last_text.empty()) {
+                last = size - 1;
+            } else if (not number(last_text, last) || last < first) {
+                return std::nullopt;
+            }
+
+            if (first >= size) continue;
+            ranges.push_back({ first, std::min(last, size - 1) });
+        }
+
+        if (specs == 0) return std::nullopt;
+        return ranges;
+    }
+
+    /**
+     * builds a strong ETag from a file's inode, size and modification time,
+     * coding tells encoded representations of the file apart
+     */
+    std::string file_etag(const struct stat& info, std::string_view coding)
+    {
+        char tag[80];
+        std::snprintf(tag, sizeof(tag), "\"%llx-%llx-%llx",
+            static_cast<unsigned long long>(info.st_ino),
+            static_cast<unsigned long long>(info.st_size),
+            static_cast<unsigned long long>(info.st_mtim.tv_sec) * 1'000'000'000ull + info.st_mtim.tv_nsec);
+
+        std::string etag = tag;
+        if (not coding.empty()) {
+            etag += '-';
+            etag += coding;
+        }
+        etag += '"';
+        return etag;
+    }
+
+    /**
+     * a file's modification time as a Last-Modified value
+     */
+    std::string file_last_modified(const struct stat& info)
+    {
+        char date[HTTP_DATE_LEN];
+        format_http_date(info.st_mtime, date);
+        return std::string(date, HTTP_DATE_LEN);
+    }
+
+    /**
+     * sends the body of a streamed response piece by piece.
+     *
+     * small writes are gathered into a buffer of up to STREAM_BUFFER bytes and
+     * larger ones go out as their own chunk without being copied. writes block
+     * while the client's socket is full, so a producer can't outrun the client
+     * and memory stays bounded.
+     */
+    class ResponseWriter {
+    public:
+        using sink = std::function<bool (iovec*, int)>;
+
+    private:
+        sink send;
+        bool chunked;
+        bool good;
+        std::string buffer;
+
+        bool send_chunk(std::string_view data)
+        {
+            if (not this->good) return false;
+            if (data.empty()) return true;
+
+            if (not this->chunked) {
+                iovec iov = { const_cast<char*>(data.data()), data.size() };
+                this->good = this->send(&iov, 1);
+                return this->good;
+            }
+
+            char size_line[24];
+            auto end = std::to_chars(size_line, size_line + sizeof(size_line) - 2, data.size(), 16).ptr;
+            *end++ = '\r';
+            *end++ = '\n';
+
+            iovec iov[3] = {
+                { size_line, static_cast<size_t>(end - size_line) },
+                { const_cast<char*>(data.data()), data.size() },
+                { const_cast<char*>("\r\n"), 2 },
+            };
+            this->good = this->send(iov, 3);
+            return this->good;
+        }
+
+    public:
+        ResponseWriter(sink send, bool chunked)
+            : send(std::move(send)), chunked(chunked), good(true)
+        {
+            this->buffer.reserve(STREAM_BUFFER);
+        }
+
+        // delete copy constructors
+        ResponseWriter(ResponseWriter& w) = delete;
+        ResponseWriter(const ResponseWriter& w) = delete;
+        ResponseWriter& operator=(ResponseWriter& w) = delete;
+        ResponseWriter& operator=(const ResponseWriter& w) = delete;
+
+        /**
+         * queues data for the client, returns false once the client is gone
+         */
+        bool write(std::string_view data)
+        {
+            if (this->buffer.size() + data.size() <= STREAM_BUFFER) {
+                this->buffer.append(data);
+                return this->good;
+            }
+
+            if (not this->flush()) return false;
+
+            if (data.size() >= STREAM_BUFFER) {
+                return this->send_chunk(data);
+            }
+            this->buffer.append(data);
+            return this->good;
+        }
+
+        /**
+         * sends whatever has been buffered
+         */
+        bool flush()
+        {
+            bool sent = this->send_chunk(this->buffer);
+            this->buffer.clear();
+            return sent;
+        }
+
+        /**
+         * flushes and ends the body
+         */
+        bool finish()
+        {
+            if (not this->flush()) return false;
+            if (this->chunked) {
+                iovec iov = { const_cast<char*>("0\r\n\r\n"), 5 };
+                this->good = this->send(&iov, 1);
+            }
+            return this->good;
+        }
+
+        bool is_good() const
+        {
+            return this->good;
+        }
     };
 
+    using stream_handler = std::function<void (ResponseWriter&)>;
+
     class Response {
     private:
         Request& request;
+        size_t session_cookies; // cookies set while creating the response
 
     public:
         std::unordered_map<std::string, std::string> headers;
@@ -67,21 +312,28 @@ namespace hussar {
         std::string code;
         std::string status;
         std::string body; 
+        std::shared_ptr<const std::string> prebuilt; // serialized entity sent instead of headers and body
+        stream_handler streamer;                     // produces the body after the headers are sent
+        std::optional<uint64_t> stream_length;       // length of the streamed body, when it's known up front
+        std::shared_ptr<const FileBody> file;        // sent as the body instead of resp.body
+        std::shared_ptr<const std::string> shared_body; // sent as the body instead of resp.body
+        std::string_view static_body;                // body with static storage, sent instead of resp.body
+        bool open_ended;                             // the body follows the response separately, until the connection closes
+
+        /**
+         * a piece of a body made of several parts, text or a range of a file
+         */
+        struct BodyPart {
+            std::string data;
+            std::shared_ptr<const FileBody> file;
+            off_t offset = 0;
+            size_t length = 0;
+        };
+        std::vector<BodyPart> parts; // sent as the body instead of resp.body when not empty
 
         Response(Request& req)
-            : request(req), proto("HTTP/1.1"), code("200"), status("OK")
-        {
-            // get local time
-            auto now = std::chrono::system_clock::now();
-            auto time = std::chrono::system_clock::to_time_t(now);
-            auto local_time = *std::localtime(&time);
-            
-            // format date for http output
-            std::ostringstream date_stream;
-            date_stream << std::put_time(&local_time, "%a, %d %b %Y %H:%M:%S");
-            std::string date = date_stream.str();
-
-            this->headers["Date"] = date;
+            : request(req), session_cookies(0), proto("HTTP/1.1"), code("200"), status("OK"), open_ended(false)
+        {
             this->headers["Server"] = SERVER_NAME;
             this->headers["Connection"] = req.keep_alive ? "keep-alive" : "close";
             this->headers["Content-Type"] = "text/html";
@@ -107,6 +359,7 @@ namespace hussar {
                 c.value = req.session_id;
                 c.http_only = true;
             }
+            this->session_cookies = this->cookies.size();
         }
 
         // delete copy constructors
@@ -115,51 +368,414 @@ namespace hussar {
         Response& operator=(Response& resp) = delete;
         Response& operator=(const Response& resp) = delete;
 
-        // transform field data into an HTTP response
-        std::string serialize()
+        /**
+         * appends the status line and the headers that change per request
+         */
+        void serialize_head(std::string& head)
         {
-            std::ostringstream response_stream;
+            const auto& lines = status_lines();
+            int number = status_number(this->code);
 
             // code status texts
-            if (statuses.find(this->code) != statuses.end()) {
-                response_stream << this->proto << " " << this->code << " " << statuses[this->code] << "\n";
+            if (number >= 0 && lines[number].size()) {
+                if (this->proto == "HTTP/1.1") {
+                    head += lines[number];
+                } else {
+                    head += this->proto;
+                    head += std::string_view(lines[number]).substr(8);
+                }
             } else if (this->status != "") {
-                response_stream << this->proto << " " << this->code << " " << this->status << "\n";
+                head += this->proto + " " + this->code + " " + this->status + "\r\n";
             } else { // code not implemented and custom status is empty
                 this->code = "500";
-                response_stream << this->proto << " " << this->code << " " << statuses[this->code] << "\n";
+                head += this->proto + " " + this->code + " " + statuses[this->code] + "\r\n";
                 this->headers["Content-Type"] = "text/html";
                 this->body = "<h1>500: " + statuses[this->code] + "</h1>";
+                this->prebuilt.reset();
+                this->shared_body.reset();
+                this->static_body = {};
+                this->file.reset();
+                this->parts.clear();
+                this->streamer = nullptr;
+                this->stream_length.reset();
+                this->open_ended = false;
+            }
+
+            head += "Date: ";
+            head += http_date();
+            head += "\r\nConnection: ";
+            head += this->headers["Connection"];
+            head += "\r\n";
+
+            // set cookie headers
+            for (Cookie& cookie : this->cookies) {
+                if (cookie.is_valid()) {
+                    head += "Set-Cookie: ";
+                    head += cookie.serialize();
+                    head += "\r\n";
+                }
             }
+        }
 
+        /**
+         * appends the headers describing the body and the blank line ending the headers
+         */
+        void serialize_entity(std::string& head, bool with_body)
+        {
             // stored headers
             for (auto& [key, data] : this->headers) {
-                if (key != "") {
-                    response_stream << key << ": " << data << "\n";
+                if (key != "" && key != "Date" && key != "Connection") {
+                    head += key;
+                    head += ": ";
+                    head += data;
+                    head += "\r\n";
                 }
             }
 
-            // set cookie headers
-            for (Cookie& cookie : this->cookies) {
-                if (cookie.is_valid()) {
-                    response_stream << "Set-Cookie: " << cookie.serialize() << "\n";
+            if (this->streaming()) {
+                if (this->stream_length) {
+                    char length[24];
+                    auto end = std::to_chars(length, length + sizeof(length), *this->stream_length).ptr;
+                    head += "Content-Length: ";
+                    head.append(length, end);
+                    head += "\r\n\r\n";
+                    return;
                 }
+                head += this->chunked_stream() ? "Transfer-Encoding: chunked\r\n\r\n" : "\r\n";
+                return;
+            }
+
+            // a body sent after the response has no length, it ends with the connection
+            if (this->open_ended) {
+                head += "\r\n";
+                return;
+            }
+
+            // a 101 has no body, and a 304's length would be taken for the stored one's
+            if (this->code == "101" || this->code == "304") {
+                head += "\r\n";
+                return;
             }
 
             // content length header
-            if (this->request.method != "HEAD") {
-                response_stream << "Content-Length: " << body.size() << "\n";
+            char length[24];
+            auto end = std::to_chars(length, length + sizeof(length), with_body ? this->body_size() : 0).ptr;
+            head += "Content-Length: ";
+            head.append(length, end);
+            head += "\r\n\r\n";
+        }
+
+        /**
+         * returns the serialized entity of this response for reuse as another
+         * response's prebuilt bytes
+         */
+        std::shared_ptr<const std::string> snapshot()
+        {
+            std::string entity;
+            entity.reserve(this->estimate_head() + this->body_size());
+            this->serialize_entity(entity, true);
+            entity += this->body_view();
+            return std::make_shared<const std::string>(std::move(entity));
+        }
+
+        /**
+         * sends the file at path as the body straight from disk, returns false
+         * if it isn't a regular file that can be opened
+         */
+        bool send_file(const std::filesystem::path& path)
+        {
+            return this->send_file(FileBody::open(path));
+        }
+
+        /**
+         * sends an opened file as the body, returns false if body is null
+         */
+        bool send_file(std::shared_ptr<const FileBody> body)
+        {
+            if (not body) return false;
+            this->file = std::move(body);
+            this->shared_body.reset();
+            this->static_body = {};
+            this->body.clear();
+            this->headers["Accept-Ranges"] = "bytes";
+            return true;
+        }
+
+        /**
+         * sets a strong ETag from the file's inode, size and modification
+         * time, and Last-Modified. set Content-Encoding first, the tag differs
+         * per encoding
+         */
+        void set_validators(const struct stat& info)
+        {
+            auto coding = this->headers.find("Content-Encoding");
+            this->headers["ETag"] = file_etag(info, coding != this->headers.end() ? coding->second : "");
+            this->headers["Last-Modified"] = file_last_modified(info);
+        }
+
+        /**
+         * checks If-None-Match, or else If-Modified-Since, against the ETag and
+         * Last-Modified headers of a GET or HEAD response. if the client's copy
+         * is current the response becomes an empty 304 and true is returned
+         */
+        bool not_modified()
+        {
+            if (this->request.method_id != Method::GET && this->request.method_id != Method::HEAD) return false;
+            if (this->code != "200") return false;
+
+            bool current = false;
+            std::string_view if_none_match = this->request.header("If-None-Match");
+            if (not if_none_match.empty()) {
+                auto etag = this->headers.find("ETag");
+                current = etag != this->headers.end() && etag_matches(if_none_match, etag->second, true);
             } else {
-                response_stream << "Content-Length: 0\n";
+                std::string_view if_modified_since = this->request.header("If-Modified-Since");
+                auto modified = this->headers.find("Last-Modified");
+                if (not if_modified_since.empty() && modified != this->headers.end()) {
+                    auto since = parse_http_date(if_modified_since);
+                    auto last = parse_http_date(modified->second);
+                    current = since && last && *last <= *since;
+                }
+            }
+
+            if (current) {
+                this->code = "304";
+                this->body.clear();
+                this->file.reset();
+                this->shared_body.reset();
+                this->static_body = {};
+                this->parts.clear();
             }
+            return current;
+        }
+
+        /**
+         * answers the request's Range header from the file body.
+         *
+         * a single range is sent with 206 and Content-Range, several as a
+         * multipart/byteranges body, and 416 if none of them can be satisfied.
+         * the ranges are sent straight from the file. does nothing unless this
+         * is a 200 response with a file body and a usable Range header.
+         */
+        void send_ranges()
+        {
+            if (not this->file || this->code != "200") return;
+            if (this->request.method_id != Method::GET) return;
 
-            response_stream << "\n";
+            std::string_view range = this->request.header("Range");
+            if (range.empty()) return;
 
-            if (this->request.method != "HEAD") {
-                response_stream << this->body;
+            // If-Range only lets the range through while the validator still matches
+            std::string_view if_range = this->request.header("If-Range");
+            if (not if_range.empty()) {
+                if (if_range.starts_with('"') || if_range.starts_with("W/")) {
+                    auto etag = this->headers.find("ETag");
+                    if (etag == this->headers.end() || not etag_matches(if_range, etag->second, false)) return;
+                } else {
+                    auto modified = this->headers.find("Last-Modified");
+                    if (modified == this->headers.end() || modified->second != if_range) return;
+                }
             }
 
-            return response_stream.str();
+            off_t size = this->file->length;
+            auto ranges = parse_byte_ranges(range, size);
+            if (not ranges) return;
+
+            std::string total = std::to_string(size);
+            if (ranges->empty()) {
+                this->code = "416";
+                this->headers["Content-Range"] = "bytes */" + total;
+                this->headers["Content-Type"] = "text/html";
+                this->file.reset();
+                this->body = "<h1>416: Range Not Satisfiable</h1>";
+                return;
+            }
+
+            auto content_range = [&total](const ByteRange& r) {
+                return "bytes " + std::to_string(r.first) + "-" + std::to_string(r.last) + "/" + total;
+            };
+
+            this->code = "206";
+            this->parts.clear();
+            if (ranges->size() == 1) {
+                const ByteRange& r = ranges->front();
+                this->headers["Content-Range"] = content_range(r);
+                this->parts.push_back({ "", this->file, this->file->offset + r.first, static_cast<size_t>(r.last - r.first + 1) });
+                return;
+            }
+
+            thread_local std::mt19937_64 random{std::random_device{}()};
+            char boundary[17];
+            std::snprintf(boundary, sizeof(boundary), "%016llx", static_cast<unsigned long long>(random()));
+
+            std::string type = this->headers["Content-Type"];
+            this->headers["Content-Type"] = std::string("multipart/byteranges; boundary=") + boundary;
+
+            std::string delimiter;
+            for (const ByteRange& r : *ranges) {
+                delimiter += "--";
+                delimiter += boundary;
+                delimiter += "\r\nContent-Type: " + type;
+                delimiter += "\r\nContent-Range: " + content_range(r) + "\r\n\r\n";
+                this->parts.push_back({ std::move(delimiter), nullptr, 0, 0 });
+                this->parts.push_back({ "", this->file, this->file->offset + r.first, static_cast<size_t>(r.last - r.first + 1) });
+                delimiter = "\r\n";
+            }
+            this->parts.push_back({ delimiter + "--" + boundary + "--\r\n", nullptr, 0, 0 });
+        }
+
+        /**
+         * sends a shared buffer as the body without copying it
+         */
+        void send_shared(std::shared_ptr<const std::string> data)
+        {
+            this->shared_body = std::move(data);
+            this->static_body = {};
+            this->file.reset();
+            this->body.clear();
+        }
+
+        /**
+         * sends data that outlives every response, such as embedded assets,
+         * as the body without copying it
+         */
+        void send_static(std::string_view data)
+        {
+            this->static_body = data.data() ? data : std::string_view("", 0);
+            this->shared_body.reset();
+            this->file.reset();
+            this->body.clear();
+        }
+
+        /**
+         * streams the body from producer instead of sending resp.body.
+         *
+         * the body goes out with chunked transfer encoding, or to HTTP/1.0
+         * clients as is with the connection closed at the end.
+         */
+        void stream(stream_handler producer)
+        {
+            this->streamer = std::move(producer);
+            this->stream_length.reset();
+            if (not this->chunked()) {
+                this->headers["Connection"] = "close";
+                this->request.keep_alive = false;
+            }
+        }
+
+        /**
+         * streams a body of a known length from producer, it goes out as is
+         * with a Content-Length instead of chunked. the producer has to write
+         * exactly length bytes, or throw to cut the response short
+         */
+        void stream(stream_handler producer, uint64_t length)
+        {
+            this->streamer = std::move(producer);
+            this->stream_length = length;
+        }
+
+        bool streaming() const
+        {
+            return static_cast<bool>(this->streamer);
+        }
+
+        /**
+         * returns true if the client understands chunked transfer encoding
+         */
+        bool chunked() const
+        {
+            return this->request.version != "HTTP/1.0" && this->request.version != "HTTP/0.9";
+        }
+
+        /**
+         * returns true if the streamed body is sent with chunked transfer encoding
+         */
+        bool chunked_stream() const
+        {
+            return this->chunked() && not this->stream_length;
+        }
+
+        /**
+         * length of the body that will be sent
+         */
+        size_t body_size() const
+        {
+            if (not this->parts.empty()) {
+                size_t size = 0;
+                for (const BodyPart& part : this->parts) {
+                    size += part.file ? part.length : part.data.size();
+                }
+                return size;
+            }
+            return this->file ? this->file->length : this->body_view().size();
+        }
+
+        /**
+         * the in memory body, resp.body unless a shared body was set
+         */
+        std::string_view body_view() const
+        {
+            if (this->shared_body) return *this->shared_body;
+            if (this->static_body.data()) return this->static_body;
+            return this->body;
+        }
+
+        /**
+         * returns true if the handler set cookies of its own
+         */
+        bool sets_cookies() const
+        {
+            return this->cookies.size() > this->session_cookies;
+        }
+
+        /**
+         * upper bound guess of the serialized header size, used to size the buffer once
+         */
+        size_t estimate_head() const
+        {
+            size_t size = 128 + HTTP_DATE_LEN + this->proto.size() + this->status.size();
+            for (auto& [key, data] : this->headers) {
+                size += key.size() + data.size() + 4;
+            }
+            size += this->cookies.size() * 128;
+            return size;
+        }
+
+        /**
+         * serializes the status line and headers into head and returns the
+         * buffers making up the response, ready for writev. head must outlive them
+         */
+        std::array<iovec, 2> serialize(std::string& head)
+        {
+            head.clear();
+            head.reserve(this->estimate_head());
+
+            this->serialize_head(head);
+
+            // cached responses are sent straight from their shared bytes
+            if (this->prebuilt) {
+                return {{
+                    { head.data(), head.size() },
+                    { const_cast<char*>(this->prebuilt->data()), this->prebuilt->size() },
+                }};
+            }
+
+            bool with_body = this->request.method_id != Method::HEAD && not this->streaming();
+            this->serialize_entity(head, with_body);
+
+            return {{
+                { head.data(), head.size() },
+                { const_cast<char*>(this->body_view().data()), with_body ? this->body_view().size() : 0 },
+            }};
+        }
+
+        // transform field data into an HTTP response
+        std::string serialize()
+        {
+            std::string response;
+            auto iov = this->serialize(response);
+            response.append(static_cast<const char*>(iov[1].iov_base), iov[1].iov_len);
+            return response;
         }
     };
 };
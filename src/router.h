@@ -18,9 +18,16 @@
 #pragma once
 
 #include "hussar.h"
+#include "task.h"
+#include "cache.h"
+#include "websocket.h"
+#include "events.h"
+#include "proxy.h"
+#include "balancer.h"
 
 namespace hussar {
     using handler = std::function<void (Request&, Response&)>;
+    using async_handler = std::function<task<void> (Request&, Response&)>;
     void not_implemented(Request& req, Response& resp)
     {
         resp.code = "501";
@@ -28,18 +35,292 @@ namespace hussar {
         resp.body = "<h1>501: Not Implemented!</h1>";
     }
 
+    // runs before the route, returning false stops the request before the handler
+    using before_handler = std::function<bool (Request&, Response&)>;
+
+    /**
+     * a before and/or after step wrapped around route handlers
+     */
+    struct Middleware {
+        before_handler before;
+        handler after;
+
+        Middleware(before_handler before, handler after = nullptr)
+            : before(std::move(before)), after(std::move(after))
+        {}
+
+        template <typename B>
+            requires std::is_constructible_v<before_handler, B>
+        Middleware(B before)
+            : before(std::move(before)), after(nullptr)
+        {}
+    };
+
+    /**
+     * a route handler, either a plain function or a coroutine returning task<void>
+     */
+    struct Endpoint {
+        handler func;
+        async_handler async_func;
+
+        Endpoint(std::nullptr_t)
+        {}
+
+        template <typename F>
+            requires std::is_invocable_r_v<task<void>, F, Request&, Response&>
+        Endpoint(F func)
+            : async_func(std::move(func))
+        {}
+
+        template <typename F>
+            requires (std::is_invocable_v<F, Request&, Response&> && not std::is_invocable_r_v<task<void>, F, Request&, Response&>)
+        Endpoint(F func)
+            : func(std::move(func))
+        {}
+    };
+
+    /**
+     * per route registration options
+     */
+    struct RouteOptions {
+        std::vector<Middleware> middleware;
+        CacheOptions cache;
+        UploadSink upload;  // writes uploaded files straight to disk as they arrive
+        bool stream_body = false; // the handler pulls the body through req.read_body() instead of it being read first
+    };
+
+    /**
+     * a registered handler with its middleware flattened into one sequence.
+     *
+     * befores run in order until one returns false, then the handler if they
+     * all passed, then the afters of every middleware whose before ran, in reverse.
+     */
+    struct Route {
+        handler func;
+        async_handler async_func;
+        std::vector<Middleware> own;   // route specific middleware
+        std::vector<Middleware> chain; // global middleware followed by own
+        std::shared_ptr<ResponseCache> cache;
+        UploadSink upload;
+        bool stream_body = false;
+        std::shared_ptr<const WebSocketHandler> websocket; // the connection is upgraded once a 101 is sent
+        std::shared_ptr<const EventStreamHandler> events;  // the connection streams events once answered
+
+        bool is_async() const
+        {
+            return static_cast<bool>(this->async_func);
+        }
+
+        // runs the befores, ran is set to how many of them were called
+        bool run_before(Request& req, Response& resp, size_t& ran) const
+        {
+            for (ran = 0; ran < this->chain.size();) {
+                const before_handler& before = this->chain[ran++].before;
+                if (before && not before(req, resp)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // serves a GET request from the route's cache, generating is set if the caller has to store the response
+        bool cached(Request& req, Response& resp, std::string& key, bool& generating) const
+        {
+            generating = false;
+            if (not this->cache || req.method_id != Method::GET) return false;
+
+            key = this->cache->key(req);
+            return this->cache->lookup(key, resp, generating);
+        }
+
+        // runs the afters of the first ran middleware in reverse
+        void run_after(size_t ran, Request& req, Response& resp) const
+        {
+            while (ran--) {
+                const handler& after = this->chain[ran].after;
+                if (after) after(req, resp);
+            }
+        }
+
+        // runs the route on the calling thread, coroutine handlers are waited on
+        void operator()(Request& req, Response& resp) const
+        {
+            size_t ran;
+            std::string key;
+            bool generating = false;
+            // a handler that throws must not leave other requests waiting on its cache entry
+            try {
+                if (this->run_before(req, resp, ran) && not this->cached(req, resp, key, generating)) {
+                    if (this->func) {
+                        this->func(req, resp);
+                    } else if (this->async_func) {
+                        sync_wait(this->async_func(req, resp));
+                    } else {
+                        not_implemented(req, resp);
+                    }
+                }
+                this->run_after(ran, req, resp);
+            } catch (...) {
+                if (generating) this->cache->abandon(key);
+                throw;
+            }
+            if (generating) this->cache->store(key, resp);
+        }
+
+        // runs the route as a coroutine
+        task<void> run_async(Request& req, Response& resp) const
+        {
+            size_t ran;
+            std::string key;
+            bool generating = false;
+            // a handler that throws must not leave other requests waiting on its cache entry
+            try {
+                if (this->run_before(req, resp, ran) && not this->cached(req, resp, key, generating)) {
+                    if (this->async_func) {
+                        co_await this->async_func(req, resp);
+                    } else if (this->func) {
+                        this->func(req, resp);
+                    } else {
+                        not_implemented(req, resp);
+                    }
+                }
+                this->run_after(ran, req, resp);
+            } catch (...) {
+                if (generating) this->cache->abandon(key);
+                throw;
+            }
+            if (generating) this->cache->store(key, resp);
+        }
+    };
+
+    /**
+     * routes requests to handlers by method and path.
+     *
+     * routes may contain ":name" segments and a trailing "*name" wildcard,
+     * the captured values are available to handlers through req.params.
+     * calling freeze() once every route is registered makes the router
+     * immutable and moves static routes into a single hash lookup.
+     *
+     * handlers are plain functions or coroutines returning task<void>, which
+     * suspend to the io loop instead of holding a pool thread while they wait.
+     *
+     * middleware registered with use() wraps every route and the fallback,
+     * middleware in RouteOptions wraps only its route. the chains are
+     * flattened when routes or middleware are registered, not per request.
+     *
+     * RouteOptions::cache caches a route's GET responses, a hit runs the
+     * middleware but replaces the handler with the cached bytes.
+     *
+     * RouteOptions::upload writes the route's uploaded files to disk while
+     * they are read, see UploadSink.
+     *
+     * websocket() registers a GET route that upgrades to a WebSocket, the
+     * middleware runs on the handshake and the connection then belongs to the
+     * io loop, see WebSocket. events() does the same for server-sent event
+     * streams, see EventStream.
+     *
+     * RouteOptions::stream_body leaves the body unread until the handler
+     * pulls it through req.read_body(). proxy() forwards a route to an
+     * upstream server this way for every method, see Upstream, or spreads it
+     * over several, see UpstreamGroup.
+     */
     class Router {
     protected:
-        handler FALLBACK;
-        std::unordered_map<std::string, handler> GET;
-        std::unordered_map<std::string, handler> HEAD;
-        std::unordered_map<std::string, handler> POST;
-        std::unordered_map<std::string, std::unordered_map<std::string, handler>> ALT;
+        Route FALLBACK;
+        std::vector<Middleware> MIDDLEWARE;                    // global middleware
+        std::array<RadixTree<Route>, METHOD_COUNT> ROUTES;     // indexed by Method
+        std::unordered_map<std::string, RadixTree<Route>> ALT; // non-standard methods
+
+        // static routes and whether a tree walk is still needed, filled by freeze()
+        std::array<std::unordered_map<std::string, const Route*>, METHOD_COUNT> FROZEN;
+        std::array<bool, METHOD_COUNT> DYNAMIC;
+        bool frozen;
+
+        // build a route's call sequence from the global and its own middleware
+        void compose(Route& r)
+        {
+            r.chain.clear();
+            r.chain.reserve(this->MIDDLEWARE.size() + r.own.size());
+            r.chain.insert(r.chain.end(), this->MIDDLEWARE.begin(), this->MIDDLEWARE.end());
+            r.chain.insert(r.chain.end(), r.own.begin(), r.own.end());
+        }
+
+        // register a route for the method, r may come with the parts of a special route type
+        void add_route(Method method_id, const std::string& method, const std::string& route, Endpoint& endpoint, RouteOptions& options, Route r = {})
+        {
+            if (this->frozen) {
+                fatal_error("ERROR route registered after freeze(): " + method + " " + route);
+            }
+
+            r.func = std::move(endpoint.func);
+            r.async_func = std::move(endpoint.async_func);
+            r.own = std::move(options.middleware);
+            r.upload = std::move(options.upload);
+            r.stream_body = options.stream_body;
+            if (r.stream_body && (r.async_func || r.websocket || r.events)) {
+                fatal_error("ERROR stream_body needs a plain handler: " + method + " " + route);
+            }
+            if (options.cache.ttl.count() > 0) {
+                r.cache = std::make_shared<ResponseCache>(std::move(options.cache));
+            }
+            this->compose(r);
+
+            if (method_id == Method::OTHER) {
+                this->ALT[method].insert(route, std::move(r));
+            } else {
+                this->ROUTES[static_cast<size_t>(method_id)].insert(route, std::move(r));
+            }
+        }
+
+        // find the route for a standard method
+        const Route* find_route(Method method_id, Request& req)
+        {
+            size_t n = static_cast<size_t>(method_id);
+            if (this->frozen) {
+                auto found = this->FROZEN[n].find(req.document);
+                if (found != this->FROZEN[n].end()) {
+                    return found->second;
+                }
+                if (not this->DYNAMIC[n]) {
+                    return nullptr;
+                }
+            }
+            return this->ROUTES[n].find(req.document, req.params);
+        }
+
+        // call the route if it was found, else the fallback
+        void dispatch(const Route* r, Request& req, Response& resp)
+        {
+            if (r) {
+                (*r)(req, resp);
+            } else {
+                this->FALLBACK(req, resp);
+            }
+        }
+
+        // registers a proxying handler for every method it forwards
+        void add_proxy(const std::string& route, std::function<void (Request&, Response&)> handler, RouteOptions& options)
+        {
+            static const std::pair<Method, std::string> methods[] = {
+                { Method::GET, "GET" }, { Method::HEAD, "HEAD" }, { Method::POST, "POST" }, { Method::PUT, "PUT" },
+                { Method::DELETE, "DELETE" }, { Method::OPTIONS, "OPTIONS" }, { Method::PATCH, "PATCH" },
+            };
+
+            options.stream_body = true;
+            for (auto& [method_id, method] : methods) {
+                RouteOptions copy = options;
+                Endpoint endpoint(handler);
+                this->add_route(method_id, method, route, endpoint, copy);
+            }
+        }
 
     public:
         Router()
-            : FALLBACK(&not_implemented)
-        {}
+            : frozen(false)
+        {
+            this->FALLBACK.func = &not_implemented;
+            this->DYNAMIC.fill(true);
+        }
 
         // delete copy constructors
         Router(Router& r) = delete;
@@ -47,109 +328,189 @@ namespace hussar {
         Router& operator=(Router& r) = delete;
         Router& operator=(const Router& r) = delete;
 
-        void route(Request& req, Response& resp)
+        /**
+         * returns the route for the request, falling back to the fallback route.
+         * bad requests are answered here and return nullptr
+         */
+        const Route* resolve(Request& req, Response& resp)
         {
-            if (req.is_good) {
-                if (req.method == "GET") {
-                    this->get(req, resp);
-                } else if (req.method == "HEAD") {
-                    this->head(req, resp);
-                } else if (req.method == "POST") {
-                    this->post(req, resp);
-                } else {
-                    this->alt(req.method, req, resp);
-                }
-            } else {
+            if (not req.is_good) {
                 resp.headers["Content-Type"] = "text/html";
                 resp.code = "400";
                 resp.body = "<h1>400: Bad Request</h1>";
+                return nullptr;
             }
+
+            const Route* r;
+            if (req.method_id != Method::OTHER) {
+                r = this->find_route(req.method_id, req);
+            } else {
+                auto tree = this->ALT.find(req.method);
+                r = tree != this->ALT.end() ? tree->second.find(req.document, req.params) : nullptr;
+            }
+            return r ? r : &this->FALLBACK;
+        }
+
+        void route(Request& req, Response& resp)
+        {
+            const Route* r = this->resolve(req, resp);
+            if (r) (*r)(req, resp);
+        }
+
+        /**
+         * registers global middleware around every route and the fallback,
+         * routes registered earlier are recomposed
+         */
+        void use(before_handler before, handler after = nullptr)
+        {
+            if (this->frozen) {
+                fatal_error("ERROR middleware registered after freeze()");
+            }
+
+            this->MIDDLEWARE.emplace_back(std::move(before), std::move(after));
+
+            auto recompose = [this](Route& r) { this->compose(r); };
+            for (auto& tree : this->ROUTES) {
+                tree.for_each(recompose);
+            }
+            for (auto& [method, tree] : this->ALT) {
+                tree.for_each(recompose);
+            }
+            this->compose(this->FALLBACK);
+        }
+
+        /**
+         * stops route registration and builds the static route tables,
+         * routes can't be added after this
+         */
+        void freeze()
+        {
+            if (this->frozen) return;
+
+            for (size_t n = 0; n < METHOD_COUNT; ++n) {
+                auto& table = this->FROZEN[n];
+                this->ROUTES[n].for_each_static([&table](const std::string& path, const Route& r) {
+                    table.emplace(path, &r);
+                });
+                this->DYNAMIC[n] = this->ROUTES[n].size() != table.size();
+            }
+            this->frozen = true;
         }
 
         // register get route
-        void get(const std::string& route, handler func)
+        void get(const std::string& route, Endpoint endpoint, RouteOptions options = {})
         {
-            this->GET[route] = func;
+            this->add_route(Method::GET, "GET", route, endpoint, options);
         }
 
         // call get route
         void get(Request& req, Response& resp)
         {
-            if (this->GET.find(req.document) != this->GET.end()) {
-                this->GET[req.document](req, resp);
-            } else if (this->FALLBACK) {
-                this->FALLBACK(req, resp);
-            } else {
-                not_implemented(req, resp);
-            }
+            this->dispatch(this->find_route(Method::GET, req), req, resp);
         }
 
         // register head route
-        void head(const std::string& route, handler func)
+        void head(const std::string& route, Endpoint endpoint, RouteOptions options = {})
         {
-            this->HEAD[route] = func;
+            this->add_route(Method::HEAD, "HEAD", route, endpoint, options);
         }
 
         // call head route
         void head(Request& req, Response& resp)
         {
-            if (this->HEAD.contains(req.document)) {
-                this->HEAD[req.document](req, resp);
-            } else if (this->FALLBACK) {
-                this->FALLBACK(req, resp);
-            } else {
-                not_implemented(req, resp);
-            }
+            this->dispatch(this->find_route(Method::HEAD, req), req, resp);
         }
 
         // register post route
-        void post(const std::string& route, handler func)
+        void post(const std::string& route, Endpoint endpoint, RouteOptions options = {})
         {
-            this->POST[route] = func;
+            this->add_route(Method::POST, "POST", route, endpoint, options);
         }
 
         // call post route
         void post(Request& req, Response& resp)
         {
-            if (this->POST.contains(req.document)) {
-                this->POST[req.document](req, resp);
-            } else if (this->FALLBACK) {
-                this->FALLBACK(req, resp);
-            } else {
-                not_implemented(req, resp);
+            this->dispatch(this->find_route(Method::POST, req), req, resp);
+        }
+
+        // register websocket route
+        void websocket(const std::string& route, WebSocketHandler handler, RouteOptions options = {})
+        {
+            if (options.cache.ttl.count() > 0) {
+                fatal_error("ERROR websocket routes can't be cached: " + route);
+            }
+
+            Route r;
+            r.websocket = std::make_shared<const WebSocketHandler>(std::move(handler));
+            Endpoint endpoint(&websocket_handshake);
+            this->add_route(Method::GET, "GET", route, endpoint, options, std::move(r));
+        }
+
+        // register server-sent event stream route
+        void events(const std::string& route, EventStreamHandler handler, RouteOptions options = {})
+        {
+            if (options.cache.ttl.count() > 0) {
+                fatal_error("ERROR event stream routes can't be cached: " + route);
             }
+
+            Route r;
+            r.events = std::make_shared<const EventStreamHandler>(std::move(handler));
+            Endpoint endpoint(&event_stream_open);
+            this->add_route(Method::GET, "GET", route, endpoint, options, std::move(r));
+        }
+
+        // register a route forwarding every method but CONNECT and TRACE to upstream
+        void proxy(const std::string& route, Upstream& upstream, RouteOptions options = {})
+        {
+            this->add_proxy(route, hussar::proxy(upstream), options);
+        }
+
+        void proxy(const std::string& route, UpstreamGroup& group, RouteOptions options = {})
+        {
+            this->add_proxy(route, hussar::proxy(group), options);
         }
 
         // register alternate method route
-        void alt(const std::string& method, const std::string& route, handler func)
+        void alt(const std::string& method, const std::string& route, Endpoint endpoint, RouteOptions options = {})
         {
-            this->ALT[method][route] = func;
+            this->add_route(parse_method(method), method, route, endpoint, options);
         }
 
         // call alternate method route
         void alt(const std::string& method, Request& req, Response& resp)
         {
-            if (this->ALT.contains(method) && this->ALT[method].contains(req.document)) {
-                this->ALT[method][req.document](req, resp);
-            } else if (this->FALLBACK) {
-                this->FALLBACK(req, resp);
+            Method method_id = parse_method(method);
+            if (method_id != Method::OTHER) {
+                this->dispatch(this->find_route(method_id, req), req, resp);
+                return;
+            }
+
+            auto tree = this->ALT.find(method);
+            if (tree != this->ALT.end()) {
+                this->dispatch(tree->second.find(req.document, req.params), req, resp);
             } else {
-                not_implemented(req, resp);
+                this->dispatch(nullptr, req, resp);
             }
         }
 
         // register fallback route
-        void fallback(handler func)
+        void fallback(Endpoint endpoint, RouteOptions options = {})
         {
-            this->FALLBACK = func;
+            this->FALLBACK.func = std::move(endpoint.func);
+            this->FALLBACK.async_func = std::move(endpoint.async_func);
+            this->FALLBACK.own = std::move(options.middleware);
+            this->FALLBACK.upload = std::move(options.upload);
+            this->FALLBACK.stream_body = options.stream_body;
+            if (this->FALLBACK.stream_body && this->FALLBACK.async_func) {
+                fatal_error("ERROR stream_body needs a plain handler: fallback");
+            }
+            this->compose(this->FALLBACK);
         }
 
         // call fallback route
         void fallback(Request& req, Response& resp)
         {
-            if (this->FALLBACK) {
-                this->FALLBACK(req, resp);
-            }
+            this->FALLBACK(req, resp);
         }
     };
 };
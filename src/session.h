@@ -23,7 +23,7 @@
 
 namespace hussar {
     std::mutex openssl_rand_mtx;
-    std::unique_lock<std::mutex> openssl_rand_lock(openssl_rand_mtx);
+    std::mutex& openssl_rand_lock = openssl_rand_mtx;
 
     struct Session {
         std::string id;
@@ -110,7 +110,7 @@ namespace hussar {
 
     std::unordered_map<std::string, Session> sessions;
     std::mutex sessions_mtx;
-    std::unique_lock<std::mutex> sessions_lock(sessions_mtx);
+    std::mutex& sessions_lock = sessions_mtx;
 
     /**
      * Creates a session and returns its id
@@ -0,0 +1,273 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <mutex>
+
+namespace hussar {
+    template <typename T = void>
+    class task;
+
+    namespace detail {
+        struct task_promise_base {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+
+            // resumes whoever awaited the task once it finishes
+            struct final_awaiter {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                template <typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                    std::coroutine_handle<> continuation = h.promise().continuation;
+                    if (continuation) return continuation;
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            final_awaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void unhandled_exception()
+            {
+                this->exception = std::current_exception();
+            }
+        };
+
+        // fire and forget coroutine used to drive a task to completion
+        struct detached {
+            struct promise_type {
+                detached get_return_object() noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never initial_suspend() noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() noexcept
+                {
+                    return {};
+                }
+
+                void return_void() noexcept {}
+
+                void unhandled_exception() noexcept
+                {
+                    std::terminate();
+                }
+            };
+        };
+    };
+
+    /**
+     * lazily started coroutine returning T.
+     *
+     * the body runs when the task is awaited and the awaiting coroutine is
+     * resumed on whichever thread the task finishes on.
+     */
+    template <typename T>
+    class task {
+    public:
+        struct promise_type : detail::task_promise_base {
+            std::optional<T> value;
+
+            task get_return_object()
+            {
+                return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+
+            void return_value(T v)
+            {
+                this->value.emplace(std::move(v));
+            }
+        };
+
+    private:
+        std::coroutine_handle<promise_type> h;
+
+        explicit task(std::coroutine_handle<promise_type> h)
+            : h(h)
+        {}
+
+    public:
+        task(task&& t) noexcept
+            : h(std::exchange(t.h, nullptr))
+        {}
+
+        task& operator=(task&& t) noexcept
+        {
+            if (this != &t) {
+                if (this->h) this->h.destroy();
+                this->h = std::exchange(t.h, nullptr);
+            }
+            return *this;
+        }
+
+        // not copyable
+        task(task& t) = delete;
+        task(const task& t) = delete;
+        task& operator=(task& t) = delete;
+        task& operator=(const task& t) = delete;
+
+        ~task()
+        {
+            if (this->h) this->h.destroy();
+        }
+
+        bool await_ready() const noexcept
+        {
+            return not this->h || this->h.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            this->h.promise().continuation = awaiting;
+            return this->h;
+        }
+
+        T await_resume()
+        {
+            if (this->h.promise().exception) {
+                std::rethrow_exception(this->h.promise().exception);
+            }
+            return std::move(*this->h.promise().value);
+        }
+    };
+
+    template <>
+    class task<void> {
+    public:
+        struct promise_type : detail::task_promise_base {
+            task get_return_object()
+            {
+                return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+
+            void return_void() noexcept {}
+        };
+
+    private:
+        std::coroutine_handle<promise_type> h;
+
+        explicit task(std::coroutine_handle<promise_type> h)
+            : h(h)
+        {}
+
+    public:
+        task(task&& t) noexcept
+            : h(std::exchange(t.h, nullptr))
+        {}
+
+        task& operator=(task&& t) noexcept
+        {
+            if (this != &t) {
+                if (this->h) this->h.destroy();
+                this->h = std::exchange(t.h, nullptr);
+            }
+            return *this;
+        }
+
+        // not copyable
+        task(task& t) = delete;
+        task(const task& t) = delete;
+        task& operator=(task& t) = delete;
+        task& operator=(const task& t) = delete;
+
+        ~task()
+        {
+            if (this->h) this->h.destroy();
+        }
+
+        bool await_ready() const noexcept
+        {
+            return not this->h || this->h.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            this->h.promise().continuation = awaiting;
+            return this->h;
+        }
+
+        void await_resume()
+        {
+            if (this->h.promise().exception) {
+                std::rethrow_exception(this->h.promise().exception);
+            }
+        }
+    };
+
+    /**
+     * starts t on the calling thread, done(exception) is called on the thread
+     * that finishes it, with a null exception_ptr on success
+     */
+    detail::detached spawn(task<void> t, std::function<void (std::exception_ptr)> done)
+    {
+        std::exception_ptr error;
+        try {
+            co_await t;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done(error);
+    }
+
+    /**
+     * runs t and blocks the calling thread until it finishes
+     */
+    void sync_wait(task<void> t)
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::exception_ptr error;
+        bool finished = false;
+
+        spawn(std::move(t), [&](std::exception_ptr e) {
+            std::lock_guard<std::mutex> lock(mtx);
+            error = e;
+            finished = true;
+            cv.notify_one();
+        });
+
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&finished] { return finished; });
+        if (error) std::rethrow_exception(error);
+    }
+};
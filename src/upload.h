@@ -17,80 +17,316 @@
 
 #pragma once
 
+#include <sys/sendfile.h>   // copying spilled uploads
+#include <fcntl.h>          // O_TMPFILE, fallocate
+#include <unistd.h>
+#include <openssl/evp.h>    // sha256 of sunk uploads
+#include <filesystem>
+#include <memory>
 #include <string>
+#include <utility>
 #include "util.h"
 
 namespace hussar {
 
+    /**
+     * route option that writes uploaded files straight into an anonymous file
+     * in dir as they are read, instead of holding them in memory.
+     *
+     * nothing is named in dir until the handler calls keep() or save(), so a
+     * request stopped by middleware leaves nothing behind. with sha256 set the
+     * digest is computed as the bytes arrive, without it a raw body on a plain
+     * connection is spliced from the socket to the file without passing
+     * through user space
+     */
+    struct UploadSink {
+        std::filesystem::path dir;  // empty disables the sink
+        bool sha256 = true;
+    };
+
+    /**
+     * a part of a multipart/form-data body.
+     *
+     * small parts are held in data, parts growing past the spill size while
+     * they are read are moved into an anonymous temp file, so a large upload
+     * never sits in memory. the temp file disappears with the object unless
+     * save() or keep() links it into place
+     */
     struct UploadedFile {
         std::string id;
         std::string name;
         std::string mime;
-        std::string data;
+        std::string data;   // contents, unless they were spilled to fd
+        int fd = -1;        // temp file holding the contents of a large part
+        size_t size = 0;
+        std::string sha256; // hex digest, for files read through a hashing UploadSink
+        std::filesystem::path path; // where keep() linked the file
+        bool is_file = false;   // the part had a filename, so it came from a file input
         bool valid = false;
 
-        UploadedFile(const std::string& boundary, const std::string& body)
+        UploadedFile() {}
+
+        UploadedFile(const std::string& id, const std::string& name, const std::string& mime, const std::string& data)
+            : id(id), name(name), mime(mime), data(data), size(data.size()), is_file(true)
         {
-            if (boundary.size() == 0) return;
-            if (body.size() == 0) return;
+            valid = true;
+        }
 
-            size_t start = body.find(boundary);
-            if (start == std::string::npos) return;
-            start += boundary.size();
-            start += 2; // for the \r\n
+        // moveable
+        UploadedFile(UploadedFile&& file)
+            : id(std::move(file.id)), name(std::move(file.name)), mime(std::move(file.mime)), data(std::move(file.data)),
+            fd(std::exchange(file.fd, -1)), size(file.size), sha256(std::move(file.sha256)), path(std::move(file.path)),
+            is_file(file.is_file), valid(file.valid), temp_dir(std::move(file.temp_dir)), reserved(file.reserved),
+            hash(std::move(file.hash))
+        {}
 
-            size_t end = body.find(boundary, start);
+        UploadedFile& operator=(UploadedFile&& file)
+        {
+            if (this->fd >= 0) close(this->fd);
+            this->id = std::move(file.id);
+            this->name = std::move(file.name);
+            this->mime = std::move(file.mime);
+            this->data = std::move(file.data);
+            this->fd = std::exchange(file.fd, -1);
+            this->size = file.size;
+            this->sha256 = std::move(file.sha256);
+            this->path = std::move(file.path);
+            this->is_file = file.is_file;
+            this->valid = file.valid;
+            this->temp_dir = std::move(file.temp_dir);
+            this->reserved = file.reserved;
+            this->hash = std::move(file.hash);
+            return *this;
+        }
 
-            std::string file_component = body.substr(start, end - start - 4);
+        // not copyable
+        UploadedFile(UploadedFile& file) = delete;
+        UploadedFile(const UploadedFile& file) = delete;
+        UploadedFile& operator=(UploadedFile& file) = delete;
+        UploadedFile& operator=(const UploadedFile& file) = delete;
 
-            std::vector<std::string_view> file_components = split_string<std::string_view>(file_component, "\r\n");
+        ~UploadedFile()
+        {
+            if (this->fd >= 0) close(this->fd);
+        }
 
-            size_t n;
-            for (n = 0; n < file_components.size(); ++n) {
-                auto& line = file_components[n];
-                if (line == "") {
-                    ++n; // start of the file content
-                    break;
-                }
-                if (line.find("Content-Disposition: ") != std::string_view::npos) {
-                    std::string content_disposition = extract_header_content(line);
+        /**
+         * reads the Content-Disposition and Content-Type of the part's header block
+         */
+        void parse_headers(std::string_view headers)
+        {
+            while (not headers.empty()) {
+                size_t end = headers.find("\r\n");
+                std::string_view line = headers.substr(0, end);
+                headers = end == std::string_view::npos ? std::string_view() : headers.substr(end + 2);
+
+                if (line.size() > 20 && iequals(line.substr(0, 20), "Content-Disposition:")) {
+                    std::string content_disposition = strip_terminal_chars(std::string(trim(line.substr(20))));
                     parse_content_disposition(content_disposition);
-                } else if (line.find("Content-Type: ") != std::string_view::npos) {
-                    this->mime = extract_header_content(line);
+                } else if (line.size() > 13 && iequals(line.substr(0, 13), "Content-Type:")) {
+                    this->mime = strip_terminal_chars(std::string(trim(line.substr(13))));
                 }
             }
-            std::ostringstream oss;
-            oss << file_components[n++];
-            for (; n < file_components.size(); ++n) {
-                oss << "\r\n" << file_components[n];
+            this->valid = true;
+        }
+
+        /**
+         * moves the contents into an anonymous temp file in dir, with reserve
+         * bytes allocated up front so the file doesn't fragment as it grows.
+         * returns false if the file can't be created
+         */
+        bool spill_to(const std::string& dir, uint64_t reserve = 0)
+        {
+            if (this->fd >= 0) return true;
+
+            this->temp_dir = dir.empty() ? std::filesystem::temp_directory_path().string() : dir;
+            this->fd = open_temp(this->temp_dir);
+            if (this->fd < 0) return false;
+            if (reserve && fallocate(this->fd, FALLOC_FL_KEEP_SIZE, 0, reserve) == 0) this->reserved = reserve;
+
+            if (not write_all(this->fd, this->data)) return false;
+            this->data.clear();
+            this->data.shrink_to_fit();
+            return true;
+        }
+
+        /**
+         * starts hashing the contents appended from now on with sha256
+         */
+        bool hash_sha256()
+        {
+            this->hash.reset(EVP_MD_CTX_new());
+            return this->hash && EVP_DigestInit_ex(this->hash.get(), EVP_sha256(), nullptr) == 1;
+        }
+
+        /**
+         * appends a piece of the part's contents, moving them to a temp file
+         * in dir once they grow past spill bytes. returns false if the temp
+         * file can't be written
+         */
+        bool append(std::string_view piece, size_t spill, const std::string& dir)
+        {
+            if (piece.empty()) return true;
+
+            if (this->fd < 0 && this->size + piece.size() > spill && not this->spill_to(dir)) return false;
+
+            this->size += piece.size();
+            if (this->hash && EVP_DigestUpdate(this->hash.get(), piece.data(), piece.size()) != 1) return false;
+            if (this->fd >= 0) return write_all(this->fd, piece);
+            this->data += piece;
+            return true;
+        }
+
+        /**
+         * counts bytes written to the temp file behind the part's back, by splice
+         */
+        void appended(size_t count)
+        {
+            this->size += count;
+        }
+
+        /**
+         * called once the whole part was appended, fills in sha256 and gives
+         * back space reserved past the end of the file
+         */
+        bool finish()
+        {
+            if (this->fd >= 0 && this->reserved > this->size) {
+                if (ftruncate(this->fd, this->size) != 0) return false;
+            }
+            this->reserved = 0;
+
+            if (this->hash) {
+                unsigned char digest[EVP_MAX_MD_SIZE];
+                unsigned int length = 0;
+                bool good = EVP_DigestFinal_ex(this->hash.get(), digest, &length) == 1;
+                this->hash.reset();
+                if (not good) return false;
+
+                static const char hex[] = "0123456789abcdef";
+                this->sha256.clear();
+                for (unsigned int n = 0; n < length; ++n) {
+                    this->sha256 += hex[digest[n] >> 4];
+                    this->sha256 += hex[digest[n] & 15];
+                }
             }
+            return true;
+        }
 
-            this->data = oss.str();
-            valid = true;
+        /**
+         * true if the contents were spilled to a temp file
+         */
+        bool spilled() const
+        {
+            return this->fd >= 0;
         }
 
-        UploadedFile(const std::string& id, const std::string& name, const std::string& mime, const std::string& data)
-            : id(id), name(name), mime(mime), data(data)
+        /**
+         * returns the contents, reading them back from the temp file if they were spilled
+         */
+        std::string contents() const
         {
-            valid = true;
+            if (this->fd < 0) return this->data;
+
+            std::string out(this->size, '\0');
+            size_t got = 0;
+            while (got < out.size()) {
+                ssize_t status = pread(this->fd, out.data() + got, out.size() - got, got);
+                if (status < 0 && errno == EINTR) continue;
+                if (status <= 0) break;
+                got += status;
+            }
+            out.resize(got);
+            return out;
         }
 
-        // moveable
-        UploadedFile(UploadedFile&& file)
-            : id(file.id), name(file.name), mime(file.mime), data(std::move(file.data))
-        {}
+        /**
+         * writes the contents to dest, replacing it. a spilled part is linked
+         * into place without copying when dest is on the same filesystem
+         */
+        bool save(const std::filesystem::path& dest) const
+        {
+            if (this->fd < 0) {
+                std::ofstream out(dest, std::ios::binary | std::ios::trunc);
+                out.write(this->data.data(), this->data.size());
+                return out.good();
+            }
 
-        // not copyable
-        UploadedFile(UploadedFile& file) = delete;
-        UploadedFile(const UploadedFile& file) = delete;
-        UploadedFile& operator=(UploadedFile& file) = delete;
-        UploadedFile& operator=(const UploadedFile& file) = delete;
+            std::string proc = "/proc/self/fd/" + std::to_string(this->fd);
+            if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, dest.c_str(), AT_SYMLINK_FOLLOW) == 0) return true;
+            if (errno == EEXIST && unlink(dest.c_str()) == 0 &&
+                linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, dest.c_str(), AT_SYMLINK_FOLLOW) == 0) return true;
+
+            // another filesystem, or a temp file that can't be linked
+            int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out < 0) return false;
+            off_t offset = 0;
+            while (static_cast<size_t>(offset) < this->size) {
+                ssize_t sent = sendfile(out, this->fd, &offset, this->size - offset);
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent <= 0) break;
+            }
+            close(out);
+            return static_cast<size_t>(offset) == this->size;
+        }
+
+        /**
+         * links a spilled file into dir, or the directory its temp file is in,
+         * under its filename. a taken name gets a number added. sets and
+         * returns path, which is empty if the file couldn't be linked
+         */
+        std::filesystem::path keep(std::filesystem::path dir = {})
+        {
+            if (this->fd < 0 && not this->spill_to(dir.string())) return {};
+            if (dir.empty()) dir = this->temp_dir;
+
+            std::string base = filter_name(this->name);
+            if (base.empty() || base.find_first_not_of('.') == std::string::npos) base = "upload";
+
+            std::string proc = "/proc/self/fd/" + std::to_string(this->fd);
+            for (int n = 0; n < 1000; ++n) {
+                std::filesystem::path candidate = dir / (n ? std::to_string(n) + "-" + base : base);
+                if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, candidate.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+                    this->path = candidate;
+                    return this->path;
+                }
+                if (errno != EEXIST) break;
+            }
+            return {};
+        }
 
     private:
+        std::string temp_dir;   // where the temp file was created
+        uint64_t reserved = 0;  // bytes allocated for the temp file by fallocate
+        std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> hash{nullptr, EVP_MD_CTX_free};
+
+        // opens an unnamed file in dir, or a named one unlinked straight away
+        static int open_temp(const std::string& dir)
+        {
+            int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+            if (fd >= 0) return fd;
+
+            std::string name = dir + "/hussar-upload-XXXXXX";
+            fd = mkostemp(name.data(), O_CLOEXEC);
+            if (fd >= 0) unlink(name.c_str());
+            return fd;
+        }
+
+        static bool write_all(int fd, std::string_view data)
+        {
+            while (not data.empty()) {
+                ssize_t status = write(fd, data.data(), data.size());
+                if (status < 0 && errno == EINTR) continue;
+                if (status <= 0) return false;
+                data.remove_prefix(status);
+            }
+            return true;
+        }
+
         void parse_content_disposition(std::string& content) {
             std::vector<std::string> d_components = split_string<std::string>(content, "; ");
 
-            if (d_components[0] != "form-data") return;
+            if (d_components.empty() || d_components[0] != "form-data") return;
 
             for (size_t n = 1; n < d_components.size(); ++n) {
                 std::vector<std::string> attrib = split_string<std::string>(d_components[n], "=");
@@ -103,6 +339,7 @@ namespace hussar {
                     this->id = filter_name(value);
                 } else if (key == "filename") {
                     this->name = filter_name(value);
+                    this->is_file = true;
                 }
             }
         }
@@ -24,14 +24,19 @@
 #include <string>
 #include <vector>
 #include <mutex>
+#include <ctime>
+#include <optional>
 
 #define SERVER_NAME "hussar"
+#define HTTP_DATE_LEN 29
+#define STREAM_BUFFER 16384
+#define MAX_BYTE_RANGES 16
 
 #define hus hussar
 
 namespace hussar {
     std::mutex print_mtx;
-    std::unique_lock<std::mutex> print_lock(print_mtx);
+    std::mutex& print_lock = print_mtx;     // locked by every thread, so it can't be a shared unique_lock
     std::unordered_map<std::string, std::string> mimes = {
         {"woff", "font/woff"},
         {"woff2", "font/woff2"},
@@ -47,7 +52,10 @@ namespace hussar {
         {"jpg", "image/jpeg"},
         {"css", "text/css"},
         {"html", "text/html"},
-        {"txt", "text/plain"}
+        {"txt", "text/plain"},
+        {"json", "application/json"},
+        {"svg", "image/svg+xml"},
+        {"xml", "application/xml"}
     };
 
 
@@ -196,6 +204,62 @@ namespace hussar {
         return oss.str();
     }
 
+    /**
+     * strips spaces and tabs from both ends of str
+     */
+    std::string_view trim(std::string_view str)
+    {
+        while (str.size() && (str.front() == ' ' || str.front() == '\t')) str.remove_prefix(1);
+        while (str.size() && (str.back() == ' ' || str.back() == '\t')) str.remove_suffix(1);
+        return str;
+    }
+
+    /**
+     * 32 bit fnv-1a with a seed and a final mix, used for the perfect hash
+     * index of embedded assets, so it must not change between builds
+     */
+    constexpr uint32_t seeded_hash(std::string_view str, uint32_t seed)
+    {
+        uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+        for (char c : str) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    /**
+     * compares two strings ignoring ascii case
+     */
+    bool iequals(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size()) return false;
+        for (size_t n = 0; n < a.size(); ++n) {
+            if (std::tolower(static_cast<unsigned char>(a[n])) != std::tolower(static_cast<unsigned char>(b[n]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * returns true if a comma separated header value lists token, ignoring case
+     */
+    bool has_token(std::string_view list, std::string_view token)
+    {
+        while (not list.empty()) {
+            size_t end = list.find(',');
+            if (iequals(trim(list.substr(0, end)), token)) return true;
+            list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+        }
+        return false;
+    }
+
     /**
      * returns a string containing the mime time of the extension of the document string.
      */
@@ -213,6 +277,26 @@ namespace hussar {
         return mimeIter->second;
     }
 
+    /**
+     * returns the mime type of the extension of the last segment of a path,
+     * without building a filesystem path
+     */
+    const std::string& get_mime(std::string_view document) {
+        static const std::string fallback = "application/octet-stream";
+
+        size_t dot = document.rfind('.');
+        if (dot == std::string_view::npos || document.find('/', dot) != std::string_view::npos || dot + 1 == document.size()) {
+            return fallback;
+        }
+
+        auto mimeIter = mimes.find(std::string(document.substr(dot + 1)));
+        if (mimeIter == mimes.end()) {
+            return fallback;
+        }
+
+        return mimeIter->second;
+    }
+
     /**
      * splits the str into dest delimited by char c
      */
@@ -296,6 +380,111 @@ namespace hussar {
         return oss.str();
     }
 
+    /**
+     * writes t as an RFC 7231 date, "Sun, 06 Nov 1994 08:49:37 GMT", into dst.
+     * dst must have room for HTTP_DATE_LEN chars, no null terminator is written
+     */
+    void format_http_date(time_t t, char* dst)
+    {
+        static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+        static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+        std::tm gmt;
+        gmtime_r(&t, &gmt);
+
+        auto two = [](char* d, int v) {
+            d[0] = '0' + v / 10;
+            d[1] = '0' + v % 10;
+        };
+
+        std::memcpy(dst, days[gmt.tm_wday], 3);
+        std::memcpy(dst + 3, ", ", 2);
+        two(dst + 5, gmt.tm_mday);
+        dst[7] = ' ';
+        std::memcpy(dst + 8, months[gmt.tm_mon], 3);
+        dst[11] = ' ';
+        int year = gmt.tm_year + 1900;
+        two(dst + 12, year / 100);
+        two(dst + 14, year % 100);
+        dst[16] = ' ';
+        two(dst + 17, gmt.tm_hour);
+        dst[19] = ':';
+        two(dst + 20, gmt.tm_min);
+        dst[22] = ':';
+        two(dst + 23, gmt.tm_sec);
+        std::memcpy(dst + 25, " GMT", 4);
+    }
+
+    /**
+     * parses an HTTP date in the RFC 7231 format, or the obsolete RFC 850 and
+     * asctime formats, returns nothing if it isn't one
+     */
+    std::optional<time_t> parse_http_date(std::string_view text)
+    {
+        static const char* formats[] = {
+            "%a, %d %b %Y %H:%M:%S GMT",
+            "%A, %d-%b-%y %H:%M:%S GMT",
+            "%a %b %e %H:%M:%S %Y",
+        };
+
+        std::string copy(text);
+        for (const char* format : formats) {
+            std::tm tm{};
+            const char* end = strptime(copy.c_str(), format, &tm);
+            if (end && *end == '\0') return timegm(&tm);
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * returns true if etag is in the If-None-Match or If-Match style list,
+     * weak comparison ignores the W/ prefix of both sides
+     */
+    bool etag_matches(std::string_view list, std::string_view etag, bool weak)
+    {
+        if (weak && etag.starts_with("W/")) etag.remove_prefix(2);
+
+        while (not list.empty()) {
+            size_t end = list.find(',');
+            std::string_view tag = trim(list.substr(0, end));
+            list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+
+            if (tag == "*") return true;
+            if (weak && tag.starts_with("W/")) tag.remove_prefix(2);
+            if (tag == etag && not tag.starts_with("W/")) return true;
+        }
+        return false;
+    }
+
+    std::mutex http_date_mtx;
+    time_t http_date_second = -1;
+    char http_date_shared[HTTP_DATE_LEN];
+
+    /**
+     * returns the current date for the Date header.
+     *
+     * the date is formatted once per second into a shared buffer, each thread
+     * copies it once per second and otherwise reuses its own copy.
+     */
+    std::string_view http_date()
+    {
+        thread_local time_t second = -1;
+        thread_local char date[HTTP_DATE_LEN];
+
+        time_t now = std::time(nullptr);
+        if (now != second) {
+            std::lock_guard<std::mutex> lock(http_date_mtx);
+            if (http_date_second != now) {
+                format_http_date(now, http_date_shared);
+                http_date_second = now;
+            }
+            std::memcpy(date, http_date_shared, HTTP_DATE_LEN);
+            second = now;
+        }
+
+        return std::string_view(date, HTTP_DATE_LEN);
+    }
+
     /**
      * for fatal errors that should kill the program.
      */
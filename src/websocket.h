@@ -0,0 +1,556 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <openssl/evp.h>    // handshake digest
+#include <memory>
+#if defined(__SSE2__)
+#include <immintrin.h>      // unmask kernel
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "libs.h"
+#include "loop.h"
+#include "parked.h"
+#include "request.h"
+#include "response.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_MAX_MESSAGE 16777216  // bytes of a message, fragments included
+#define WEBSOCKET_MAX_QUEUE 8388608     // bytes waiting to be sent before a client is dropped as too slow
+#define WEBSOCKET_CLOSE_WAIT 5          // seconds a client has to answer a close
+
+namespace hussar {
+    enum class WsOpcode : uint8_t {
+        CONTINUATION = 0x0,
+        TEXT = 0x1,
+        BINARY = 0x2,
+        CLOSE = 0x8,
+        PING = 0x9,
+        PONG = 0xA
+    };
+
+    enum class WsClose : uint16_t {
+        NORMAL = 1000,
+        GOING_AWAY = 1001,
+        PROTOCOL = 1002,
+        UNSUPPORTED = 1003,
+        NO_STATUS = 1005,
+        INVALID_DATA = 1007,
+        POLICY = 1008,
+        TOO_BIG = 1009,
+        INTERNAL = 1011
+    };
+
+    /**
+     * xors a masked payload with its 4 byte key in place. the key is repeated
+     * across a vector register, or a 64 bit word without one, so all but the
+     * last few bytes are unmasked 16 or 32 at a time
+     */
+    void websocket_unmask(char* data, size_t size, const char* key)
+    {
+        uint32_t key32;
+        std::memcpy(&key32, key, sizeof(key32));
+        size_t n = 0;
+
+        // every stride is a multiple of 4, so byte n always lines up with key[n & 3]
+#if defined(__AVX2__)
+        __m256i key256 = _mm256_set1_epi32(static_cast<int>(key32));
+        for (; n + 32 <= size; n += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + n));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + n), _mm256_xor_si256(block, key256));
+        }
+#endif
+#if defined(__SSE2__)
+        __m128i key128 = _mm_set1_epi32(static_cast<int>(key32));
+        for (; n + 16 <= size; n += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + n));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(data + n), _mm_xor_si128(block, key128));
+        }
+#elif defined(__ARM_NEON)
+        uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+        for (; n + 16 <= size; n += 16) {
+            uint8_t* block = reinterpret_cast<uint8_t*>(data + n);
+            vst1q_u8(block, veorq_u8(vld1q_u8(block), key128));
+        }
+#endif
+        uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+        for (; n + 8 <= size; n += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + n, sizeof(word));
+            word ^= key64;
+            std::memcpy(data + n, &word, sizeof(word));
+        }
+        for (; n < size; ++n) {
+            data[n] ^= key[n & 3];
+        }
+    }
+
+    /**
+     * returns true if text is well formed UTF-8, ascii runs are skipped 8
+     * bytes at a time
+     */
+    bool valid_utf8(std::string_view text)
+    {
+        size_t n = 0;
+        while (n < text.size()) {
+            if (n + 8 <= text.size()) {
+                uint64_t word;
+                std::memcpy(&word, text.data() + n, sizeof(word));
+                if ((word & 0x8080808080808080ULL) == 0) {
+                    n += 8;
+                    continue;
+                }
+            }
+
+            unsigned char c = text[n];
+            if (c < 0x80) {
+                ++n;
+                continue;
+            }
+
+            size_t length;
+            uint32_t point;
+            uint32_t least;     // smallest code point of the length, anything lower is overlong
+            if ((c & 0xE0) == 0xC0) {
+                length = 2;
+                point = c & 0x1F;
+                least = 0x80;
+            } else if ((c & 0xF0) == 0xE0) {
+                length = 3;
+                point = c & 0x0F;
+                least = 0x800;
+            } else if ((c & 0xF8) == 0xF0) {
+                length = 4;
+                point = c & 0x07;
+                least = 0x10000;
+            } else {
+                return false;
+            }
+            if (n + length > text.size()) return false;
+
+            for (size_t k = 1; k < length; ++k) {
+                unsigned char next = text[n + k];
+                if ((next & 0xC0) != 0x80) return false;
+                point = (point << 6) | (next & 0x3F);
+            }
+            if (point < least || point > 0x10FFFF || (point >= 0xD800 && point <= 0xDFFF)) return false;
+            n += length;
+        }
+        return true;
+    }
+
+    /**
+     * returns a whole unmasked frame carrying payload, as a server sends it
+     */
+    std::string websocket_frame(WsOpcode opcode, std::string_view payload)
+    {
+        std::string frame;
+        frame.reserve(payload.size() + 10);
+        frame += static_cast<char>(0x80 | static_cast<uint8_t>(opcode));
+
+        uint64_t size = payload.size();
+        if (size < 126) {
+            frame += static_cast<char>(size);
+        } else if (size <= 0xFFFF) {
+            frame += static_cast<char>(126);
+            frame += static_cast<char>(size >> 8);
+            frame += static_cast<char>(size);
+        } else {
+            frame += static_cast<char>(127);
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                frame += static_cast<char>(size >> shift);
+            }
+        }
+
+        frame += payload;
+        return frame;
+    }
+
+    /**
+     * returns the Sec-WebSocket-Accept value answering a Sec-WebSocket-Key
+     */
+    std::string websocket_accept(std::string_view key)
+    {
+        std::string input(key);
+        input += WEBSOCKET_GUID;
+
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_Digest(input.data(), input.size(), digest, &length, EVP_sha1(), nullptr);
+
+        unsigned char encoded[EVP_MAX_MD_SIZE * 2];
+        int size = EVP_EncodeBlock(encoded, digest, length);
+        return std::string(reinterpret_cast<char*>(encoded), size);
+    }
+
+    /**
+     * answers the opening handshake of a websocket route. a request that
+     * isn't an upgrade to version 13 gets a 426 naming it, a good one gets
+     * 101 and the connection goes on as a websocket once it is sent
+     */
+    void websocket_handshake(Request& req, Response& resp)
+    {
+        if (req.version != "HTTP/1.1" || not has_token(req.header("Upgrade"), "websocket") ||
+            not has_token(req.header("Connection"), "upgrade") || req.header("Sec-WebSocket-Version") != "13") {
+            resp.code = "426";
+            resp.headers["Upgrade"] = "websocket";
+            resp.headers["Sec-WebSocket-Version"] = "13";
+            resp.body = "<h1>426: Upgrade Required!</h1>";
+            return;
+        }
+
+        // the key is 16 random bytes in base64, and a handshake has no body
+        std::string_view key = req.header("Sec-WebSocket-Key");
+        if (req.chunked() || req.declared_length().value_or(0) > 0 || key.size() != 24 || not key.ends_with("==") || key.substr(0, 22).find_first_not_of(
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/") != std::string_view::npos) {
+            resp.code = "400";
+            resp.body = "<h1>400: Bad Request!</h1>";
+            return;
+        }
+
+        resp.code = "101";
+        resp.headers.erase("Content-Type");
+        resp.headers["Upgrade"] = "websocket";
+        resp.headers["Connection"] = "Upgrade";
+        resp.headers["Sec-WebSocket-Accept"] = websocket_accept(key);
+
+        // the connection carries on after the response, as a websocket
+        req.keep_alive = true;
+    }
+
+    class WebSocket;
+
+    /**
+     * the callbacks of a websocket route. they are called on the io loop
+     * thread, so they must not block. on_message gets whole messages with
+     * their fragments joined, and whether the message is binary
+     */
+    struct WebSocketHandler {
+        std::function<void (WebSocket&)> on_open;
+        std::function<void (WebSocket&, std::string_view, bool)> on_message;
+        std::function<void (WebSocket&)> on_close;
+        size_t max_message = WEBSOCKET_MAX_MESSAGE;
+        size_t max_queue = WEBSOCKET_MAX_QUEUE;     // a client further behind than this is dropped
+    };
+
+    /**
+     * an upgraded connection, parked on the io loop rather than a pool thread.
+     *
+     * frames are parsed and unmasked where they were read, and sent frames
+     * are shared, not copied, between every socket they are queued to. send()
+     * and close() may be called from any thread.
+     */
+    class WebSocket : public ParkedSocket {
+    private:
+        std::shared_ptr<const WebSocketHandler> handler;
+        std::string input;              // the start of a frame that hasn't fully arrived
+        std::string message;            // fragments of the message being received
+        WsOpcode message_opcode;        // TEXT or BINARY while a fragmented message arrives
+        bool close_sent;
+        bool close_received;
+
+        template <typename F>
+        void guarded(F func)
+        {
+            try {
+                func();
+            } catch (...) {
+                this->fail(WsClose::INTERNAL);
+            }
+        }
+
+        void opened() override
+        {
+            if (this->handler->on_open) {
+                this->guarded([this] {
+                    this->handler->on_open(*this);
+                });
+            }
+        }
+
+        void ended() override
+        {
+            if (this->handler->on_close) this->handler->on_close(*this);
+        }
+
+        /**
+         * handles the frames in freshly read bytes. whole frames are handled
+         * where they are, only the start of an unfinished one is kept
+         */
+        void consume(char* data, size_t size) override
+        {
+            if (this->input.empty()) {
+                size_t used = this->parse(data, size);
+                if (not this->closed) this->input.assign(data + used, size - used);
+            } else {
+                this->input.append(data, size);
+                size_t used = this->parse(this->input.data(), this->input.size());
+                this->input.erase(0, used);
+            }
+
+            // don't hold on to the room a large message needed
+            if (this->input.empty() && this->input.capacity() > PARKED_READ_CHUNK) {
+                std::string().swap(this->input);
+            }
+        }
+        /**
+         * handles the whole frames at the start of data, returns the bytes they took
+         */
+        size_t parse(char* data, size_t size)
+        {
+            size_t at = 0;
+            while (not this->closed && not this->close_received && size - at >= 2) {
+                const unsigned char* head = reinterpret_cast<const unsigned char*>(data + at);
+                size_t available = size - at;
+                bool fin = head[0] & 0x80;
+                WsOpcode opcode = static_cast<WsOpcode>(head[0] & 0x0F);
+
+                // no extensions are negotiated and clients must mask what they send
+                if ((head[0] & 0x70) || not (head[1] & 0x80)) {
+                    this->fail(WsClose::PROTOCOL);
+                    break;
+                }
+
+                uint64_t length = head[1] & 0x7F;
+                size_t header = 2;
+                if (length == 126) {
+                    if (available < 4) break;
+                    length = (head[2] << 8) | head[3];
+                    header = 4;
+                } else if (length == 127) {
+                    if (available < 10) break;
+                    length = 0;
+                    for (size_t k = 2; k < 10; ++k) {
+                        length = (length << 8) | head[k];
+                    }
+                    header = 10;
+                }
+
+                // the limits are checked before waiting for the payload
+                bool control = static_cast<uint8_t>(opcode) & 0x8;
+                if (control && (length > 125 || not fin)) {
+                    this->fail(WsClose::PROTOCOL);
+                    break;
+                }
+                if (not control && length > this->handler->max_message - std::min(this->message.size(), this->handler->max_message)) {
+                    this->fail(WsClose::TOO_BIG);
+                    break;
+                }
+
+                if (available < header + 4 || available - header - 4 < length) break;
+                char* payload = data + at + header + 4;
+                websocket_unmask(payload, length, data + at + header);
+                at += header + 4 + length;
+                this->on_frame(opcode, fin, std::string_view(payload, length));
+            }
+            return at;
+        }
+
+        void on_frame(WsOpcode opcode, bool fin, std::string_view payload)
+        {
+            switch (opcode) {
+                case WsOpcode::TEXT:
+                case WsOpcode::BINARY:
+                    if (this->message_opcode != WsOpcode::CONTINUATION) {
+                        this->fail(WsClose::PROTOCOL);
+                    } else if (fin) {
+                        this->deliver(opcode, payload);
+                    } else {
+                        this->message_opcode = opcode;
+                        this->message.assign(payload);
+                    }
+                    break;
+                case WsOpcode::CONTINUATION:
+                    if (this->message_opcode == WsOpcode::CONTINUATION) {
+                        this->fail(WsClose::PROTOCOL);
+                        break;
+                    }
+                    this->message.append(payload);
+                    if (fin) {
+                        std::string whole = std::move(this->message);
+                        this->message.clear();
+                        opcode = this->message_opcode;
+                        this->message_opcode = WsOpcode::CONTINUATION;
+                        this->deliver(opcode, whole);
+                    }
+                    break;
+                case WsOpcode::PING:
+                    this->push(std::make_shared<const std::string>(websocket_frame(WsOpcode::PONG, payload)));
+                    break;
+                case WsOpcode::PONG:
+                    break;
+                case WsOpcode::CLOSE:
+                    this->on_close_frame(payload);
+                    break;
+                default:
+                    this->fail(WsClose::PROTOCOL);
+                    break;
+            }
+        }
+
+        void deliver(WsOpcode opcode, std::string_view payload)
+        {
+            if (opcode == WsOpcode::TEXT && not valid_utf8(payload)) {
+                this->fail(WsClose::INVALID_DATA);
+                return;
+            }
+
+            // messages after our close are discarded
+            if (this->close_sent || not this->handler->on_message) return;
+            this->guarded([&] {
+                this->handler->on_message(*this, payload, opcode == WsOpcode::BINARY);
+            });
+        }
+
+        void on_close_frame(std::string_view payload)
+        {
+            this->close_received = true;
+            if (payload.size() == 1) {
+                this->fail(WsClose::PROTOCOL);
+                return;
+            }
+            if (payload.size() >= 2) {
+                uint16_t code = (static_cast<unsigned char>(payload[0]) << 8) | static_cast<unsigned char>(payload[1]);
+                bool known = (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+                if (not known) {
+                    this->fail(WsClose::PROTOCOL);
+                    return;
+                }
+                if (not valid_utf8(payload.substr(2))) {
+                    this->fail(WsClose::INVALID_DATA);
+                    return;
+                }
+            }
+
+            // the status code is echoed back, then the server closes the connection first
+            this->send_close(payload.substr(0, std::min<size_t>(payload.size(), 2)));
+            this->finish();
+        }
+
+        void send_close(std::string_view payload)
+        {
+            if (this->close_sent) return;
+            this->push(std::make_shared<const std::string>(websocket_frame(WsOpcode::CLOSE, payload)));
+            this->close_sent = true;
+            this->running = false;
+        }
+
+        /**
+         * fails the connection, the close frame naming why goes out and the
+         * connection is closed without waiting for an answer
+         */
+        void fail(WsClose code)
+        {
+            if (this->closed) return;
+            uint16_t value = static_cast<uint16_t>(code);
+            char payload[2] = { static_cast<char>(value >> 8), static_cast<char>(value) };
+            this->send_close(std::string_view(payload, 2));
+            this->finish();
+        }
+
+    public:
+        WebSocket(int client, SSL* ssl, std::unique_ptr<Request> req, std::shared_ptr<const WebSocketHandler> handler)
+            : ParkedSocket(client, ssl, std::move(req), handler->max_queue, Overflow::DISCONNECT), handler(std::move(handler)),
+              message_opcode(WsOpcode::CONTINUATION), close_sent(false), close_received(false)
+        {}
+
+        /**
+         * sends a text or binary message, callable from any thread
+         */
+        void send(std::string_view message, bool binary = false)
+        {
+            this->send_frame(std::make_shared<const std::string>(websocket_frame(binary ? WsOpcode::BINARY : WsOpcode::TEXT, message)));
+        }
+
+        /**
+         * sends a frame made by websocket_frame(), so the same bytes can be
+         * sent to several clients. callable from any thread
+         */
+        void send_frame(std::shared_ptr<const std::string> frame)
+        {
+            this->send_bytes(std::move(frame));
+        }
+
+        /**
+         * starts the closing handshake, a client that doesn't answer within
+         * WEBSOCKET_CLOSE_WAIT seconds is disconnected. callable from any thread
+         */
+        void close(WsClose code = WsClose::NORMAL, std::string_view reason = {})
+        {
+            if (not io_loop.in_loop()) {
+                io_loop.post([self = std::static_pointer_cast<WebSocket>(this->shared_from_this()), code, reason = std::string(reason)] {
+                    self->close(code, reason);
+                });
+                return;
+            }
+            if (this->closed || this->close_sent) return;
+
+            uint16_t value = static_cast<uint16_t>(code);
+            std::string payload;
+            payload += static_cast<char>(value >> 8);
+            payload += static_cast<char>(value);
+            payload += reason.substr(0, 123);   // control frames carry at most 125 bytes
+            this->send_close(payload);
+
+            io_loop.after(std::chrono::seconds(WEBSOCKET_CLOSE_WAIT), [weak = this->weak_from_this()] {
+                if (auto self = weak.lock()) std::static_pointer_cast<WebSocket>(self)->drop();
+            });
+        }
+    };
+
+    /**
+     * a group of websockets that messages are broadcast to. a broadcast is
+     * framed once and the same frame is queued to every member, see Channel
+     */
+    class WebSocketChannel : public Channel {
+    public:
+        /**
+         * adds a websocket to the channel, callable from any thread
+         */
+        void join(WebSocket& ws)
+        {
+            this->add(ws);
+        }
+
+        /**
+         * removes a websocket from the channel, callable from any thread
+         */
+        void leave(WebSocket& ws)
+        {
+            this->remove(ws);
+        }
+
+        /**
+         * sends a text or binary message to every member, callable from any thread
+         */
+        void broadcast(std::string_view message, bool binary = false)
+        {
+            this->fan_out(std::make_shared<const std::string>(websocket_frame(binary ? WsOpcode::BINARY : WsOpcode::TEXT, message)));
+        }
+
+        /**
+         * sends a frame made by websocket_frame() to every member, callable from any thread
+         */
+        void broadcast_frame(std::shared_ptr<const std::string> frame)
+        {
+            this->fan_out(std::move(frame));
+        }
+    };
+};
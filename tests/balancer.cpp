@@ -0,0 +1,177 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "standin.h"
+
+using namespace std::chrono_literals;
+
+/**
+ * a stand-in upstream naming itself in every answer, that can be made to
+ * fail, answer slowly or fail its health checks
+ */
+struct Backend {
+    std::string name;
+    std::atomic<bool> fail{false};
+    std::atomic<bool> slow{false};
+    std::atomic<bool> down{false};
+    std::unique_ptr<StandIn> standin;
+
+    Backend(const std::string& name)
+        : name(name)
+    {
+        this->standin = std::make_unique<StandIn>([this](int fd, const std::string& head, const std::string&) {
+            std::string path = target(head);
+            std::string named = "X-Upstream: " + this->name + "\r\n";
+            if (path == "/health") return reply(fd, this->down ? "503 Service Unavailable" : "200 OK", "", named);
+            // too big to be buffered, so it stays in flight until its body is read
+            if (path == "/hold") return reply(fd, "200 OK", std::string(100'000, 'h'), named);
+            if (this->slow) std::this_thread::sleep_for(50ms);
+            return reply(fd, this->fail ? "500 Internal Server Error" : "200 OK", this->name, named);
+        });
+    }
+};
+
+std::vector<std::unique_ptr<Backend>> backends(int count)
+{
+    std::vector<std::unique_ptr<Backend>> made;
+    for (int n = 0; n < count; ++n) made.push_back(std::make_unique<Backend>(std::to_string(n)));
+    return made;
+}
+
+std::vector<std::string> addresses(const std::vector<std::unique_ptr<Backend>>& from)
+{
+    std::vector<std::string> made;
+    for (auto& b : from) made.push_back(b->standin->address);
+    return made;
+}
+
+/**
+ * sends count requests through the group one after another, returns how
+ * many each upstream answered
+ */
+std::map<std::string, int> spread(hussar::UpstreamGroup& group, int count, const std::string& method = "GET")
+{
+    std::map<std::string, int> served;
+    for (int n = 0; n < count; ++n) {
+        auto req = make_request(method, "/");
+        hussar::Response resp(*req);
+        group.forward(*req, resp);
+        ++served[resp.code == "502" ? "502" : resp.headers["X-Upstream"]];
+    }
+    return served;
+}
+
+int main()
+{
+    // round robin takes turns
+    {
+        auto b = backends(3);
+        hussar::UpstreamGroup group(addresses(b));
+        auto served = spread(group, 30);
+        CHECK(served["0"] == 10 && served["1"] == 10 && served["2"] == 10);
+    }
+
+    // least outstanding and power of two choices both avoid an upstream still sending a body
+    for (hussar::Balance policy : { hussar::Balance::LEAST_OUTSTANDING, hussar::Balance::POWER_OF_TWO }) {
+        auto b = backends(policy == hussar::Balance::POWER_OF_TWO ? 2 : 3);
+        hussar::UpstreamGroup group(addresses(b), { .policy = policy });
+
+        auto req = make_request("GET", "/hold");
+        auto held = std::make_unique<hussar::Response>(*req);
+        group.forward(*req, *held);
+        CHECK(held->streaming());
+        std::string busy = held->headers["X-Upstream"];
+
+        auto served = spread(group, 20);
+        CHECK(served[busy] == 0);
+
+        // once its body is sent it's picked again
+        response_body(*held);
+        held.reset();
+        served = spread(group, 30);
+        CHECK(served[busy] > 0);
+    }
+
+    // errors in a row eject an upstream, but no more than max_percent of the group
+    {
+        auto b = backends(3);
+        hussar::UpstreamGroup group(addresses(b), { .ejection = { .errors = 3, .base_time = 60s, .max_percent = 50 } });
+        b[2]->fail = true;
+        auto served = spread(group, 30);
+        CHECK(served["2"] == 3);
+        CHECK(group.available() == 2);
+
+        // past its error limit, but ejecting it too would take out two thirds
+        b[1]->fail = true;
+        served = spread(group, 20);
+        CHECK(served["1"] > 3);
+        CHECK(group.available() == 2);
+
+        // still ejected after it recovers, until the ejection ends
+        b[2]->fail = false;
+        served = spread(group, 20);
+        CHECK(served["2"] == 0);
+    }
+
+    // an upstream much slower than the rest is ejected
+    {
+        auto b = backends(3);
+        hussar::UpstreamGroup group(addresses(b), { .ejection = { .latency_factor = 3, .min_latency = 20ms, .base_time = 60s } });
+        b[1]->slow = true;
+        auto served = spread(group, 30);
+        CHECK(served["1"] <= 2);
+        CHECK(group.available() == 2);
+    }
+
+    // failed health checks take an upstream out, passing ones bring it back
+    {
+        auto b = backends(3);
+        {
+            hussar::UpstreamGroup group(addresses(b), {
+                .health = { .path = "/health", .interval = 50ms, .timeout = 500ms, .unhealthy = 2, .healthy = 2 }
+            });
+            b[0]->down = true;
+            std::this_thread::sleep_for(400ms);
+            CHECK(group.available() == 2);
+            auto served = spread(group, 20);
+            CHECK(served["0"] == 0);
+
+            b[0]->down = false;
+            std::this_thread::sleep_for(400ms);
+            CHECK(group.available() == 3);
+        }
+
+        // destroying the group stops its checks, a round already sent may still finish
+        std::this_thread::sleep_for(100ms);
+        int checked = b[1]->standin->requests;
+        std::this_thread::sleep_for(300ms);
+        CHECK(b[1]->standin->requests == checked);
+    }
+
+    // an idempotent request that can't reach one upstream is sent to another, a POST isn't
+    {
+        auto b = backends(1);
+        hussar::UpstreamGroup group({ closed_address(), b[0]->standin->address });
+        auto served = spread(group, 1, "POST");
+        CHECK(served["502"] == 1);
+        served = spread(group, 10);
+        CHECK(served["0"] == 10);
+    }
+
+    std::cout << (failures ? "balancer: FAILED" : "balancer: passed") << std::endl;
+    return failures ? 1 : 0;
+}
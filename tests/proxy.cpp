@@ -0,0 +1,211 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "standin.h"
+
+std::string big(200'000, 'b');
+std::atomic<int> vanished{0};
+
+// the stand-in's routes, each exercising a way an upstream can answer
+bool upstream(int fd, const std::string& head, const std::string& body)
+{
+    std::string path = target(head);
+    bool is_head = head.starts_with("HEAD ");
+
+    if (path == "/hello") return reply(fd, "200 OK", "hello", "Set-Cookie: a=1\r\nSet-Cookie: b=2\r\n");
+    if (path == "/echo") return reply(fd, "201 Created", body);
+
+    // answers, then closes the kept alive connection while it sits in the pool
+    if (path == "/stale") {
+        reply(fd, "200 OK", "stale");
+        return false;
+    }
+
+    // the first time it's asked, closes the connection without an answer
+    if (path == "/vanish") {
+        if (vanished++ % 2 == 0) return false;
+        return reply(fd, "200 OK", "again");
+    }
+
+    if (path == "/chunked") {
+        std::string out = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+        for (int n = 0; n < 3; ++n) out += "5\r\npart" + std::to_string(n) + "\r\n";
+        out += "0\r\n\r\n";
+        return send(fd, out.data(), out.size(), MSG_NOSIGNAL) > 0;
+    }
+
+    // no framing at all, the body ends with the connection
+    if (path == "/close") {
+        std::string out = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nuntil the end";
+        send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+        return false;
+    }
+
+    if (path == "/big") {
+        if (is_head) {
+            std::string out = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(big.size()) + "\r\n\r\n";
+            return send(fd, out.data(), out.size(), MSG_NOSIGNAL) > 0;
+        }
+        return reply(fd, "200 OK", big);
+    }
+
+    if (path == "/slow") {
+        std::this_thread::sleep_for(std::chrono::milliseconds(600));
+        return reply(fd, "200 OK", "late");
+    }
+
+    return reply(fd, "404 Not Found", "");
+}
+
+int main()
+{
+    StandIn tcp(&upstream);
+    StandIn local(&upstream, "/tmp/hussar-test-upstream.sock");
+    hussar::Upstream app(tcp.address);
+    hussar::Upstream unix_app(local.address);
+
+    // pooled connections are reused between requests
+    for (int n = 0; n < 3; ++n) {
+        auto req = make_request("GET", "/hello");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        CHECK(resp.code == "200");
+        CHECK(resp.body == "hello");
+        CHECK(resp.headers["Set-Cookie"] == "a=1\r\nSet-Cookie: b=2");
+    }
+    CHECK(tcp.accepted == 1);
+
+    for (int n = 0; n < 2; ++n) {
+        auto req = make_request("POST", "/echo", "over a unix socket");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(unix_app, *req, resp));
+        CHECK(resp.code == "201");
+        CHECK(resp.body == "over a unix socket");
+    }
+    CHECK(local.accepted == 1);
+
+    // a pooled connection the upstream closed is noticed before a request is sent on it.
+    // the POST couldn't be sent again, and without a body it goes out in a single write
+    {
+        auto req = make_request("GET", "/stale");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        auto post = make_request("POST", "/echo");
+        hussar::Response echoed(*post);
+        CHECK(hussar::proxy_request(app, *post, echoed));
+        CHECK(echoed.code == "201");
+        CHECK(tcp.accepted == 2);
+    }
+
+    // an idempotent request lost on a reused connection is sent again on a new one
+    {
+        auto req = make_request("GET", "/vanish");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        CHECK(resp.code == "200");
+        CHECK(resp.body == "again");
+        CHECK(vanished == 2);
+    }
+
+    // other requests aren't, they may have had an effect
+    {
+        auto warm = make_request("GET", "/hello");
+        hussar::Response warmed(*warm);
+        hussar::proxy_request(app, *warm, warmed);
+
+        auto req = make_request("POST", "/vanish", "body");
+        hussar::Response resp(*req);
+        CHECK(not hussar::proxy_request(app, *req, resp));
+        CHECK(resp.code == "502");
+        CHECK(vanished == 3);
+    }
+
+    // chunked and close delimited bodies are streamed to the client as they arrive
+    {
+        auto req = make_request("GET", "/chunked");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        CHECK(resp.streaming());
+        CHECK(not resp.stream_length);
+        CHECK(response_body(resp) == "part0part1part2");
+
+        int before = tcp.accepted;
+        auto next = make_request("GET", "/hello");
+        hussar::Response after(*next);
+        CHECK(hussar::proxy_request(app, *next, after));
+        CHECK(tcp.accepted == before);
+    }
+    {
+        auto req = make_request("GET", "/close");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        CHECK(resp.streaming());
+        CHECK(response_body(resp) == "until the end");
+    }
+
+    // bodies too big to buffer are streamed with their length
+    {
+        auto req = make_request("GET", "/big");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        CHECK(resp.streaming());
+        CHECK(resp.stream_length == big.size());
+        CHECK(response_body(resp) == big);
+    }
+
+    // a HEAD response keeps the length of the body it doesn't have
+    {
+        auto req = make_request("HEAD", "/big");
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        CHECK(resp.streaming());
+        CHECK(resp.stream_length == big.size());
+        CHECK(response_body(resp).empty());
+    }
+
+    // a client body that fails is the client's error, not the upstream's
+    for (ssize_t failure : { -1, -2, -3 }) {
+        auto req = make_request("POST", "/echo", "part");
+        req->body_source = [failure](std::string_view&) { return failure; };
+        hussar::Response resp(*req);
+        CHECK(hussar::proxy_request(app, *req, resp));
+        if (failure == -1) CHECK(resp.code == "200" && not req->keep_alive);
+        if (failure == -2) CHECK(resp.code == "400" && req->keep_alive);
+        if (failure == -3) CHECK(resp.code == "413" && req->keep_alive);
+    }
+
+    // an upstream that can't be reached is a 502, one that doesn't answer in time a 504
+    {
+        hussar::Upstream dead(closed_address());
+        auto req = make_request("GET", "/hello");
+        hussar::Response resp(*req);
+        CHECK(not hussar::proxy_request(dead, *req, resp));
+        CHECK(resp.code == "502");
+    }
+    {
+        hussar::Upstream slow(tcp.address, { .read_timeout = std::chrono::milliseconds(200) });
+        auto req = make_request("GET", "/slow");
+        hussar::Response resp(*req);
+        CHECK(not hussar::proxy_request(slow, *req, resp));
+        CHECK(resp.code == "504");
+    }
+
+    std::cout << (failures ? "proxy: FAILED" : "proxy: passed") << std::endl;
+    return failures ? 1 : 0;
+}
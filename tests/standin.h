@@ -0,0 +1,193 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "hussar.h"
+
+#include <sys/un.h>
+
+/**
+ * checks a condition, a failure is printed and counted without stopping the test
+ */
+int failures = 0;
+#define CHECK(cond) do { \
+        if (not (cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+/**
+ * a scripted upstream listening on 127.0.0.1 or a unix socket, with a
+ * thread per connection. the handler gets each request's head and body
+ * and writes whatever reply it wants to the socket, returning false
+ * closes the connection
+ */
+class StandIn {
+public:
+    using handler = std::function<bool (int fd, const std::string& head, const std::string& body)>;
+
+private:
+    int listener;
+    handler func;
+
+    void serve(int fd)
+    {
+        std::string input;
+        char buf[16384];
+        while (true) {
+            size_t end;
+            while ((end = input.find("\r\n\r\n")) == std::string::npos) {
+                ssize_t status = recv(fd, buf, sizeof(buf), 0);
+                if (status <= 0) {
+                    ::close(fd);
+                    return;
+                }
+                input.append(buf, status);
+            }
+            std::string head = input.substr(0, end + 4);
+            input.erase(0, end + 4);
+            ++this->requests;
+
+            // only bodies framed by Content-Length are sent by the tests
+            size_t length = 0;
+            size_t found = head.find("Content-Length: ");
+            if (found != std::string::npos) length = std::stoul(head.substr(found + 16));
+            while (input.size() < length) {
+                ssize_t status = recv(fd, buf, sizeof(buf), 0);
+                if (status <= 0) {
+                    ::close(fd);
+                    return;
+                }
+                input.append(buf, status);
+            }
+            std::string body = input.substr(0, length);
+            input.erase(0, length);
+
+            if (not this->func(fd, head, body)) {
+                ::close(fd);
+                return;
+            }
+        }
+    }
+
+public:
+    std::string address;
+    std::atomic<int> accepted{0};   // connections opened to the stand-in
+    std::atomic<int> requests{0};
+
+    StandIn(handler func, const std::string& unix_path = "")
+        : func(std::move(func))
+    {
+        if (unix_path.empty()) {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            this->listener = socket(AF_INET, SOCK_STREAM, 0);
+            socklen_t length = sizeof(addr);
+            if (bind(this->listener, reinterpret_cast<sockaddr*>(&addr), length) < 0) hussar::fatal_error("ERROR stand-in can't bind");
+            getsockname(this->listener, reinterpret_cast<sockaddr*>(&addr), &length);
+            this->address = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+        } else {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            unlink(unix_path.c_str());
+            std::strncpy(addr.sun_path, unix_path.c_str(), sizeof(addr.sun_path) - 1);
+            this->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (bind(this->listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) hussar::fatal_error("ERROR stand-in can't bind");
+            this->address = "unix:" + unix_path;
+        }
+        listen(this->listener, 64);
+
+        std::thread([this] {
+            int fd;
+            while ((fd = accept(this->listener, nullptr, nullptr)) >= 0) {
+                ++this->accepted;
+                std::thread(&StandIn::serve, this, fd).detach();
+            }
+        }).detach();
+    }
+
+    // delete copy constructors
+    StandIn(StandIn& s) = delete;
+    StandIn(const StandIn& s) = delete;
+    StandIn& operator=(StandIn& s) = delete;
+    StandIn& operator=(const StandIn& s) = delete;
+};
+
+/**
+ * writes a reply framed by Content-Length, returns false if the socket failed
+ */
+bool reply(int fd, const std::string& status, const std::string& body, const std::string& headers = "")
+{
+    std::string out = "HTTP/1.1 " + status + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+    return send(fd, out.data(), out.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(out.size());
+}
+
+/**
+ * the path of a request head
+ */
+std::string target(const std::string& head)
+{
+    size_t start = head.find(' ') + 1;
+    return head.substr(start, head.find(' ', start) - start);
+}
+
+/**
+ * an address nothing listens on
+ */
+std::string closed_address()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t length = sizeof(addr);
+    bind(fd, reinterpret_cast<sockaddr*>(&addr), length);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length);
+    ::close(fd);
+    return "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+}
+
+/**
+ * a request as the server would parse it
+ */
+std::unique_ptr<hussar::Request> make_request(const std::string& method, const std::string& path, const std::string& body = "")
+{
+    std::string raw = method + " " + path + " HTTP/1.1\r\nHost: test\r\nConnection: keep-alive\r\n";
+    if (not body.empty()) raw += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    raw += "\r\n" + body;
+    return std::make_unique<hussar::Request>(raw, "127.0.0.1");
+}
+
+/**
+ * the body of a response, running its streamer if it has one
+ */
+std::string response_body(hussar::Response& resp)
+{
+    if (not resp.streaming()) return resp.body;
+
+    std::string body;
+    hussar::ResponseWriter w([&body](iovec* iov, int count) {
+        for (int n = 0; n < count; ++n) body.append(static_cast<char*>(iov[n].iov_base), iov[n].iov_len);
+        return true;
+    }, false);
+    resp.streamer(w);
+    w.flush();
+    return body;
+}
@@ -0,0 +1,253 @@
+/**
+*     Copyright (C) 2022 Mason Soroka-Gill
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * packs a directory into a header for compiling into hussar, see `make bundle`.
+ *
+ * every file becomes a byte array with its mime type, ETag and, when it
+ * shrinks, a gzipped copy worked out here, plus a perfect hash index of the
+ * paths, so serving an asset needs no I/O and no work at startup.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/compress.h"
+#include "../src/docroot.h"
+
+#define EMBED_LINE 76           // bytes of a file per line of generated source
+#define EMBED_MAX_ATTEMPTS 1'000'000 // seeds tried per bucket before growing the table
+
+namespace fs = std::filesystem;
+
+struct Asset {
+    std::string path;
+    std::string mime;
+    std::string etag;
+    std::string body;
+    std::string gzip;
+};
+
+/**
+ * 64 bit fnv-1a of the contents, the ETag only changes when the bytes do
+ */
+std::string content_etag(std::string_view data)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (char c : data) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ull;
+    }
+    char tag[24];
+    std::snprintf(tag, sizeof(tag), "\"%016llx\"", static_cast<unsigned long long>(h));
+    return tag;
+}
+
+/**
+ * quotes data as a string literal, bytes that aren't printable are escaped
+ * in octal with all three digits so a following digit can't extend the escape
+ */
+std::string quote(std::string_view data)
+{
+    std::string literal = "\"";
+    for (char c : data) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        if (byte >= 0x20 && byte < 0x7f && c != '"' && c != '\\' && c != '?') {
+            literal += c;
+        } else {
+            char escape[5];
+            std::snprintf(escape, sizeof(escape), "\\%03o", byte);
+            literal += escape;
+        }
+    }
+    literal += '"';
+    return literal;
+}
+
+/**
+ * writes data as a string literal split over lines
+ */
+void write_literal(std::ostream& out, std::string_view data)
+{
+    if (data.empty()) out << " \"\"";
+    for (size_t n = 0; n < data.size(); n += EMBED_LINE) {
+        out << "\n        " << quote(data.substr(n, EMBED_LINE));
+    }
+}
+
+/**
+ * searches for a seed per bucket so every path lands in its own slot,
+ * largest buckets first. returns false if some bucket ran out of seeds
+ */
+bool build_index(const std::vector<Asset>& assets, size_t buckets, size_t table_size,
+    std::vector<uint32_t>& seeds, std::vector<int32_t>& slots)
+{
+    std::vector<std::vector<int32_t>> members(buckets);
+    for (size_t n = 0; n < assets.size(); ++n) {
+        members[hussar::seeded_hash(assets[n].path, 0) % buckets].push_back(n);
+    }
+
+    std::vector<size_t> order(buckets);
+    for (size_t n = 0; n < buckets; ++n) order[n] = n;
+    std::stable_sort(order.begin(), order.end(), [&members](size_t a, size_t b) {
+        return members[a].size() > members[b].size();
+    });
+
+    seeds.assign(buckets, 0);
+    slots.assign(table_size, -1);
+    std::vector<size_t> taken;
+    for (size_t bucket : order) {
+        if (members[bucket].empty()) break;
+
+        bool placed = false;
+        for (uint32_t seed = 1; seed <= EMBED_MAX_ATTEMPTS && not placed; ++seed) {
+            taken.clear();
+            placed = true;
+            for (int32_t asset : members[bucket]) {
+                size_t slot = hussar::seeded_hash(assets[asset].path, seed) % table_size;
+                if (slots[slot] >= 0 || std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                    placed = false;
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (placed) {
+                seeds[bucket] = seed;
+                for (size_t n = 0; n < taken.size(); ++n) slots[taken[n]] = members[bucket][n];
+            }
+        }
+        if (not placed) return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <directory> <output header>\n";
+        return 1;
+    }
+
+    fs::path root = argv[1];
+    if (not fs::is_directory(root)) {
+        std::cerr << "Error: " << root.string() << " is not a directory\n";
+        return 1;
+    }
+
+    std::vector<Asset> assets;
+    for (const auto& entry : fs::recursive_directory_iterator(root)) {
+        if (not entry.is_regular_file()) continue;
+
+        Asset asset;
+        asset.path = entry.path().lexically_relative(root).generic_string();
+        if (asset.path.size() >= DOCROOT_PATH_MAX) {
+            std::cerr << "Warning: skipping " << asset.path << ", the path is too long to be requested\n";
+            continue;
+        }
+
+        std::ifstream file(entry.path(), std::ios::binary);
+        asset.body.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (not file.good() && not file.eof()) {
+            std::cerr << "Error: could not read " << entry.path().string() << "\n";
+            return 1;
+        }
+
+        asset.mime = hussar::get_mime(std::string_view(asset.path));
+        asset.etag = content_etag(asset.body);
+        if (hussar::compressible(asset.mime)) {
+            auto gz = hussar::gzip(asset.body, 9);
+            if (gz && gz->size() < asset.body.size()) asset.gzip = std::move(*gz);
+        }
+        assets.push_back(std::move(asset));
+    }
+
+    // sorted so the output only changes when the files do
+    std::sort(assets.begin(), assets.end(), [](const Asset& a, const Asset& b) {
+        return a.path < b.path;
+    });
+
+    std::vector<uint32_t> seeds = { 0 };
+    std::vector<int32_t> slots = { -1 };
+    if (not assets.empty()) {
+        size_t buckets = (assets.size() + 3) / 4;
+        size_t table_size = assets.size() + assets.size() / 4 + 1;
+        while (not build_index(assets, buckets, table_size, seeds, slots)) {
+            table_size += table_size / 4 + 1;
+        }
+    }
+
+    std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    if (not out) {
+        std::cerr << "Error: could not write " << argv[2] << "\n";
+        return 1;
+    }
+
+    out << "// generated by tools/embed.cpp from " << root.generic_string() << ", do not edit\n\n";
+    out << "#pragma once\n\n#include \"embedded.h\"\n\nnamespace hussar {\n";
+
+    for (size_t n = 0; n < assets.size(); ++n) {
+        out << "    // " << quote(assets[n].path) << "\n";
+        out << "    inline constexpr char embedded_body_" << n << "[] =";
+        write_literal(out, assets[n].body);
+        out << ";\n";
+        if (not assets[n].gzip.empty()) {
+            out << "    inline constexpr char embedded_gzip_" << n << "[] =";
+            write_literal(out, assets[n].gzip);
+            out << ";\n";
+        }
+        out << "\n";
+    }
+
+    out << "    inline constexpr EmbeddedAsset embedded_asset_list[] = {\n";
+    for (size_t n = 0; n < assets.size(); ++n) {
+        const Asset& a = assets[n];
+        out << "        { std::string_view(" << quote(a.path) << ", " << a.path.size() << "),\n";
+        out << "          " << quote(a.mime) << ", " << quote(a.etag) << ",\n";
+        out << "          std::string_view(embedded_body_" << n << ", " << a.body.size() << "),\n";
+        if (a.gzip.empty()) {
+            out << "          std::string_view() },\n";
+        } else {
+            out << "          std::string_view(embedded_gzip_" << n << ", " << a.gzip.size() << ") },\n";
+        }
+    }
+    if (assets.empty()) out << "        {},\n";
+    out << "    };\n\n";
+
+    out << "    inline constexpr uint32_t embedded_seeds[] = {";
+    for (size_t n = 0; n < seeds.size(); ++n) out << (n % 12 ? " " : "\n        ") << seeds[n] << ",";
+    out << "\n    };\n\n";
+
+    out << "    inline constexpr int32_t embedded_slots[] = {";
+    for (size_t n = 0; n < slots.size(); ++n) out << (n % 12 ? " " : "\n        ") << slots[n] << ",";
+    out << "\n    };\n\n";
+
+    out << "    inline constexpr EmbeddedBundle embedded_assets = {\n";
+    out << "        embedded_asset_list, " << assets.size() << ",\n";
+    out << "        embedded_seeds, " << seeds.size() << ",\n";
+    out << "        embedded_slots, " << slots.size() << ",\n";
+    out << "    };\n};\n";
+
+    if (not out) {
+        std::cerr << "Error: could not write " << argv[2] << "\n";
+        return 1;
+    }
+
+    std::cout << "Embedded " << assets.size() << " files from " << root.string() << " into " << argv[2] << "\n";
+    return 0;
+}